@@ -0,0 +1,378 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common/Benchmark.h"
+#include "diffusion/Diffusion.h"
+#include "diffusion/DiffusionKernel.h"
+#include "lennardjones/LennardJones.h"
+#include "riemann/RiemannSum.h"
+#ifdef _OPENMP
+#include <omp.h>
+#include "diffusion/RandomWalk.h"
+#include "metropolis/RigidDisks.h"
+#endif
+#ifdef HPCSE_USE_MPI
+#include "common/Mpi.h"
+#include "diffusion/DiffusionMPI.h"
+#include "vortex/Vortex.h"
+#endif
+
+using namespace hpcse;
+
+namespace {
+
+/// Grid dimension of the diffusion row kernels, large enough to stream from
+/// memory rather than cache.
+constexpr unsigned kRowDim = 2048;
+
+/// Grid dimension and number of steps of the full diffusion solvers.
+constexpr unsigned kSolverDim = 512;
+constexpr unsigned kSolverSteps = 50;
+
+constexpr size_t kLennardJonesParticles = 1 << 20;
+
+/// One sweep of DiffuseRow over a grid stored as T, using the given
+/// instruction set.
+template <typename T>
+void RegisterDiffusionRows(BenchmarkRegistry &registry, std::string name,
+                           const SimdIsa isa) {
+  const double cells = static_cast<double>(kRowDim - 2) * (kRowDim - 2);
+  registry.Register(name, "cells", cells, [isa]() {
+    auto grid = std::make_shared<Grid<T>>(kRowDim, kRowDim, 0,
+                                          FromFloat<T>(0.5f));
+    auto buffer = std::make_shared<Grid<T>>(*grid);
+    return [isa, grid, buffer]() {
+      SetDiffusionIsa(isa);
+      const int iEnd = kRowDim - 1;
+      for (int i = 1; i < iEnd; ++i) {
+        DiffuseRow(0.25f, (*grid)[i - 1], (*grid)[i], (*grid)[i + 1],
+                   (*buffer)[i], 1, iEnd);
+      }
+      grid->swap(*buffer);
+    };
+  });
+}
+
+void RegisterDiffusion(BenchmarkRegistry &registry, const unsigned nThreads) {
+  const SimdIsa best = DetectSimdIsa();
+  for (int isa = static_cast<int>(SimdIsa::scalar);
+       isa <= static_cast<int>(best); ++isa) {
+    RegisterDiffusionRows<float>(
+        registry,
+        std::string("diffusion/row/") + SimdIsaName(static_cast<SimdIsa>(isa)),
+        static_cast<SimdIsa>(isa));
+  }
+  RegisterDiffusionRows<Half>(registry, "diffusion/row/float16", best);
+  RegisterDiffusionRows<BFloat16>(registry, "diffusion/row/bfloat16", best);
+
+  // Full solvers run kSolverSteps steps at the stability limit of the explicit
+  // solvers, discarding the snapshots
+  const float ds = 2. / kSolverDim;
+  const float dt = 0.25 * ds * ds;
+  const std::vector<float> snapshots{kSolverSteps * dt};
+  const double cellSteps =
+      static_cast<double>(kSolverDim) * kSolverDim * kSolverSteps;
+  const SnapshotSink_t discard = [](size_t, float, Grid_t const &) {};
+  auto solver = [&](std::string const &name, const unsigned threads,
+                    std::function<void()> const &run) {
+    registry.Register(
+        "diffusion/" + name, "cells", cellSteps,
+        [best, run]() {
+          return [best, run]() {
+            SetDiffusionIsa(best);
+            run();
+          };
+        },
+        threads);
+  };
+  // The sequential solver parallelizes its loops over the default OpenMP team
+#ifdef _OPENMP
+  const unsigned teamSize = omp_get_max_threads();
+#else
+  const unsigned teamSize = 1;
+#endif
+  solver("sequential", teamSize, [=]() {
+    Diffusion(kSolverDim, 1, dt, snapshots, discard);
+  });
+  solver("blocked", nThreads, [=]() {
+    DiffusionBlocked(nThreads, kSolverDim, 1, dt, snapshots, 8, discard);
+  });
+  solver("threaded", nThreads, [=]() {
+    Diffusion(nThreads, kSolverDim, 1, dt, snapshots, discard);
+  });
+  solver("adi", nThreads, [=]() {
+    DiffusionImplicit(nThreads, kSolverDim, 1, dt, snapshots, discard);
+  });
+  solver("multigrid", nThreads, [=]() {
+    DiffusionMultigrid(nThreads, kSolverDim, 1, dt, snapshots, discard);
+  });
+  // The spectral solver jumps straight to the snapshot, so its work is one
+  // evaluation of the grid
+  registry.Register(
+      "diffusion/spectral", "cells",
+      static_cast<double>(kSolverDim) * kSolverDim,
+      [=]() {
+        return [=]() {
+          DiffusionSpectral(nThreads, kSolverDim, 1, snapshots, discard);
+        };
+      },
+      nThreads);
+}
+
+void RegisterLennardJones(BenchmarkRegistry &registry) {
+  using Container_t = LennardJones::ContainerType;
+  using Member_t = float (LennardJones::*)(
+      LennardJones::ContainerItr, LennardJones::ContainerItr,
+      LennardJones::ContainerItr, std::pair<float, float> const &) const;
+  // Every call computes the interactions of both the old and the new position
+  // of the last particle with all other particles
+  auto variant = [&registry](std::string const &name, const Member_t diff) {
+    const double pairs = 2 * (kLennardJonesParticles - 1);
+    registry.Register("lennardjones/" + name, "pairs", pairs, [diff]() {
+      std::mt19937 rng(42);
+      std::uniform_real_distribution<float> uniform(0, 1);
+      auto x = std::make_shared<Container_t>(kLennardJonesParticles);
+      auto y = std::make_shared<Container_t>(kLennardJonesParticles);
+      for (size_t i = 0; i < kLennardJonesParticles; ++i) {
+        (*x)[i] = uniform(rng);
+        (*y)[i] = uniform(rng);
+      }
+      auto lennardJones = std::make_shared<LennardJones>(0.1, 5.0);
+      return [diff, x, y, lennardJones]() {
+        const float energy = ((*lennardJones).*diff)(
+            x->cbegin(), x->cend(), y->cbegin(), {0.5f, 0.5f});
+        KeepResult(energy);
+      };
+    });
+  };
+  variant("diff", &LennardJones::Diff);
+  variant("diff_autovec", &LennardJones::DiffAutoVec);
+#ifdef __AVX__
+  variant("diff_avx", &LennardJones::DiffAvx);
+#endif
+}
+
+void RegisterRiemann(BenchmarkRegistry &registry, const unsigned nThreads) {
+  const int n = (1 << 24) / nThreads * nThreads;
+  registry.Register(
+      "riemann/parallel", "samples", n,
+      [n, nThreads]() {
+        return [n, nThreads]() {
+          const double integral = RiemannParallel(
+              [](double x) { return std::sqrt(x) * std::log(x); }, 1, 2, n,
+              nThreads);
+          KeepResult(integral);
+        };
+      },
+      nThreads);
+}
+
+#ifdef _OPENMP
+void RegisterMonteCarlo(BenchmarkRegistry &registry,
+                        const unsigned nThreads) {
+  constexpr unsigned kWalks = 1 << 12;
+  registry.Register(
+      "randomwalk", "walks", kWalks,
+      [nThreads]() {
+        return [nThreads]() {
+          const auto result =
+              RandomWalk(nThreads, kWalks, 0.01, {0.3, 0.4}, {0, 1}, {0, 1},
+                         [](float x, float) { return x; });
+          KeepResult(result);
+        };
+      },
+      nThreads);
+  // Dominated by the histogram of all pair distances taken at every step
+  constexpr unsigned kDisksX = 20, kDisksY = 23, kSteps = 10;
+  constexpr double kDisks = kDisksX * kDisksY;
+  registry.Register(
+      "rigiddisks", "pairs", kSteps * kDisks * (kDisks - 1) / 2,
+      [nThreads]() {
+        return [nThreads]() {
+          const auto histogram =
+              RigidDisks(nThreads, kDisksX, kDisksY, 1, 0.5, 1, kSteps, 64);
+          KeepResult(histogram);
+        };
+      },
+      nThreads);
+}
+#endif
+
+#ifdef HPCSE_USE_MPI
+/// Registers a benchmark run by all ranks together. The setup waits for rank 0
+/// to finish the single-rank benchmarks before it without occupying cores.
+/// Counters are taken over all CPUs, so they include the other ranks on the
+/// node of rank 0.
+void RegisterCollective(BenchmarkRegistry &registry, std::string name,
+                        std::string unit, const double work,
+                        BenchmarkRegistry::Kernel_t run) {
+  registry.Register(
+      std::move(name), std::move(unit), work,
+      [run]() {
+        mpi::IdleBarrier();
+        return run;
+      },
+      static_cast<unsigned>(mpi::size()));
+}
+
+/// The distributed diffusion solvers with one thread per rank, on the grid
+/// and for the steps of the shared memory solvers.
+void RegisterDiffusionMpi(BenchmarkRegistry &registry) {
+  const float ds = 2. / kSolverDim;
+  const float dt = 0.25 * ds * ds;
+  const std::vector<float> snapshots{kSolverSteps * dt};
+  const double cellSteps =
+      static_cast<double>(kSolverDim) * kSolverDim * kSolverSteps;
+  const SnapshotSink_t discard = [](size_t, float, Grid_t const &) {};
+  const SimdIsa best = DetectSimdIsa();
+  RegisterCollective(registry, "diffusion/rows", "cells", cellSteps, [=]() {
+    SetDiffusionIsa(best);
+    DiffusionRows(kSolverDim, 1, dt, snapshots, discard);
+  });
+  RegisterCollective(registry, "diffusion/grid", "cells", cellSteps, [=]() {
+    SetDiffusionIsa(best);
+    DiffusionGrid(kSolverDim, 1, dt, snapshots, discard);
+  });
+}
+
+void RegisterVortex(BenchmarkRegistry &registry) {
+  constexpr int kVortices = 2000;
+  constexpr int kSteps = 10;
+  constexpr float kTimestep = 1e-3;
+  RegisterCollective(
+      registry, "vortex", "pairs",
+      static_cast<double>(kVortices) * kVortices * kSteps, []() {
+        const auto snapshots =
+            Vortex(kVortices, 1, kTimestep, {kSteps * kTimestep});
+        KeepResult(snapshots);
+      });
+}
+#endif
+
+} // End anonymous namespace
+
+int main(int argc, char *argv[]) {
+#ifdef HPCSE_USE_MPI
+  // Benchmarks of the distributed solvers run on all ranks, and all others
+  // only on rank 0, which reports. Other ranks sleep in the meantime, so the
+  // threaded benchmarks have the cores to themselves
+  mpi::Context context(argc, argv);
+  const bool report = mpi::rank() == 0;
+#else
+  const bool report = true;
+#endif
+
+  BenchmarkSettings settings;
+  std::string filter;
+  std::string outPath("benchmarks.json");
+  unsigned nThreads = std::max(1u, std::thread::hardware_concurrency());
+  bool list = false;
+  for (; argc > 1 && std::string(argv[1]).compare(0, 2, "--") == 0;
+       --argc, ++argv) {
+    const std::string flag(argv[1]);
+    if (flag.compare(0, 9, "--filter=") == 0) {
+      filter = flag.substr(9);
+    } else if (flag.compare(0, 14, "--repetitions=") == 0) {
+      settings.repetitions = std::stoi(flag.substr(14));
+    } else if (flag.compare(0, 9, "--warmup=") == 0) {
+      settings.warmup = std::stoi(flag.substr(9));
+    } else if (flag.compare(0, 10, "--threads=") == 0) {
+      nThreads = std::max(1, std::stoi(flag.substr(10)));
+    } else if (flag.compare(0, 9, "--output=") == 0) {
+      outPath = flag.substr(9);
+    } else if (flag == "--list") {
+      list = true;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
+  if (argc != 1) {
+    if (report) {
+      std::cerr << "Usage: [--filter=<substring of names>] "
+                   "[--repetitions=<timed runs>] [--warmup=<untimed runs>] "
+                   "[--threads=<threads>] [--output=<JSON file>] [--list]"
+                << std::endl;
+    }
+    return 1;
+  }
+
+  BenchmarkRegistry registry;
+  if (report) {
+    RegisterDiffusion(registry, nThreads);
+    RegisterLennardJones(registry);
+    RegisterRiemann(registry, nThreads);
+#ifdef _OPENMP
+    RegisterMonteCarlo(registry, nThreads);
+#endif
+  }
+#ifdef HPCSE_USE_MPI
+  RegisterDiffusionMpi(registry);
+  RegisterVortex(registry);
+#endif
+  if (list) {
+    for (auto &name : registry.Names()) {
+      if (report && name.find(filter) != std::string::npos) {
+        std::cout << name << "\n";
+      }
+    }
+    return 0;
+  }
+
+  auto results = registry.Run(
+      settings, filter, [report](BenchmarkResult const &result) {
+        if (report) {
+          std::cout << std::left << std::setw(28) << result.name << std::right
+                    << std::setw(12) << std::setprecision(4)
+                    << 1e3 * result.median << " ms  " << std::setw(12)
+                    << result.throughput << " " << result.unit << "/s";
+          // Measured operations, if the hardware counters provide them
+          for (auto &counter : result.counters) {
+            if (counter.first == "flops") {
+              std::cout << "  " << 1e-9 * counter.second / result.median
+                        << " GFLOP/s";
+            } else if (counter.first == "flops_per_byte") {
+              std::cout << "  " << counter.second << " FLOP/B";
+            }
+          }
+          if (result.counterScope == "omitted") {
+            std::cout << "  (counters omitted: multithreaded)";
+          }
+          std::cout << (result.rejected > 0
+                            ? "  (" + std::to_string(result.rejected) +
+                                  " outliers)"
+                            : "")
+                    << std::endl;
+        }
+      });
+  if (report) {
+    std::vector<std::pair<std::string, std::string>> description{
+        {"compiler", __VERSION__},
+        {"simd", SimdIsaName(DetectSimdIsa())},
+        {"threads", std::to_string(nThreads)},
+        {"perf_counters",
+         PerfCounters(PerfCounters::Scope::allCpus).available()
+             ? "available"
+             : PerfCounters().available() ? "single threaded only"
+                                          : "unavailable"},
+        {"warmup", std::to_string(settings.warmup)}};
+#ifdef HPCSE_USE_MPI
+    description.emplace_back("ranks", std::to_string(mpi::size()));
+#endif
+    std::ofstream outFile(outPath);
+    WriteBenchmarkJson(outFile, results, description);
+    std::cout << "Wrote " << results.size() << " result(s) to " << outPath
+              << "." << std::endl;
+  }
+#ifdef HPCSE_USE_MPI
+  mpi::IdleBarrier();
+#endif
+  return 0;
+}
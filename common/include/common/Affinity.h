@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace hpcse {
+
+/// Placement of worker threads on CPUs. Compact fills the CPUs of one NUMA
+/// node before moving on to the next, while scatter assigns consecutive
+/// workers to different nodes in turn. An explicit list assigns worker i to the
+/// i-th CPU of the list. Workers beyond the number of CPUs wrap around.
+class ThreadAffinity {
+
+public:
+  enum class Policy {
+    none,
+    compact,
+    scatter,
+    list
+  };
+
+  /// No pinning.
+  inline ThreadAffinity();
+
+  static inline ThreadAffinity Compact();
+
+  static inline ThreadAffinity Scatter();
+
+  static inline ThreadAffinity List(std::vector<int> const &cpus);
+
+  /// Parses "none", "compact", "scatter" or a CPU list such as "0-3,8,10".
+  /// Throws std::invalid_argument for malformed input.
+  static inline ThreadAffinity Parse(std::string const &description);
+
+  inline Policy policy() const;
+
+  /// CPU assigned to the given worker, or -1 without pinning.
+  inline int Cpu(int worker) const;
+
+  /// Pins the calling thread to the CPU of the given worker. Returns false if
+  /// the thread was not pinned.
+  inline bool Pin(int worker) const;
+
+  static inline std::vector<int> ParseCpuList(std::string const &list);
+
+private:
+  inline ThreadAffinity(Policy policy, std::vector<int> cpus);
+
+  /// CPUs the process may run on, ordered by NUMA node, then physical core,
+  /// then CPU number.
+  static inline std::vector<int> CompactOrder();
+
+  /// NUMA node of each of the given CPUs.
+  static inline std::vector<int> NodeOf(std::vector<int> const &cpus);
+
+  Policy policy_;
+  std::vector<int> cpus_;
+};
+
+/// Pins the calling thread to the CPU of a worker for the lifetime of the
+/// object and restores its previous CPU mask afterwards, so that threads
+/// borrowed from a shared pool are handed back unpinned.
+class ScopedPin {
+
+public:
+  inline ScopedPin(ThreadAffinity const &affinity, int worker);
+
+  inline ~ScopedPin();
+
+  ScopedPin(ScopedPin const &) = delete;
+  ScopedPin &operator=(ScopedPin const &) = delete;
+
+private:
+  bool pinned_{false};
+#ifdef __linux__
+  cpu_set_t previous_{};
+#endif
+};
+
+ThreadAffinity::ThreadAffinity() : ThreadAffinity(Policy::none, {}) {}
+
+ThreadAffinity::ThreadAffinity(const Policy policy, std::vector<int> cpus)
+    : policy_(policy), cpus_(std::move(cpus)) {}
+
+ThreadAffinity ThreadAffinity::Compact() {
+  return ThreadAffinity(Policy::compact, CompactOrder());
+}
+
+ThreadAffinity ThreadAffinity::Scatter() {
+  const auto compact = CompactOrder();
+  const auto nodes = NodeOf(compact);
+  // Deal the CPUs of each node out in turn
+  std::vector<std::vector<int>> perNode;
+  for (size_t i = 0; i < compact.size(); ++i) {
+    if (nodes[i] >= static_cast<int>(perNode.size())) {
+      perNode.resize(nodes[i] + 1);
+    }
+    perNode[nodes[i]].emplace_back(compact[i]);
+  }
+  std::vector<int> cpus;
+  for (size_t round = 0; cpus.size() < compact.size(); ++round) {
+    for (auto &node : perNode) {
+      if (round < node.size()) {
+        cpus.emplace_back(node[round]);
+      }
+    }
+  }
+  return ThreadAffinity(Policy::scatter, cpus);
+}
+
+ThreadAffinity ThreadAffinity::List(std::vector<int> const &cpus) {
+  if (cpus.empty()) {
+    throw std::invalid_argument("CPU list must not be empty.");
+  }
+  return ThreadAffinity(Policy::list, cpus);
+}
+
+ThreadAffinity ThreadAffinity::Parse(std::string const &description) {
+  if (description.empty() || description == "none") {
+    return ThreadAffinity();
+  }
+  if (description == "compact") {
+    return Compact();
+  }
+  if (description == "scatter") {
+    return Scatter();
+  }
+  return List(ParseCpuList(description));
+}
+
+ThreadAffinity::Policy ThreadAffinity::policy() const { return policy_; }
+
+int ThreadAffinity::Cpu(const int worker) const {
+  if (policy_ == Policy::none || cpus_.empty()) {
+    return -1;
+  }
+  return cpus_[worker % cpus_.size()];
+}
+
+bool ThreadAffinity::Pin(const int worker) const {
+  const int cpu = Cpu(worker);
+  if (cpu < 0) {
+    return false;
+  }
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+ScopedPin::ScopedPin(ThreadAffinity const &affinity, const int worker) {
+  if (affinity.Cpu(worker) < 0) {
+    return;
+  }
+#ifdef __linux__
+  pinned_ = sched_getaffinity(0, sizeof(previous_), &previous_) == 0 &&
+            affinity.Pin(worker);
+#endif
+}
+
+ScopedPin::~ScopedPin() {
+#ifdef __linux__
+  if (pinned_) {
+    sched_setaffinity(0, sizeof(previous_), &previous_);
+  }
+#endif
+}
+
+std::vector<int> ThreadAffinity::ParseCpuList(std::string const &list) {
+  std::vector<int> cpus;
+  std::stringstream stream(list);
+  std::string range;
+  try {
+    while (std::getline(stream, range, ',')) {
+      const auto dash = range.find('-');
+      const int first = std::stoi(range.substr(0, dash));
+      const int last =
+          dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      if (first < 0 || last < first) {
+        throw std::invalid_argument(range);
+      }
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.emplace_back(cpu);
+      }
+    }
+  } catch (std::logic_error const &) {
+    throw std::invalid_argument("Malformed CPU list \"" + list + "\".");
+  }
+  return cpus;
+}
+
+std::vector<int> ThreadAffinity::CompactOrder() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.emplace_back(cpu);
+      }
+    }
+  }
+#endif
+  const auto nodes = NodeOf(cpus);
+  std::vector<std::tuple<int, int, int>> order;
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    int core = cpus[i];
+    std::ifstream coreFile("/sys/devices/system/cpu/cpu" +
+                           std::to_string(cpus[i]) + "/topology/core_id");
+    coreFile >> core;
+    order.emplace_back(nodes[i], core, cpus[i]);
+  }
+  std::sort(order.begin(), order.end());
+  for (size_t i = 0; i < order.size(); ++i) {
+    cpus[i] = std::get<2>(order[i]);
+  }
+  return cpus;
+}
+
+std::vector<int> ThreadAffinity::NodeOf(std::vector<int> const &cpus) {
+  std::vector<int> nodes(cpus.size(), 0);
+  for (int node = 0;; ++node) {
+    std::ifstream nodeFile("/sys/devices/system/node/node" +
+                           std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!std::getline(nodeFile, list)) {
+      break;
+    }
+    for (int cpu : ParseCpuList(list)) {
+      const auto found = std::find(cpus.cbegin(), cpus.cend(), cpu);
+      if (found != cpus.cend()) {
+        nodes[found - cpus.cbegin()] = node;
+      }
+    }
+  }
+  return nodes;
+}
+
+} // End namespace hpcse
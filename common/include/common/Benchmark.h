@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "common/PerfCounters.h"
+#include "common/Timer.h"
+
+namespace hpcse {
+
+/// Settings shared by all benchmarks of a run.
+struct BenchmarkSettings {
+  /// Untimed runs preceding the measurement, warming caches, page tables and
+  /// thread pools.
+  unsigned warmup{1};
+  /// Timed runs.
+  unsigned repetitions{10};
+  /// Samples further than this many interquartile ranges beyond the quartiles
+  /// are rejected as outliers (Tukey's fences).
+  double outlierFactor{1.5};
+};
+
+/// Timings of one benchmark in seconds. Statistics are computed over the
+/// samples left after rejecting outliers.
+struct BenchmarkResult {
+  std::string name{};
+  /// Unit of the work done per run, e.g. "cells" or "pairs".
+  std::string unit{};
+  double work{0};
+  /// Every timed run, in the order in which they were taken.
+  std::vector<double> samples{};
+  size_t rejected{0};
+  double min{0}, p10{0}, p25{0}, median{0}, p75{0}, p90{0}, max{0};
+  double mean{0};
+  /// Work per second at the median time.
+  double throughput{0};
+  /// Hardware counter values per run, averaged over all timed runs, if the
+  /// counters are available (see PerfCounters).
+  std::vector<std::pair<std::string, double>> counters{};
+  /// Which threads the counters count: "thread" for the calling thread of a
+  /// single threaded benchmark, "cpus" for every CPU of a multithreaded one,
+  /// or "omitted" if counting every CPU is not permitted, so that counters of
+  /// the calling thread alone would miss the work of the others.
+  std::string counterScope{};
+};
+
+/// Named kernels to be timed. Each is registered with a setup function, which
+/// is called once, untimed, and returns the function to time, so that inputs
+/// are prepared outside of the measurement.
+class BenchmarkRegistry {
+
+public:
+  using Kernel_t = std::function<void()>;
+  using Setup_t = std::function<Kernel_t()>;
+
+  /// work is the amount of work done by one call of the kernel, in units of
+  /// unit, from which the throughput is reported. threads is the number of
+  /// threads or local processes doing the work, which decides how the
+  /// hardware counters are taken.
+  inline void Register(std::string name, std::string unit, double work,
+                       Setup_t setup, unsigned threads = 1);
+
+  inline std::vector<std::string> Names() const;
+
+  /// Runs every benchmark with filter in its name, in order of registration.
+  /// Called with the result of each benchmark as soon as it is done.
+  inline std::vector<BenchmarkResult>
+  Run(BenchmarkSettings const &settings, std::string const &filter = "",
+      std::function<void(BenchmarkResult const &)> const &progress =
+          nullptr) const;
+
+private:
+  static inline void
+  AccumulateCounters(std::vector<std::pair<std::string, double>> &sums,
+                     std::vector<std::pair<std::string, double>> const &values);
+
+  struct Entry {
+    std::string name;
+    std::string unit;
+    double work;
+    Setup_t setup;
+    unsigned threads;
+  };
+
+  std::vector<Entry> entries_{};
+};
+
+/// Linearly interpolated quantile q in [0, 1] of sorted samples.
+inline double Quantile(std::vector<double> const &sorted, double q);
+
+/// Computes the statistics of result from its samples.
+inline void Summarize(BenchmarkResult &result, double outlierFactor);
+
+/// Writes results as a JSON document. context holds key-value pairs describing
+/// the machine and build, written as strings.
+inline void
+WriteBenchmarkJson(std::ostream &stream,
+                   std::vector<BenchmarkResult> const &results,
+                   std::vector<std::pair<std::string, std::string>> const
+                       &context = {});
+
+/// Prevents the compiler from discarding the computation of value as unused.
+template <typename T> inline void KeepResult(T const &value);
+
+void BenchmarkRegistry::Register(std::string name, std::string unit,
+                                 const double work, Setup_t setup,
+                                 const unsigned threads) {
+  entries_.emplace_back(Entry{std::move(name), std::move(unit), work,
+                              std::move(setup), threads});
+}
+
+std::vector<std::string> BenchmarkRegistry::Names() const {
+  std::vector<std::string> names;
+  for (auto &entry : entries_) {
+    names.emplace_back(entry.name);
+  }
+  return names;
+}
+
+std::vector<BenchmarkResult> BenchmarkRegistry::Run(
+    BenchmarkSettings const &settings, std::string const &filter,
+    std::function<void(BenchmarkResult const &)> const &progress) const {
+  std::vector<BenchmarkResult> results;
+  for (auto &entry : entries_) {
+    if (entry.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    BenchmarkResult result;
+    result.name = entry.name;
+    result.unit = entry.unit;
+    result.work = entry.work;
+    const Kernel_t kernel = entry.setup();
+    for (unsigned i = 0; i < settings.warmup; ++i) {
+      kernel();
+    }
+    // Counters are started outside of the timed region, so reading them does
+    // not add to the samples
+    const bool threaded = entry.threads > 1;
+    PerfCounters perfCounters(threaded ? PerfCounters::Scope::allCpus
+                                       : PerfCounters::Scope::callingThread);
+    if (perfCounters.available()) {
+      result.counterScope = threaded ? "cpus" : "thread";
+    } else if (threaded && PerfCounters().available()) {
+      result.counterScope = "omitted";
+    }
+    Timer timer;
+    for (unsigned i = 0; i < settings.repetitions; ++i) {
+      perfCounters.Start();
+      timer.Start();
+      kernel();
+      result.samples.emplace_back(timer.Stop());
+      perfCounters.Stop();
+      AccumulateCounters(result.counters, perfCounters.values());
+    }
+    for (auto &counter : result.counters) {
+      counter.second /= settings.repetitions;
+    }
+    Summarize(result, settings.outlierFactor);
+    if (progress) {
+      progress(result);
+    }
+    results.emplace_back(std::move(result));
+  }
+  return results;
+}
+
+void BenchmarkRegistry::AccumulateCounters(
+    std::vector<std::pair<std::string, double>> &sums,
+    std::vector<std::pair<std::string, double>> const &values) {
+  for (auto &value : values) {
+    auto sum = std::find_if(sums.begin(), sums.end(),
+                            [&value](std::pair<std::string, double> const &s) {
+                              return s.first == value.first;
+                            });
+    if (sum == sums.end()) {
+      sums.emplace_back(value.first, 0);
+      sum = sums.end() - 1;
+    }
+    sum->second += value.second;
+  }
+}
+
+double Quantile(std::vector<double> const &sorted, const double q) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  const double position = q * (sorted.size() - 1);
+  const size_t below = static_cast<size_t>(position);
+  const size_t above = std::min(below + 1, sorted.size() - 1);
+  const double weight = position - below;
+  return (1 - weight) * sorted[below] + weight * sorted[above];
+}
+
+void Summarize(BenchmarkResult &result, const double outlierFactor) {
+  std::vector<double> sorted(result.samples);
+  std::sort(sorted.begin(), sorted.end());
+  const double q1 = Quantile(sorted, 0.25);
+  const double q3 = Quantile(sorted, 0.75);
+  const double lower = q1 - outlierFactor * (q3 - q1);
+  const double upper = q3 + outlierFactor * (q3 - q1);
+  std::vector<double> kept;
+  std::copy_if(sorted.cbegin(), sorted.cend(), std::back_inserter(kept),
+               [lower, upper](const double t) {
+                 return t >= lower && t <= upper;
+               });
+  result.rejected = sorted.size() - kept.size();
+  if (kept.empty()) {
+    return;
+  }
+  result.min = kept.front();
+  result.p10 = Quantile(kept, 0.1);
+  result.p25 = Quantile(kept, 0.25);
+  result.median = Quantile(kept, 0.5);
+  result.p75 = Quantile(kept, 0.75);
+  result.p90 = Quantile(kept, 0.9);
+  result.max = kept.back();
+  double sum = 0;
+  for (auto t : kept) {
+    sum += t;
+  }
+  result.mean = sum / kept.size();
+  result.throughput = result.median > 0 ? result.work / result.median : 0;
+}
+
+namespace {
+
+inline std::string JsonString(std::string const &value) {
+  std::string output("\"");
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      output += '\\';
+      output += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      output += escaped;
+    } else {
+      output += c;
+    }
+  }
+  return output + "\"";
+}
+
+inline std::string JsonNumber(const double value) {
+  // Infinities and NaN have all exponent bits set. Tested on the bits, since
+  // -ffast-math allows std::isfinite to be folded to true
+  std::uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  constexpr std::uint64_t kExponent = 0x7ff0000000000000;
+  if ((bits & kExponent) == kExponent) {
+    return "null";
+  }
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+  return buffer;
+}
+
+} // End anonymous namespace
+
+void WriteBenchmarkJson(
+    std::ostream &stream, std::vector<BenchmarkResult> const &results,
+    std::vector<std::pair<std::string, std::string>> const &context) {
+  stream << "{\n  \"context\": {";
+  for (size_t i = 0; i < context.size(); ++i) {
+    stream << (i > 0 ? "," : "") << "\n    " << JsonString(context[i].first)
+           << ": " << JsonString(context[i].second);
+  }
+  stream << (context.empty() ? "" : "\n  ") << "},\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    auto &r = results[i];
+    stream << (i > 0 ? "," : "") << "\n    {\n"
+           << "      \"name\": " << JsonString(r.name) << ",\n"
+           << "      \"unit\": " << JsonString(r.unit) << ",\n"
+           << "      \"work\": " << JsonNumber(r.work) << ",\n"
+           << "      \"repetitions\": " << r.samples.size() << ",\n"
+           << "      \"rejected\": " << r.rejected << ",\n"
+           << "      \"seconds\": {"
+           << "\"min\": " << JsonNumber(r.min)
+           << ", \"p10\": " << JsonNumber(r.p10)
+           << ", \"p25\": " << JsonNumber(r.p25)
+           << ", \"median\": " << JsonNumber(r.median)
+           << ", \"p75\": " << JsonNumber(r.p75)
+           << ", \"p90\": " << JsonNumber(r.p90)
+           << ", \"max\": " << JsonNumber(r.max)
+           << ", \"mean\": " << JsonNumber(r.mean) << "},\n"
+           << "      \"throughput\": " << JsonNumber(r.throughput) << ",\n";
+    if (!r.counterScope.empty()) {
+      stream << "      \"counter_scope\": " << JsonString(r.counterScope)
+             << ",\n";
+    }
+    if (!r.counters.empty()) {
+      stream << "      \"counters\": {";
+      for (size_t j = 0; j < r.counters.size(); ++j) {
+        stream << (j > 0 ? ", " : "") << JsonString(r.counters[j].first)
+               << ": " << JsonNumber(r.counters[j].second);
+      }
+      stream << "},\n";
+    }
+    stream << "      \"samples\": [";
+    for (size_t j = 0; j < r.samples.size(); ++j) {
+      stream << (j > 0 ? ", " : "") << JsonNumber(r.samples[j]);
+    }
+    stream << "]\n    }";
+  }
+  stream << (results.empty() ? "" : "\n  ") << "]\n}\n";
+}
+
+template <typename T>
+void KeepResult(T const &value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+} // End namespace hpcse
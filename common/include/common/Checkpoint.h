@@ -0,0 +1,385 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common/ThreadPool.h"
+
+namespace hpcse {
+
+namespace {
+
+constexpr char kCheckpointMagic[8] = {'H', 'P', 'C', 'S', 'E', 'C', 'K', 'P'};
+
+} // End anonymous namespace
+
+/// Checkpointing of a solver run. Checkpoints hold the full state of the
+/// solver, so that a run resumed from one produces results bit-identical to an
+/// uninterrupted run.
+struct Checkpointing {
+  /// Prefix of the checkpoint files. Empty disables checkpointing.
+  std::string path{};
+  /// Timesteps between checkpoints. Zero writes no checkpoints.
+  unsigned interval{0};
+  /// Resume from the latest checkpoint at path if there is one, rather than
+  /// starting from the initial condition.
+  bool resume{false};
+};
+
+/// Solver state serialized as raw bytes. Values are read back with Get in the
+/// order in which they were added with Put.
+class CheckpointState {
+
+public:
+  template <typename T> inline void Put(T const &value);
+
+  template <typename T> inline void Put(T const *values, size_t count);
+
+  template <typename T> inline T Get();
+
+  /// Throws std::runtime_error if fewer than count values remain.
+  template <typename T> inline void Get(T *values, size_t count);
+
+  /// Reads back values and throws std::runtime_error if they differ from
+  /// expected, rejecting checkpoints of runs with different parameters.
+  template <typename T> inline void Expect(T const &expected, char const *what);
+
+  template <typename T>
+  inline void Expect(T const *expected, size_t count, char const *what);
+
+  inline void Clear();
+
+  inline std::vector<char> &bytes();
+
+  inline std::vector<char> const &bytes() const;
+
+private:
+  std::vector<char> bytes_{};
+  size_t position_{0};
+};
+
+/// Checkpoints with a given prefix, written on a background thread. Files
+/// alternate between prefix.0 and prefix.1, and each is written to a temporary
+/// file that is flushed to disk and renamed when complete, so the previous
+/// checkpoint survives an interruption or a crash of the system while the next
+/// one is being written. A checkpoint requested
+/// while the previous one is still being written is expected to be skipped
+/// rather than waited for, so the solver never blocks on I/O.
+class CheckpointStore {
+
+public:
+  inline explicit CheckpointStore(std::string prefix,
+                                  ThreadPool &pool = ThreadPool::Default());
+
+  /// Waits for the pending checkpoint to be written.
+  inline ~CheckpointStore();
+
+  CheckpointStore(CheckpointStore const &) = delete;
+  CheckpointStore &operator=(CheckpointStore const &) = delete;
+
+  /// Step of the latest complete checkpoint whose contents match their
+  /// checksum, or -1 if there is none. A corrupted checkpoint is passed over in
+  /// favor of the previous one, and std::runtime_error is thrown only if no
+  /// complete checkpoint is intact.
+  inline long Latest() const;
+
+  /// Reads the checkpoint of the given step into state(). Returns false if
+  /// there is no complete checkpoint of that step, and throws
+  /// std::runtime_error if it is corrupted. The file is kept until the next
+  /// checkpoint has been written.
+  inline bool Load(long step);
+
+  /// Deletes existing checkpoints, so that they cannot be mistaken for
+  /// checkpoints of a new run.
+  inline void Remove();
+
+  /// True if no checkpoint is being written. Rethrows errors of the last
+  /// write.
+  inline bool Idle();
+
+  /// Clears and returns the state to be written by Commit. Must only be called
+  /// while idle.
+  inline CheckpointState &Prepare();
+
+  inline CheckpointState &state();
+
+  /// Starts writing state() as the checkpoint of the given step.
+  inline void Commit(long step);
+
+  /// Blocks until the pending checkpoint has been written. Rethrows errors.
+  inline void Wait();
+
+private:
+  struct Header {
+    char magic[8];
+    std::int64_t step;
+    std::uint64_t size;
+    std::uint64_t checksum;
+  };
+
+  /// FNV-1a over 64-bit words, with the remaining bytes as a last word.
+  static inline std::uint64_t Checksum(std::vector<char> const &bytes);
+
+  inline std::string SlotPath(int slot) const;
+
+  /// Header of the file of the given slot, with step -1 if it is missing or
+  /// incomplete.
+  inline Header ReadHeader(int slot) const;
+
+  /// Reads the contents of the given slot into bytes. Returns false if they
+  /// cannot be read or do not match the checksum of the header.
+  inline bool ReadSlot(int slot, Header const &header,
+                       std::vector<char> &bytes) const;
+
+  inline void Write(int slot, long step) const;
+
+  /// Flushes the file or directory at path to disk.
+  static inline void Sync(std::string const &path, bool directory);
+
+  std::string prefix_;
+  ThreadPool &pool_;
+  CheckpointState state_{};
+  std::future<void> pending_{};
+  int nextSlot_{0};
+};
+
+template <typename T>
+void CheckpointState::Put(T const &value) {
+  Put(&value, 1);
+}
+
+template <typename T>
+void CheckpointState::Put(T const *values, const size_t count) {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Checkpointed values must be trivially copyable.");
+  char const *begin = reinterpret_cast<char const *>(values);
+  bytes_.insert(bytes_.end(), begin, begin + count * sizeof(T));
+}
+
+template <typename T>
+T CheckpointState::Get() {
+  T value;
+  Get(&value, 1);
+  return value;
+}
+
+template <typename T>
+void CheckpointState::Get(T *values, const size_t count) {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Checkpointed values must be trivially copyable.");
+  const size_t size = count * sizeof(T);
+  if (bytes_.size() - position_ < size) {
+    throw std::runtime_error("Checkpoint ended unexpectedly.");
+  }
+  std::memcpy(values, bytes_.data() + position_, size);
+  position_ += size;
+}
+
+template <typename T>
+void CheckpointState::Expect(T const &expected, char const *what) {
+  Expect(&expected, 1, what);
+}
+
+template <typename T>
+void CheckpointState::Expect(T const *expected, const size_t count,
+                             char const *what) {
+  std::vector<T> values(count);
+  Get(values.data(), count);
+  // Compared bitwise, since the values must match exactly
+  if (std::memcmp(values.data(), expected, count * sizeof(T)) != 0) {
+    throw std::runtime_error(std::string("Checkpoint was taken with a "
+                                         "different ") +
+                             what + ".");
+  }
+}
+
+void CheckpointState::Clear() {
+  bytes_.clear();
+  position_ = 0;
+}
+
+std::vector<char> &CheckpointState::bytes() { return bytes_; }
+
+std::vector<char> const &CheckpointState::bytes() const { return bytes_; }
+
+CheckpointStore::CheckpointStore(std::string prefix, ThreadPool &pool)
+    : prefix_(std::move(prefix)), pool_(pool) {}
+
+CheckpointStore::~CheckpointStore() {
+  if (pending_.valid()) {
+    pending_.wait();
+  }
+}
+
+long CheckpointStore::Latest() const {
+  const Header headers[2] = {ReadHeader(0), ReadHeader(1)};
+  const int newer = headers[1].step > headers[0].step ? 1 : 0;
+  std::vector<char> bytes;
+  bool corrupted = false;
+  for (int slot : {newer, 1 - newer}) {
+    if (headers[slot].step < 0) {
+      continue;
+    }
+    if (ReadSlot(slot, headers[slot], bytes)) {
+      return headers[slot].step;
+    }
+    corrupted = true;
+  }
+  if (corrupted) {
+    throw std::runtime_error("No checkpoint at " + prefix_ + " is intact.");
+  }
+  return -1;
+}
+
+bool CheckpointStore::Load(const long step) {
+  for (int slot = 0; slot < 2; ++slot) {
+    const Header header = ReadHeader(slot);
+    if (step < 0 || header.step != step) {
+      continue;
+    }
+    state_.Clear();
+    if (!ReadSlot(slot, header, state_.bytes())) {
+      throw std::runtime_error("Checkpoint " + SlotPath(slot) +
+                               " is corrupted.");
+    }
+    nextSlot_ = 1 - slot;
+    return true;
+  }
+  return false;
+}
+
+void CheckpointStore::Remove() {
+  Wait();
+  for (int slot = 0; slot < 2; ++slot) {
+    std::remove(SlotPath(slot).c_str());
+  }
+}
+
+bool CheckpointStore::Idle() {
+  if (!pending_.valid()) {
+    return true;
+  }
+  if (pending_.wait_for(std::chrono::seconds(0)) !=
+      std::future_status::ready) {
+    return false;
+  }
+  pending_.get();
+  return true;
+}
+
+CheckpointState &CheckpointStore::Prepare() {
+  state_.Clear();
+  return state_;
+}
+
+CheckpointState &CheckpointStore::state() { return state_; }
+
+void CheckpointStore::Commit(const long step) {
+  const int slot = nextSlot_;
+  nextSlot_ = 1 - slot;
+  pending_ = pool_.Submit([this, slot, step]() { Write(slot, step); });
+}
+
+void CheckpointStore::Wait() {
+  if (pending_.valid()) {
+    pending_.get();
+  }
+}
+
+std::uint64_t CheckpointStore::Checksum(std::vector<char> const &bytes) {
+  constexpr std::uint64_t kPrime = 0x100000001b3;
+  std::uint64_t hash = 0xcbf29ce484222325;
+  const size_t nWords = bytes.size() / sizeof(std::uint64_t);
+  for (size_t i = 0; i < nWords; ++i) {
+    std::uint64_t word;
+    std::memcpy(&word, bytes.data() + i * sizeof(word), sizeof(word));
+    hash = (hash ^ word) * kPrime;
+  }
+  std::uint64_t last = 0;
+  const size_t remainder = bytes.size() - nWords * sizeof(last);
+  if (remainder > 0) {
+    std::memcpy(&last, bytes.data() + nWords * sizeof(last), remainder);
+  }
+  return (hash ^ last) * kPrime;
+}
+
+std::string CheckpointStore::SlotPath(const int slot) const {
+  return prefix_ + "." + std::to_string(slot);
+}
+
+CheckpointStore::Header CheckpointStore::ReadHeader(const int slot) const {
+  Header header;
+  std::ifstream file(SlotPath(slot), std::ios::binary | std::ios::ate);
+  const auto fileSize = file.tellg();
+  file.seekg(0);
+  if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) != 0 ||
+      static_cast<std::uint64_t>(fileSize) != sizeof(header) + header.size) {
+    header.step = -1;
+  }
+  return header;
+}
+
+bool CheckpointStore::ReadSlot(const int slot, Header const &header,
+                               std::vector<char> &bytes) const {
+  std::ifstream file(SlotPath(slot), std::ios::binary);
+  file.seekg(sizeof(Header));
+  bytes.resize(header.size);
+  file.read(bytes.data(), header.size);
+  return file && Checksum(bytes) == header.checksum;
+}
+
+void CheckpointStore::Write(const int slot, const long step) const {
+  Header header;
+  std::memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+  header.step = step;
+  header.size = state_.bytes().size();
+  header.checksum = Checksum(state_.bytes());
+  const std::string path = SlotPath(slot);
+  const std::string temporary = path + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    file.write(state_.bytes().data(), state_.bytes().size());
+    if (!file.flush()) {
+      throw std::runtime_error("Failed to write checkpoint " + temporary +
+                               ".");
+    }
+  }
+  // The contents must reach the disk before the rename, or a crash may leave
+  // the renamed file empty, and the rename only persists once the directory
+  // has been flushed as well
+  Sync(temporary, false);
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("Failed to rename checkpoint " + temporary +
+                             ".");
+  }
+  const size_t separator = path.find_last_of('/');
+  Sync(separator == std::string::npos ? "." : path.substr(0, separator + 1),
+       true);
+}
+
+void CheckpointStore::Sync(std::string const &path, const bool directory) {
+  const int fd =
+      open(path.c_str(), directory ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+  const bool synced = fd >= 0 && fsync(fd) == 0;
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (!synced) {
+    throw std::runtime_error("Failed to flush " + path + " to disk.");
+  }
+}
+
+} // End namespace hpcse
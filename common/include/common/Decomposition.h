@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+
+namespace hpcse {
+
+/// Split of a Dim-dimensional grid of cells into blocks, one per rank. Cells
+/// along each dimension are distributed as evenly as possible, so blocks
+/// differ in extent by at most one cell per dimension.
+template <size_t Dim>
+struct Decomposition {
+  /// Number of ranks along each dimension.
+  std::array<int, Dim> ranks;
+  /// Extent of the largest block along each dimension.
+  std::array<int, Dim> blockCells;
+  /// Cells of the largest block relative to the average, minus one.
+  double imbalance;
+  /// Halo cells exchanged by the rank with the largest surface.
+  long haloCells;
+  /// Estimated cost of a step in units of updating one cell.
+  double cost;
+};
+
+/// Relative cost of exchanging one halo cell compared to updating one cell.
+constexpr double kDefaultHaloWeight = 4;
+
+/// Finds the decomposition of cells over nRanks ranks minimizing the cost of
+/// the slowest rank, modeled as the cells of the largest block plus
+/// haloWeight times the largest number of halo cells exchanged by a rank. All
+/// factorizations of nRanks are considered, so any rank count is supported.
+/// Among decompositions of equal cost, more ranks are placed along earlier
+/// dimensions, where the halos are contiguous for row-major storage. Throws
+/// std::invalid_argument if there are more ranks than cells.
+template <size_t Dim>
+Decomposition<Dim> Decompose(int nRanks, std::array<int, Dim> const &cells,
+                             double haloWeight = kDefaultHaloWeight);
+
+namespace {
+
+template <size_t Dim>
+void DecomposeRecursive(const size_t dim, const int ranksLeft,
+                        std::array<int, Dim> const &cells,
+                        const double haloWeight,
+                        std::array<int, Dim> &ranks,
+                        Decomposition<Dim> &best) {
+  if (dim == Dim - 1) {
+    ranks[dim] = ranksLeft;
+    Decomposition<Dim> candidate{};
+    candidate.ranks = ranks;
+    double blockVolume = 1;
+    double totalVolume = 1;
+    for (size_t d = 0; d < Dim; ++d) {
+      if (ranks[d] > cells[d]) {
+        return; // Empty blocks
+      }
+      candidate.blockCells[d] = (cells[d] + ranks[d] - 1) / ranks[d];
+      blockVolume *= candidate.blockCells[d];
+      totalVolume *= cells[d];
+    }
+    // Along each dimension, a rank exchanges a face with each of its up to two
+    // neighbors
+    candidate.haloCells = 0;
+    for (size_t d = 0; d < Dim; ++d) {
+      long face = 1;
+      for (size_t e = 0; e < Dim; ++e) {
+        if (e != d) {
+          face *= candidate.blockCells[e];
+        }
+      }
+      candidate.haloCells += std::min(2, ranks[d] - 1) * face;
+    }
+    double nBlocks = 1;
+    for (size_t d = 0; d < Dim; ++d) {
+      nBlocks *= ranks[d];
+    }
+    candidate.imbalance = blockVolume / (totalVolume / nBlocks) - 1;
+    candidate.cost = blockVolume + haloWeight * candidate.haloCells;
+    if (candidate.cost < best.cost) {
+      best = candidate;
+    }
+    return;
+  }
+  // Visit larger counts first, so ties favor earlier dimensions
+  for (int n = ranksLeft; n >= 1; --n) {
+    if (ranksLeft % n == 0) {
+      ranks[dim] = n;
+      DecomposeRecursive<Dim>(dim + 1, ranksLeft / n, cells, haloWeight, ranks,
+                              best);
+    }
+  }
+}
+
+} // End anonymous namespace
+
+template <size_t Dim>
+Decomposition<Dim> Decompose(const int nRanks,
+                             std::array<int, Dim> const &cells,
+                             const double haloWeight) {
+  static_assert(Dim > 0, "Decomposition must have at least one dimension.");
+  Decomposition<Dim> best{};
+  best.cost = std::numeric_limits<double>::infinity();
+  std::array<int, Dim> ranks{};
+  if (nRanks >= 1) {
+    DecomposeRecursive<Dim>(0, nRanks, cells, haloWeight, ranks, best);
+  }
+  if (best.cost == std::numeric_limits<double>::infinity()) {
+    throw std::invalid_argument(
+        "Cannot decompose grid into the given number of ranks.");
+  }
+  return best;
+}
+
+} // End namespace hpcse
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+namespace hpcse {
+
+/// Discrete Fourier transform of any length in double precision. Powers of two
+/// are transformed with the iterative radix-2 algorithm, and other lengths with
+/// Bluestein's algorithm as a convolution of the next power of two that fits,
+/// so every length costs O(n log n). Plans are immutable after construction,
+/// so a plan can be shared by threads as long as each has its own workspace.
+class Fft {
+
+public:
+  using Complex_t = std::complex<double>;
+
+  /// Buffers reused between transforms to avoid allocating for every line.
+  struct Workspace {
+    std::vector<Complex_t> data{};
+    std::vector<Complex_t> scratch{};
+  };
+
+  inline explicit Fft(size_t n);
+
+  inline size_t size() const;
+
+  /// In-place X_k = sum_j x_j exp(-2 pi i jk / n), without normalization.
+  inline void Forward(Complex_t *data, Workspace &workspace) const;
+
+  /// In-place x_j = sum_k X_k exp(2 pi i jk / n), without normalization, so
+  /// Inverse(Forward(x)) = n x.
+  inline void Inverse(Complex_t *data, Workspace &workspace) const;
+
+private:
+  /// In-place radix-2 transform of length m_.
+  inline void Radix2(Complex_t *data, bool inverse) const;
+
+  size_t n_;
+  /// Length of the radix-2 transform: n_ itself if it is a power of two,
+  /// otherwise the convolution length used by Bluestein's algorithm.
+  size_t m_;
+  /// exp(-2 pi i k / m_) for k < m_ / 2.
+  std::vector<Complex_t> twiddles_{};
+  /// exp(-pi i j^2 / n_) for j < n_, only for Bluestein's algorithm.
+  std::vector<Complex_t> chirp_{};
+  /// Transform of the conjugate chirp, wrapped around to length m_ and divided
+  /// by m_ to normalize the convolution.
+  std::vector<Complex_t> chirpSpectrum_{};
+};
+
+/// Type-I discrete sine transform
+///   y_k = sum_{j=1..n} x_j sin(pi jk / (n + 1)),  k = 1..n,
+/// which diagonalizes the second difference operator with zero boundaries.
+/// Computed as the Fourier transform of the odd extension of length
+/// 2 (n + 1), transforming two real sequences at a time as the real and
+/// imaginary parts of one. Applying the transform twice scales by (n + 1) / 2.
+class SineTransform {
+
+public:
+  inline explicit SineTransform(size_t n);
+
+  inline size_t size() const;
+
+  /// Transforms first and second in place, each of length size().
+  inline void Transform(double *first, double *second,
+                        Fft::Workspace &workspace) const;
+
+private:
+  size_t n_;
+  Fft fft_;
+};
+
+Fft::Fft(const size_t n) : n_(n), m_(n > 0 ? 1 : 0) {
+  while (m_ < n_) {
+    m_ <<= 1;
+  }
+  if (m_ != n_) {
+    m_ = 1;
+    while (m_ < 2 * n_ - 1) {
+      m_ <<= 1;
+    }
+  }
+  const double pi = std::acos(-1.);
+  twiddles_.resize(m_ / 2);
+  for (size_t k = 0; k < m_ / 2; ++k) {
+    twiddles_[k] = std::polar(1., -2 * pi * k / m_);
+  }
+  if (m_ != n_) {
+    // j^2 is reduced modulo 2n to keep the angles accurate for long transforms
+    chirp_.resize(n_);
+    for (size_t j = 0; j < n_; ++j) {
+      chirp_[j] = std::polar(1., -pi * ((j * j) % (2 * n_)) / n_);
+    }
+    chirpSpectrum_.assign(m_, 0);
+    chirpSpectrum_[0] = std::conj(chirp_[0]) / static_cast<double>(m_);
+    for (size_t j = 1; j < n_; ++j) {
+      chirpSpectrum_[j] = chirpSpectrum_[m_ - j] =
+          std::conj(chirp_[j]) / static_cast<double>(m_);
+    }
+    Radix2(chirpSpectrum_.data(), false);
+  }
+}
+
+size_t Fft::size() const { return n_; }
+
+void Fft::Forward(Complex_t *data, Workspace &workspace) const {
+  if (m_ == n_) {
+    Radix2(data, false);
+    return;
+  }
+  // X_k = w_k sum_j (x_j w_j) conj(w_{k-j}), with w_j = exp(-pi i j^2 / n)
+  auto &scratch = workspace.scratch;
+  scratch.assign(m_, 0);
+  for (size_t j = 0; j < n_; ++j) {
+    scratch[j] = data[j] * chirp_[j];
+  }
+  Radix2(scratch.data(), false);
+  for (size_t k = 0; k < m_; ++k) {
+    scratch[k] *= chirpSpectrum_[k];
+  }
+  Radix2(scratch.data(), true);
+  for (size_t k = 0; k < n_; ++k) {
+    data[k] = scratch[k] * chirp_[k];
+  }
+}
+
+void Fft::Inverse(Complex_t *data, Workspace &workspace) const {
+  for (size_t j = 0; j < n_; ++j) {
+    data[j] = std::conj(data[j]);
+  }
+  Forward(data, workspace);
+  for (size_t j = 0; j < n_; ++j) {
+    data[j] = std::conj(data[j]);
+  }
+}
+
+void Fft::Radix2(Complex_t *data, const bool inverse) const {
+  for (size_t i = 1, j = 0; i < m_; ++i) {
+    size_t bit = m_ >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      std::swap(data[i], data[j]);
+    }
+  }
+  for (size_t length = 2; length <= m_; length <<= 1) {
+    const size_t half = length >> 1;
+    const size_t step = m_ / length;
+    for (size_t begin = 0; begin < m_; begin += length) {
+      for (size_t k = 0; k < half; ++k) {
+        const Complex_t w =
+            inverse ? std::conj(twiddles_[k * step]) : twiddles_[k * step];
+        const Complex_t odd = data[begin + k + half] * w;
+        data[begin + k + half] = data[begin + k] - odd;
+        data[begin + k] += odd;
+      }
+    }
+  }
+}
+
+SineTransform::SineTransform(const size_t n) : n_(n), fft_(2 * (n + 1)) {}
+
+size_t SineTransform::size() const { return n_; }
+
+void SineTransform::Transform(double *first, double *second,
+                              Fft::Workspace &workspace) const {
+  // The transform of a real odd sequence is imaginary, -2i times the sine
+  // transform, so packing the second sequence as the imaginary part puts twice
+  // its sine transform in the real part of the result
+  auto &data = workspace.data;
+  data.assign(fft_.size(), 0);
+  for (size_t j = 1; j <= n_; ++j) {
+    data[j] = Fft::Complex_t(first[j - 1], second[j - 1]);
+    data[fft_.size() - j] = -data[j];
+  }
+  fft_.Forward(data.data(), workspace);
+  for (size_t k = 1; k <= n_; ++k) {
+    first[k - 1] = -0.5 * data[k].imag();
+    second[k - 1] = 0.5 * data[k].real();
+  }
+}
+
+} // End namespace hpcse
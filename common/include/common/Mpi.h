@@ -1,10 +1,18 @@
 #pragma once
 
 #include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
 #include <iterator>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 #include <mpi.h>
 #include "common/Common.h"
+#include "common/Decomposition.h"
+#include "common/Trace.h"
 
 namespace hpcse {
 
@@ -66,7 +74,7 @@ inline int size() { return size(MPI_COMM_WORLD); }
 template <typename IteratorType, typename = CheckRandomAccess<IteratorType>>
 void Send(IteratorType begin, const IteratorType end, const int destination,
           const int tag = 0, MPI_Comm comm = MPI_COMM_WORLD) {
-  using T = typename std::iterator_traits<const IteratorType>::value_type;
+  using T = typename std::iterator_traits<IteratorType>::value_type;
   MPI_Send(&(*begin), std::distance(begin, end), MpiType<T>::value(),
            destination, tag, comm);
 }
@@ -75,7 +83,7 @@ template <typename IteratorType, typename = CheckRandomAccess<IteratorType>>
 MPI_Request SendAsync(IteratorType begin, const IteratorType end,
                       const int destination, const int tag = 0,
                       MPI_Comm comm = MPI_COMM_WORLD) {
-  using T = typename std::iterator_traits<const IteratorType>::value_type;
+  using T = typename std::iterator_traits<IteratorType>::value_type;
   MPI_Request request;
   MPI_Isend(&(*begin), std::distance(begin, end), MpiType<T>::value(),
             destination, tag, comm, &request);
@@ -181,6 +189,16 @@ void Reduce(SendIterator sendBegin, const SendIterator sendEnd,
       MpiOp<op>::value(), root, comm);
 }
 
+/// Reduces a single value across all ranks of comm, returning the result on
+/// every rank.
+template <Op op, typename T>
+T AllReduce(const T value, MPI_Comm comm = MPI_COMM_WORLD) {
+  T output;
+  MPI_Allreduce(&value, &output, 1, MpiType<T>::value(), MpiOp<op>::value(),
+                comm);
+  return output;
+}
+
     inline MPI_Status
     Wait(MPI_Request &request) {
   MPI_Status status;
@@ -197,6 +215,201 @@ WaitAll(ContainerType<MPI_Request, std::allocator<MPI_Request>> &requests) {
   return statuses;
 }
 
+/// Committed datatype selecting a block of subsizes elements starting at
+/// starts from a row-major array of dimensions sizes. Must be released with
+/// MPI_Type_free.
+template <typename T, size_t Dim>
+MPI_Datatype Subarray(std::array<int, Dim> sizes,
+                      std::array<int, Dim> subsizes,
+                      std::array<int, Dim> starts) {
+  MPI_Datatype output;
+  MPI_Type_create_subarray(Dim, sizes.data(), subsizes.data(), starts.data(),
+                           MPI_ORDER_C, MpiType<T>::value(), &output);
+  MPI_Type_commit(&output);
+  return output;
+}
+
+/// Committed datatype of count blocks of blockLength elements of T, the
+/// beginnings of consecutive blocks stride elements apart, e.g. a column of a
+/// row-major array. Must be released with MPI_Type_free.
+template <typename T>
+MPI_Datatype Vector(const int count, const int blockLength, const int stride) {
+  MPI_Datatype output;
+  MPI_Type_vector(count, blockLength, stride, MpiType<T>::value(), &output);
+  MPI_Type_commit(&output);
+  return output;
+}
+
+/// File opened collectively on a communicator and closed on destruction.
+class File {
+
+public:
+  inline File(std::string const &path, const int mode,
+              MPI_Comm comm = MPI_COMM_WORLD) {
+    if (MPI_File_open(comm, path.c_str(), mode, MPI_INFO_NULL, &file_) !=
+        MPI_SUCCESS) {
+      throw std::runtime_error("Failed to open " + path + " for MPI-IO.");
+    }
+  }
+  inline ~File() { MPI_File_close(&file_); }
+  File(File const &) = delete;
+  File(File &&) = delete;
+  File &operator=(File const &) = delete;
+  File &operator=(File &&) = delete;
+
+  inline MPI_File handle() const { return file_; }
+
+private:
+  MPI_File file_{};
+};
+
+/// Barrier that sleeps between polls rather than spinning, so that ranks
+/// waiting for others to finish work of their own leave them the cores.
+inline void IdleBarrier(MPI_Comm comm = MPI_COMM_WORLD) {
+  MPI_Request request;
+  MPI_Ibarrier(comm, &request);
+  int done = 0;
+  MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+  while (!done) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+  }
+}
+
+/// Communicator of the ranks of comm that can share memory, typically those
+/// running on the same node. Must be released with MPI_Comm_free.
+inline MPI_Comm SplitShared(MPI_Comm comm = MPI_COMM_WORLD) {
+  MPI_Comm output;
+  MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank(comm), MPI_INFO_NULL,
+                      &output);
+  return output;
+}
+
+/// Rank in target of the given rank of comm, or MPI_UNDEFINED if it is not
+/// part of target. MPI_PROC_NULL is returned unchanged.
+inline int TranslateRank(const int rank, MPI_Comm comm, MPI_Comm target) {
+  MPI_Group group, targetGroup;
+  MPI_Comm_group(comm, &group);
+  MPI_Comm_group(target, &targetGroup);
+  int output;
+  MPI_Group_translate_ranks(group, 1, &rank, targetGroup, &output);
+  MPI_Group_free(&group);
+  MPI_Group_free(&targetGroup);
+  return output;
+}
+
+/// Window of count elements of T per rank, allocated collectively on a
+/// communicator of ranks sharing memory (see SplitShared). Every rank can load
+/// and store directly to the segments of all other ranks. A passive epoch is
+/// held on all ranks for the lifetime of the window, so stores are made
+/// visible to other ranks by calling Sync() before notifying them, and the
+/// notified ranks call Sync() before loading.
+template <typename T>
+class SharedWindow {
+
+public:
+  inline SharedWindow(const size_t count, MPI_Comm comm) {
+    MPI_Win_allocate_shared(count * sizeof(T), sizeof(T), MPI_INFO_NULL, comm,
+                            &data_, &window_);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, window_);
+  }
+  inline ~SharedWindow() {
+    MPI_Win_unlock_all(window_);
+    MPI_Win_free(&window_);
+  }
+  SharedWindow(SharedWindow const &) = delete;
+  SharedWindow(SharedWindow &&) = delete;
+  SharedWindow &operator=(SharedWindow const &) = delete;
+  SharedWindow &operator=(SharedWindow &&) = delete;
+
+  /// Segment of the calling rank.
+  inline T *data() const { return data_; }
+
+  /// Segment of the given rank of the window's communicator, or nullptr if
+  /// that rank allocated no elements.
+  inline T *Query(const int rank) const {
+    MPI_Aint size;
+    int displacementUnit;
+    T *output;
+    MPI_Win_shared_query(window_, rank, &size, &displacementUnit, &output);
+    return size > 0 ? output : nullptr;
+  }
+
+  /// Synchronizes the public and private copies of the window, acting as a
+  /// memory barrier for loads and stores to shared segments.
+  inline void Sync() const { MPI_Win_sync(window_); }
+
+  inline MPI_Win handle() const { return window_; }
+
+private:
+  T *data_{nullptr};
+  MPI_Win window_{};
+};
+
+/// First 64-byte aligned element at or after p, for placing data within the
+/// segments of a SharedWindow. Segments are mapped at page granularity, so
+/// every rank finds the same element of another rank's segment.
+template <typename T>
+inline T *AlignUp(T *const p) {
+  return reinterpret_cast<T *>((reinterpret_cast<std::uintptr_t>(p) + 63) &
+                               ~static_cast<std::uintptr_t>(63));
+}
+
+/// Collects the trace events of all ranks of comm and writes them to a Chrome
+/// trace at path on rank 0, with one process per rank. Ranks are aligned at a
+/// barrier, so their clocks need not agree. Collective, and must not be called
+/// while any thread is recording.
+inline void WriteTrace(std::string const &path,
+                       MPI_Comm comm = MPI_COMM_WORLD) {
+  Tracer &tracer = Tracer::Get();
+  MPI_Barrier(comm);
+  const long synchronized = tracer.Now();
+  // Every event was recorded at most the time since the tracer was created
+  // before the barrier, so shifting by the longest such time keeps them all
+  // non-negative
+  const long offset = AllReduce<Op::max>(synchronized, comm) - synchronized;
+  std::string events;
+  tracer.AppendChromeEvents(events, rank(comm), offset);
+  const int nRanks = size(comm);
+  int length = events.size();
+  std::vector<int> lengths(nRanks), offsets(nRanks, 0);
+  MPI_Gather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, 0, comm);
+  for (int r = 1; r < nRanks; ++r) {
+    offsets[r] = offsets[r - 1] + lengths[r - 1];
+  }
+  std::string merged(offsets[nRanks - 1] + lengths[nRanks - 1], '\0');
+  events.push_back('\0'); // Gives empty strings a valid address
+  Gather(events.begin(), events.end() - 1, merged.begin(), lengths, offsets, 0,
+         comm);
+  if (rank(comm) == 0) {
+    // The events of each rank are comma-separated, but not terminated
+    std::string joined;
+    for (int r = 0; r < nRanks; ++r) {
+      joined += (r > 0 ? ",\n" : "") + merged.substr(offsets[r], lengths[r]);
+    }
+    std::ofstream file(path);
+    WriteChromeTrace(file, joined);
+    if (!file) {
+      throw std::runtime_error("Failed to write trace " + path + ".");
+    }
+  }
+}
+
+/// Thread support of the MPI library, in increasing order of support.
+enum class ThreadLevel {
+  single = MPI_THREAD_SINGLE,
+  funneled = MPI_THREAD_FUNNELED,
+  serialized = MPI_THREAD_SERIALIZED,
+  multiple = MPI_THREAD_MULTIPLE
+};
+
+/// Thread support provided by the initialized MPI library.
+inline ThreadLevel threadLevel() {
+  int provided;
+  MPI_Query_thread(&provided);
+  return static_cast<ThreadLevel>(provided);
+}
+
 class Context {
 
 public:
@@ -204,6 +417,13 @@ public:
   inline Context(int argc, char **argv) : argc_(argc), argv_(argv) {
     MPI_Init(&argc_, &argv_);
   }
+  /// Requests the given level of thread support. The level actually provided
+  /// may be lower, and can be retrieved with threadLevel().
+  inline Context(int argc, char **argv, const ThreadLevel required)
+      : argc_(argc), argv_(argv) {
+    int provided;
+    MPI_Init_thread(&argc_, &argv_, static_cast<int>(required), &provided);
+  }
   inline ~Context() { MPI_Finalize(); }
   Context(Context const &) = delete;
   Context(Context &&) = delete;
@@ -230,6 +450,12 @@ public:
                  coords_.data());
   }
 
+  /// Grid with the number of ranks along each dimension taken from a
+  /// decomposition of the global grid, typically found with Decompose.
+  CartesianGrid(Decomposition<Dim> const &decomposition,
+                const bool periodic = false, MPI_Comm comm = MPI_COMM_WORLD)
+      : CartesianGrid(decomposition.ranks, periodic, comm) {}
+
   template <size_t GetDim> int get() const { return coords_[GetDim]; }
 
   int get(const size_t dim) const { return coords_[dim]; }
@@ -295,6 +521,10 @@ public:
     return shift<Dim - 2>(amount);
   }
 
+  /// Communicator of the grid. Neighbor ranks refer to this communicator,
+  /// which may be reordered relative to the one passed on construction.
+  MPI_Comm comm() const { return cartComm_; }
+
   template <size_t PartitionDim> MPI_Comm Partition() {
     MPI_Comm comm;
     std::array<int, Dim> dimToSplit;
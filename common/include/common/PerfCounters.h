@@ -0,0 +1,355 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace hpcse {
+
+namespace {
+
+/// Bytes transferred from memory per last level cache miss.
+constexpr double kCacheLineBytes = 64;
+
+} // End anonymous namespace
+
+/// Hardware performance counters read with Linux perf_event_open around a
+/// measured region. Counters that the CPU, kernel or permissions (see
+/// /proc/sys/kernel/perf_event_paranoid) do not provide are left out, so
+/// without any the counters are simply unavailable and the region is only
+/// timed. Floating point operations are counted on Intel CPUs providing
+/// FP_ARITH_INST_RETIRED (Broadwell and later cores), weighting each
+/// instruction by its number of lanes. Counters only count user space.
+///
+/// The counters of a thread or CPU form a group led by the cycles, so the
+/// kernel multiplexes them together and they are taken over the same time
+/// slices. The floating point counters take one general purpose counter per
+/// instruction width, more than the other counters leave free on most cores,
+/// so they form groups of their own. Counts of different groups are scaled by
+/// the time each ran, and ratios between them, i.e. flops_per_byte, are
+/// estimates if the kernel had to multiplex the groups.
+class PerfCounters {
+
+public:
+  /// Which threads are counted.
+  enum class Scope {
+    /// Only the thread constructing the counters, not including threads
+    /// created by or working for it.
+    callingThread,
+    /// Every thread of every process running on any CPU, with groups per CPU,
+    /// which counts thread pools but also anything else running. Usually
+    /// needs a perf_event_paranoid of at most 0 or CAP_PERFMON.
+    allCpus
+  };
+
+  inline explicit PerfCounters(Scope scope = Scope::callingThread);
+
+  inline ~PerfCounters();
+
+  PerfCounters(PerfCounters const &) = delete;
+  PerfCounters &operator=(PerfCounters const &) = delete;
+
+  /// True if at least one counter could be opened.
+  inline bool available() const;
+
+  /// Resets and starts all counters.
+  inline void Start();
+
+  /// Stops all counters and reads their values.
+  inline void Stop();
+
+  /// Values of the last measured region by name, scaled up if the kernel had
+  /// to multiplex counters. Contains "cycles", "instructions",
+  /// "cache_references", "cache_misses" and "flops" when available, and the
+  /// derived "ipc", "memory_bytes" (last level cache misses times the line
+  /// size) and "flops_per_byte".
+  inline std::vector<std::pair<std::string, double>> const &values() const;
+
+  /// True if the last measured region has a value of the given name.
+  inline bool Has(std::string const &name) const;
+
+  /// Value of the given name, or zero if it is not available. Check with Has,
+  /// since NaN would not survive -ffast-math.
+  inline double Get(std::string const &name) const;
+
+private:
+  struct Counter {
+    std::string name{};
+    /// Contribution of each count to the named value.
+    double weight{1};
+    int fd{-1};
+  };
+
+  /// Counters of one thread or CPU, the first of which is the group leader.
+  using Group_t = std::vector<Counter>;
+
+  /// Opens the counters on the given thread (0 for the calling one) and CPU
+  /// (-1 for any) into new groups, opening none if the cycles cannot be
+  /// counted.
+  static inline void OpenGroups(int pid, int cpu,
+                                std::vector<Group_t> &groups);
+
+  /// Opens a counter into group, which is skipped if the kernel refuses it,
+  /// e.g. since the group would no longer fit into the hardware counters.
+  static inline bool Open(Group_t &group, std::string const &name,
+                          double weight, std::uint32_t type,
+                          std::uint64_t config, int pid, int cpu);
+
+  /// Closes the counters of group from first on.
+  static inline void Close(Group_t &group, size_t first);
+
+  /// True for Intel cores that count FP_ARITH_INST_RETIRED.
+  static inline bool CountsFlops();
+
+  std::vector<Group_t> groups_{};
+  std::vector<std::pair<std::string, double>> values_{};
+};
+
+PerfCounters::PerfCounters(const Scope scope) {
+#ifdef __linux__
+  if (scope == Scope::callingThread) {
+    OpenGroups(0, -1, groups_);
+  } else {
+    // CPUs that are offline refuse the counters and are skipped
+    const long nCpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (int cpu = 0; cpu < nCpus; ++cpu) {
+      OpenGroups(-1, cpu, groups_);
+    }
+  }
+#else
+  (void)scope;
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+  for (auto &group : groups_) {
+    Close(group, 0);
+  }
+}
+
+bool PerfCounters::available() const { return !groups_.empty(); }
+
+void PerfCounters::Start() {
+#ifdef __linux__
+  for (auto &group : groups_) {
+    ioctl(group.front().fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  }
+  for (auto &group : groups_) {
+    ioctl(group.front().fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+}
+
+void PerfCounters::Stop() {
+  values_.clear();
+#ifdef __linux__
+  for (auto &group : groups_) {
+    ioctl(group.front().fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  }
+  for (auto &group : groups_) {
+    // Number of counters, time enabled and time running, the latter two
+    // differing if the group shared the hardware with others, followed by the
+    // value of each counter in the order in which they were opened
+    std::vector<std::uint64_t> buffer(3 + group.size());
+    const ssize_t bytes = buffer.size() * sizeof(std::uint64_t);
+    if (read(group.front().fd, buffer.data(), bytes) != bytes ||
+        buffer[0] != group.size()) {
+      continue;
+    }
+    const double scale =
+        buffer[2] > 0 ? static_cast<double>(buffer[1]) / buffer[2] : 0;
+    for (size_t i = 0; i < group.size(); ++i) {
+      auto &counter = group[i];
+      auto entry = std::find_if(
+          values_.begin(), values_.end(),
+          [&counter](std::pair<std::string, double> const &other) {
+            return other.first == counter.name;
+          });
+      if (entry == values_.end()) {
+        values_.emplace_back(counter.name, 0);
+        entry = values_.end() - 1;
+      }
+      entry->second += counter.weight * scale * buffer[3 + i];
+    }
+  }
+#endif
+  if (Has("cycles") && Has("instructions") && Get("cycles") > 0) {
+    values_.emplace_back("ipc", Get("instructions") / Get("cycles"));
+  }
+  if (Has("cache_misses")) {
+    const double bytes = kCacheLineBytes * Get("cache_misses");
+    values_.emplace_back("memory_bytes", bytes);
+    if (Has("flops") && bytes > 0) {
+      values_.emplace_back("flops_per_byte", Get("flops") / bytes);
+    }
+  }
+}
+
+std::vector<std::pair<std::string, double>> const &
+PerfCounters::values() const {
+  return values_;
+}
+
+bool PerfCounters::Has(std::string const &name) const {
+  for (auto &value : values_) {
+    if (value.first == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+double PerfCounters::Get(std::string const &name) const {
+  for (auto &value : values_) {
+    if (value.first == name) {
+      return value.second;
+    }
+  }
+  return 0;
+}
+
+void PerfCounters::OpenGroups(const int pid, const int cpu,
+                              std::vector<Group_t> &groups) {
+#ifdef __linux__
+  Group_t group;
+  if (!Open(group, "cycles", 1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+            pid, cpu)) {
+    return;
+  }
+  // Instructions and cycles have fixed counters on most cores, so the misses
+  // and references take two general purpose counters
+  Open(group, "instructions", 1, PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_INSTRUCTIONS, pid, cpu);
+  Open(group, "cache_misses", 1, PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_CACHE_MISSES, pid, cpu);
+  Open(group, "cache_references", 1, PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_CACHE_REFERENCES, pid, cpu);
+  groups.push_back(std::move(group));
+  if (CountsFlops()) {
+    // FP_ARITH_INST_RETIRED (event 0xc7) has one umask bit per instruction
+    // width: scalar double and single, then packed double and single of 128,
+    // 256 and 512 bits. Bits of widths with equal lanes share a counter,
+    // weighted by the lanes. FMA instructions count twice. Cores have four or
+    // eight general purpose counters per thread, so a width that the kernel
+    // refuses to add to a group leads a new one
+    constexpr unsigned kUmasks[] = {0x03, 0x04, 0x18, 0x60, 0x80};
+    constexpr double kLanes[] = {1, 2, 4, 8, 16};
+    std::vector<Group_t> flops(1);
+    bool complete = true;
+    for (int i = 0; i < 5 && complete; ++i) {
+      const std::uint64_t config = 0xc7 | (kUmasks[i] << 8);
+      complete = Open(flops.back(), "flops", kLanes[i], PERF_TYPE_RAW, config,
+                      pid, cpu);
+      if (!complete && !flops.back().empty()) {
+        flops.emplace_back();
+        complete = Open(flops.back(), "flops", kLanes[i], PERF_TYPE_RAW,
+                        config, pid, cpu);
+      }
+    }
+    // Only report operations if every width is counted
+    for (auto &flopsGroup : flops) {
+      if (complete) {
+        groups.push_back(std::move(flopsGroup));
+      } else {
+        Close(flopsGroup, 0);
+      }
+    }
+  }
+#else
+  (void)pid;
+  (void)cpu;
+  (void)groups;
+#endif
+}
+
+bool PerfCounters::Open(Group_t &group, std::string const &name,
+                        const double weight, const std::uint32_t type,
+                        const std::uint64_t config, const int pid,
+                        const int cpu) {
+#ifdef __linux__
+  perf_event_attr attributes;
+  std::memset(&attributes, 0, sizeof(attributes));
+  attributes.size = sizeof(attributes);
+  attributes.type = type;
+  attributes.config = config;
+  // Members follow their leader, which starts disabled
+  attributes.disabled = group.empty() ? 1 : 0;
+  attributes.exclude_kernel = 1;
+  attributes.exclude_hv = 1;
+  attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+  const int leader = group.empty() ? -1 : group.front().fd;
+  const int fd =
+      syscall(SYS_perf_event_open, &attributes, pid, cpu, leader, 0);
+  if (fd < 0) {
+    return false;
+  }
+  group.emplace_back();
+  group.back().name = name;
+  group.back().weight = weight;
+  group.back().fd = fd;
+  return true;
+#else
+  (void)group;
+  (void)name;
+  (void)weight;
+  (void)type;
+  (void)config;
+  (void)pid;
+  (void)cpu;
+  return false;
+#endif
+}
+
+void PerfCounters::Close(Group_t &group, const size_t first) {
+#ifdef __linux__
+  // Members before their leader
+  for (size_t i = group.size(); i > first; --i) {
+    close(group[i - 1].fd);
+  }
+#endif
+  group.resize(std::min(first, group.size()));
+}
+
+bool PerfCounters::CountsFlops() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  char vendor[12];
+  std::memcpy(vendor, &ebx, 4);
+  std::memcpy(vendor + 4, &edx, 4);
+  std::memcpy(vendor + 8, &ecx, 4);
+  if (std::memcmp(vendor, "GenuineIntel", 12) != 0 ||
+      !__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  const unsigned family = (eax >> 8) & 0xf;
+  const unsigned model = ((eax >> 12) & 0xf0) | ((eax >> 4) & 0xf);
+  // Big cores from Broadwell (0x3d) on, excluding the later Haswell models and
+  // the Atom cores sharing the family
+  constexpr unsigned kExcluded[] = {0x3f, 0x45, 0x46, 0x4c, 0x4d, 0x5a,
+                                    0x5c, 0x5f, 0x7a, 0x86, 0x96, 0x9c};
+  return family == 6 && model >= 0x3d &&
+         std::find(std::begin(kExcluded), std::end(kExcluded), model) ==
+             std::end(kExcluded);
+#else
+  return false;
+#endif
+}
+
+} // End namespace hpcse
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "common/Affinity.h"
+
+namespace hpcse {
+
+/// Pool of persistent worker threads executing submitted tasks. Threads are
+/// created on demand whenever a task is submitted while no worker is idle, and
+/// are kept for reuse until the pool is destroyed. Every submitted task thus
+/// starts without waiting for other tasks to finish, so tasks may synchronize
+/// with each other. Worker i is pinned according to the affinity passed on
+/// construction.
+class ThreadPool {
+
+public:
+  inline explicit ThreadPool(unsigned nThreads = 0,
+                             ThreadAffinity const &affinity = ThreadAffinity());
+
+  /// Finishes all submitted tasks before joining the workers.
+  inline ~ThreadPool();
+
+  ThreadPool(ThreadPool const &) = delete;
+  ThreadPool(ThreadPool &&) = delete;
+  ThreadPool &operator=(ThreadPool const &) = delete;
+  ThreadPool &operator=(ThreadPool &&) = delete;
+
+  /// Runs f(args...) on a worker thread. Exceptions are propagated through the
+  /// returned future.
+  template <typename F, typename... Args>
+  std::future<typename std::result_of<F(Args...)>::type> Submit(F &&f,
+                                                                Args &&... args);
+
+  /// Number of worker threads created so far.
+  inline size_t size() const;
+
+  /// Process-wide pool shared by all drivers that are not passed a pool.
+  static inline ThreadPool &Default();
+
+private:
+  /// Must be called with the mutex held.
+  inline void Spawn();
+
+  inline void Work(unsigned index);
+
+  ThreadAffinity affinity_;
+  std::vector<std::thread> threads_{};
+  std::deque<std::function<void()>> tasks_{};
+  size_t idle_{0};
+  bool stop_{false};
+  mutable std::mutex mutex_{};
+  std::condition_variable cv_{};
+};
+
+ThreadPool::ThreadPool(const unsigned nThreads, ThreadAffinity const &affinity)
+    : affinity_(affinity) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (unsigned i = 0; i < nThreads; ++i) {
+    Spawn();
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto &t : threads_) {
+    t.join();
+  }
+}
+
+template <typename F, typename... Args>
+std::future<typename std::result_of<F(Args...)>::type>
+ThreadPool::Submit(F &&f, Args &&... args) {
+  using R = typename std::result_of<F(Args...)>::type;
+  // std::function must be copyable, so the task is shared
+  auto task = std::make_shared<std::packaged_task<R()>>(
+      std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+  auto future = task->get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.emplace_back([task]() { (*task)(); });
+    if (tasks_.size() > idle_) {
+      Spawn();
+    }
+  }
+  cv_.notify_one();
+  return future;
+}
+
+size_t ThreadPool::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return threads_.size();
+}
+
+ThreadPool &ThreadPool::Default() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void ThreadPool::Spawn() {
+  threads_.emplace_back(&ThreadPool::Work, this, threads_.size());
+}
+
+void ThreadPool::Work(const unsigned index) {
+  affinity_.Pin(index);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    ++idle_;
+    cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+    --idle_;
+    if (tasks_.empty()) {
+      return; // Stopped
+    }
+    auto task = std::move(tasks_.front());
+    tasks_.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+  }
+}
+
+} // End namespace hpcse
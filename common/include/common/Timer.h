@@ -1,9 +1,26 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#if defined(HPCSE_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HPCSE_USE_RDTSC
+#endif
 
 namespace hpcse {
 
+/// Wall clock timer for a single interval, based on the monotonic steady
+/// clock, so that measurements are unaffected by adjustments of the system
+/// time.
 class Timer {
 
 public:
@@ -16,22 +33,323 @@ public:
   inline double Elapsed() const;
 
 private:
-  std::chrono::time_point<std::chrono::system_clock> start_;
+  std::chrono::time_point<std::chrono::steady_clock> start_;
   double elapsed_{};
 }; // End class Timer
 
-Timer::Timer() : start_(std::chrono::system_clock::now()) {}
+/// Monotonic tick counter for timing short intervals. Built with HPCSE_RDTSC
+/// on x86, ticks are read from the time stamp counter in a few nanoseconds,
+/// assuming an invariant TSC as found on all recent x86 processors. Otherwise
+/// ticks are nanoseconds of the steady clock.
+class Clock {
 
-void Timer::Start() { start_ = std::chrono::system_clock::now(); }
+public:
+  static inline std::uint64_t Ticks();
+
+  /// Duration of a tick in seconds. Time stamp counter ticks are calibrated
+  /// against the steady clock on first use, which takes a few milliseconds.
+  static inline double SecondsPerTick();
+};
+
+/// Statistics of a named scope, merged over all threads, with the scopes
+/// entered within it as children. Times are in seconds.
+struct ProfileNode {
+  std::string name{};
+  std::uint64_t count{0};
+  double total{0};
+  double min{0};
+  double max{0};
+  std::vector<ProfileNode> children{};
+};
+
+/// Accumulates the time spent in nested named scopes. Each thread records
+/// into its own tree of scopes, keyed by the name and the enclosing scope, so
+/// entering and leaving a scope takes no lock and costs two clock reads and a
+/// search of the few children of the enclosing scope. Trees are merged by
+/// name when reported.
+class Profiler {
+
+public:
+  static inline Profiler &Get();
+
+  /// Reports to std::cerr if any scopes were recorded and reporting at exit
+  /// was not disabled.
+  inline ~Profiler();
+
+  Profiler(Profiler const &) = delete;
+  Profiler &operator=(Profiler const &) = delete;
+
+  /// Enters the named scope of the calling thread. Names must be string
+  /// literals or otherwise outlive the profiler, and are told apart by
+  /// address when recording.
+  inline void Enter(char const *name);
+
+  /// Leaves the innermost scope of the calling thread, adding ticks to it.
+  inline void Leave(std::uint64_t ticks);
+
+  /// Scopes of all threads merged by name into a tree, whose root is unnamed
+  /// and holds the top level scopes. Must not be called while other threads
+  /// are recording.
+  inline ProfileNode Merge() const;
+
+  /// Writes the merged tree as an indented table, with each scope's share of
+  /// the time of its parent.
+  inline void Report(std::ostream &stream) const;
+
+  inline void ReportAtExit(bool report);
+
+  /// Discards all recorded scopes. Must not be called while any thread is
+  /// inside a scope.
+  inline void Clear();
+
+private:
+  struct Scope {
+    char const *name{nullptr};
+    int parent{0};
+    std::uint64_t count{0};
+    std::uint64_t total{0};
+    std::uint64_t min{std::numeric_limits<std::uint64_t>::max()};
+    std::uint64_t max{0};
+    std::vector<int> children{};
+  };
+
+  struct Tree {
+    /// The first scope is the root, which is never left.
+    std::vector<Scope> scopes{};
+    int current{0};
+  };
+
+  inline Profiler() = default;
+
+  inline Tree &LocalTree();
+
+  static inline void MergeInto(ProfileNode &node, Tree const &tree, int scope,
+                               double secondsPerTick);
+
+  static inline void ReportNode(std::ostream &stream, ProfileNode const &node,
+                                int depth, double parentTotal);
+
+  std::mutex mutex_{};
+  std::vector<std::unique_ptr<Tree>> trees_{};
+  bool reportAtExit_{true};
+};
+
+/// Accumulates the lifetime of the scope into the named scope of the profiler.
+class ProfileScope {
+
+public:
+  inline explicit ProfileScope(char const *name);
+
+  inline ~ProfileScope();
+
+  ProfileScope(ProfileScope const &) = delete;
+  ProfileScope &operator=(ProfileScope const &) = delete;
+
+private:
+  std::uint64_t begin_{0};
+};
+
+/// Profiles the rest of the enclosing scope under the given name. Only
+/// compiled in when HPCSE_PROFILE is defined, so that instrumented inner loops
+/// are unaffected otherwise.
+#ifdef HPCSE_PROFILE
+#define HPCSE_PROFILE_CONCAT_IMPL(A, B) A##B
+#define HPCSE_PROFILE_CONCAT(A, B) HPCSE_PROFILE_CONCAT_IMPL(A, B)
+#define HPCSE_PROFILE_SCOPE(NAME)                                              \
+  ::hpcse::ProfileScope HPCSE_PROFILE_CONCAT(profileScope, __LINE__)(NAME)
+#else
+#define HPCSE_PROFILE_SCOPE(NAME)
+#endif
+
+Timer::Timer() : start_(std::chrono::steady_clock::now()) {}
+
+void Timer::Start() { start_ = std::chrono::steady_clock::now(); }
 
 double Timer::Stop() {
   elapsed_ = 1e-9 *
              std::chrono::duration_cast<std::chrono::nanoseconds>(
-                 std::chrono::system_clock::now() - start_)
+                 std::chrono::steady_clock::now() - start_)
                  .count();
   return elapsed_;
 }
 
 double Timer::Elapsed() const { return elapsed_; }
 
-} // End namespace hocse
+std::uint64_t Clock::Ticks() {
+#ifdef HPCSE_USE_RDTSC
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+double Clock::SecondsPerTick() {
+#ifdef HPCSE_USE_RDTSC
+  static const double secondsPerTick = []() {
+    // Spin rather than sleep, so the core does not enter a low power state
+    constexpr auto kCalibration = std::chrono::milliseconds(20);
+    const auto begin = std::chrono::steady_clock::now();
+    const std::uint64_t ticksBegin = __rdtsc();
+    auto end = begin;
+    while (end - begin < kCalibration) {
+      end = std::chrono::steady_clock::now();
+    }
+    const std::uint64_t ticksEnd = __rdtsc();
+    return std::chrono::duration<double>(end - begin).count() /
+           (ticksEnd - ticksBegin);
+  }();
+  return secondsPerTick;
+#else
+  return 1e-9;
+#endif
+}
+
+Profiler &Profiler::Get() {
+  static Profiler profiler;
+  return profiler;
+}
+
+Profiler::~Profiler() {
+  if (!reportAtExit_) {
+    return;
+  }
+  for (auto &tree : trees_) {
+    if (tree->scopes.size() > 1) {
+      Report(std::cerr);
+      return;
+    }
+  }
+}
+
+void Profiler::Enter(char const *name) {
+  Tree &tree = LocalTree();
+  const int parent = tree.current;
+  for (int child : tree.scopes[parent].children) {
+    if (tree.scopes[child].name == name) {
+      tree.current = child;
+      return;
+    }
+  }
+  const int child = tree.scopes.size();
+  tree.scopes.emplace_back();
+  tree.scopes.back().name = name;
+  tree.scopes.back().parent = parent;
+  tree.scopes[parent].children.emplace_back(child);
+  tree.current = child;
+}
+
+void Profiler::Leave(const std::uint64_t ticks) {
+  Tree &tree = LocalTree();
+  Scope &scope = tree.scopes[tree.current];
+  ++scope.count;
+  scope.total += ticks;
+  scope.min = std::min(scope.min, ticks);
+  scope.max = std::max(scope.max, ticks);
+  tree.current = scope.parent;
+}
+
+ProfileNode Profiler::Merge() const {
+  ProfileNode root;
+  const double secondsPerTick = Clock::SecondsPerTick();
+  for (auto &tree : trees_) {
+    MergeInto(root, *tree, 0, secondsPerTick);
+  }
+  return root;
+}
+
+void Profiler::Report(std::ostream &stream) const {
+  const ProfileNode root = Merge();
+  double total = 0;
+  for (auto &child : root.children) {
+    total += child.total;
+  }
+  stream << std::left << std::setw(32) << "Scope" << std::right
+         << std::setw(12) << "Calls" << std::setw(12) << "Total [s]"
+         << std::setw(12) << "Mean [us]" << std::setw(12) << "Min [us]"
+         << std::setw(12) << "Max [us]" << std::setw(8) << "%"
+         << "\n";
+  for (auto &child : root.children) {
+    ReportNode(stream, child, 0, total);
+  }
+  stream << std::flush;
+}
+
+void Profiler::ReportAtExit(const bool report) { reportAtExit_ = report; }
+
+void Profiler::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &tree : trees_) {
+    tree->scopes.resize(1);
+    tree->scopes[0].children.clear();
+    tree->current = 0;
+  }
+}
+
+Profiler::Tree &Profiler::LocalTree() {
+  // The pointer is shared by all profilers, which is fine since there is only
+  // the one returned by Get
+  thread_local Tree *tree = nullptr;
+  if (tree == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    trees_.emplace_back(new Tree);
+    tree = trees_.back().get();
+    tree->scopes.emplace_back();
+    tree->scopes.back().name = "";
+  }
+  return *tree;
+}
+
+void Profiler::MergeInto(ProfileNode &node, Tree const &tree, const int scope,
+                         const double secondsPerTick) {
+  for (int index : tree.scopes[scope].children) {
+    Scope const &child = tree.scopes[index];
+    // The same name may be recorded from literals at different addresses
+    auto merged = std::find_if(node.children.begin(), node.children.end(),
+                               [&child](ProfileNode const &other) {
+                                 return other.name == child.name;
+                               });
+    if (merged == node.children.end()) {
+      node.children.emplace_back();
+      merged = node.children.end() - 1;
+      merged->name = child.name;
+      merged->min = std::numeric_limits<double>::max();
+    }
+    merged->count += child.count;
+    merged->total += secondsPerTick * child.total;
+    if (child.count > 0) {
+      merged->min = std::min(merged->min, secondsPerTick * child.min);
+      merged->max = std::max(merged->max, secondsPerTick * child.max);
+    }
+    MergeInto(*merged, tree, index, secondsPerTick);
+  }
+}
+
+void Profiler::ReportNode(std::ostream &stream, ProfileNode const &node,
+                          const int depth, const double parentTotal) {
+  const double mean = node.count > 0 ? node.total / node.count : 0;
+  const double min = node.count > 0 ? node.min : 0;
+  stream << std::left << std::setw(32)
+         << std::string(2 * depth, ' ') + node.name << std::right
+         << std::setw(12) << node.count << std::setw(12)
+         << std::setprecision(4) << node.total << std::setw(12)
+         << 1e6 * mean << std::setw(12) << 1e6 * min << std::setw(12)
+         << 1e6 * node.max << std::setw(8) << std::setprecision(3)
+         << (parentTotal > 0 ? 100 * node.total / parentTotal : 0) << "\n";
+  for (auto &child : node.children) {
+    ReportNode(stream, child, depth + 1, node.total);
+  }
+}
+
+ProfileScope::ProfileScope(char const *name) {
+  Profiler::Get().Enter(name);
+  begin_ = Clock::Ticks();
+}
+
+ProfileScope::~ProfileScope() {
+  const std::uint64_t end = Clock::Ticks();
+  Profiler::Get().Leave(end - begin_);
+}
+
+} // End namespace hpcse
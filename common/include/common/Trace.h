@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace hpcse {
+
+/// Interval spent in a phase, in nanoseconds since the tracer was created.
+/// Names must be string literals, since only the pointer is recorded.
+struct TraceEvent {
+  char const *name;
+  std::int64_t begin;
+  std::int64_t end;
+};
+
+/// Trace events of the process, recorded while enabled into one buffer per
+/// thread, so recording takes no lock. Events are exported as Chrome trace
+/// event objects, viewable in chrome://tracing or Perfetto, with one track per
+/// thread in the order in which threads first recorded an event.
+class Tracer {
+
+public:
+  static inline Tracer &Get();
+
+  Tracer(Tracer const &) = delete;
+  Tracer &operator=(Tracer const &) = delete;
+
+  /// Scopes are only recorded while enabled, so a build with tracing compiled
+  /// in only pays for checking the flag unless a trace is requested.
+  inline void Enable(bool enable = true);
+
+  inline bool enabled() const;
+
+  /// Nanoseconds since the tracer was created, from a monotonic clock.
+  inline std::int64_t Now() const;
+
+  inline void Record(char const *name, std::int64_t begin, std::int64_t end);
+
+  /// Discards all events recorded so far.
+  inline void Clear();
+
+  /// Appends the events of all threads as comma-separated Chrome trace event
+  /// objects of process pid, shifting their timestamps by offset nanoseconds,
+  /// which must leave them non-negative. Must not be called while other
+  /// threads are recording.
+  inline void AppendChromeEvents(std::string &output, int pid,
+                                 std::int64_t offset = 0) const;
+
+private:
+  struct Buffer {
+    std::vector<TraceEvent> events{};
+  };
+
+  inline Tracer();
+
+  inline Buffer &LocalBuffer();
+
+  std::chrono::steady_clock::time_point origin_;
+  std::atomic<bool> enabled_{false};
+  std::mutex mutex_{};
+  std::vector<std::unique_ptr<Buffer>> buffers_{};
+};
+
+/// Records the lifetime of the scope as an event of the process tracer.
+class TraceScope {
+
+public:
+  inline explicit TraceScope(char const *name);
+
+  inline ~TraceScope();
+
+  TraceScope(TraceScope const &) = delete;
+  TraceScope &operator=(TraceScope const &) = delete;
+
+private:
+  char const *name_;
+  std::int64_t begin_;
+};
+
+/// Writes events formatted by Tracer::AppendChromeEvents as a Chrome trace.
+inline void WriteChromeTrace(std::ostream &stream, std::string const &events);
+
+/// Traces the rest of the enclosing scope as a phase of the given name. Only
+/// compiled in when HPCSE_TRACE is defined, so that instrumented kernels are
+/// unaffected otherwise.
+#ifdef HPCSE_TRACE
+#define HPCSE_TRACE_CONCAT_IMPL(A, B) A##B
+#define HPCSE_TRACE_CONCAT(A, B) HPCSE_TRACE_CONCAT_IMPL(A, B)
+#define HPCSE_TRACE_SCOPE(NAME)                                                \
+  ::hpcse::TraceScope HPCSE_TRACE_CONCAT(traceScope, __LINE__)(NAME)
+#else
+#define HPCSE_TRACE_SCOPE(NAME)
+#endif
+
+/// True if trace scopes are compiled in.
+#ifdef HPCSE_TRACE
+constexpr bool kTraceCompiled = true;
+#else
+constexpr bool kTraceCompiled = false;
+#endif
+
+Tracer &Tracer::Get() {
+  static Tracer tracer;
+  return tracer;
+}
+
+Tracer::Tracer() : origin_(std::chrono::steady_clock::now()) {}
+
+void Tracer::Enable(const bool enable) {
+  enabled_.store(enable, std::memory_order_relaxed);
+}
+
+bool Tracer::enabled() const {
+  return enabled_.load(std::memory_order_relaxed);
+}
+
+std::int64_t Tracer::Now() const {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - origin_)
+      .count();
+}
+
+void Tracer::Record(char const *name, const std::int64_t begin,
+                    const std::int64_t end) {
+  LocalBuffer().events.emplace_back(TraceEvent{name, begin, end});
+}
+
+void Tracer::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &buffer : buffers_) {
+    buffer->events.clear();
+  }
+}
+
+void Tracer::AppendChromeEvents(std::string &output, const int pid,
+                                const std::int64_t offset) const {
+  // Timestamps and durations are in microseconds, with nanosecond precision
+  auto microseconds = [](const std::int64_t ns) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%lld.%03lld",
+                  static_cast<long long>(ns / 1000),
+                  static_cast<long long>(ns % 1000));
+    return std::string(buffer);
+  };
+  const std::string process = std::to_string(pid);
+  output += (output.empty() ? "" : ",\n") +
+            std::string("{\"name\": \"process_name\", \"ph\": \"M\", ") +
+            "\"pid\": " + process + ", \"tid\": 0, \"args\": {\"name\": " +
+            "\"rank " + process + "\"}}";
+  for (size_t thread = 0; thread < buffers_.size(); ++thread) {
+    const std::string tid = std::to_string(thread);
+    for (auto &event : buffers_[thread]->events) {
+      output += ",\n{\"name\": \"" + std::string(event.name) +
+                "\", \"ph\": \"X\", \"ts\": " +
+                microseconds(event.begin + offset) +
+                ", \"dur\": " + microseconds(event.end - event.begin) +
+                ", \"pid\": " + process + ", \"tid\": " + tid + "}";
+    }
+  }
+}
+
+Tracer::Buffer &Tracer::LocalBuffer() {
+  // The pointer is shared by all tracers, which is fine since there is only
+  // the one returned by Get
+  thread_local Buffer *buffer = nullptr;
+  if (buffer == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.emplace_back(new Buffer);
+    buffer = buffers_.back().get();
+  }
+  return *buffer;
+}
+
+TraceScope::TraceScope(char const *name)
+    : name_(name), begin_(Tracer::Get().enabled() ? Tracer::Get().Now() : -1) {}
+
+TraceScope::~TraceScope() {
+  if (begin_ >= 0) {
+    Tracer &tracer = Tracer::Get();
+    tracer.Record(name_, begin_, tracer.Now());
+  }
+}
+
+void WriteChromeTrace(std::ostream &stream, std::string const &events) {
+  stream << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n" << events
+         << "\n]}\n";
+}
+
+} // End namespace hpcse
@@ -3,43 +3,72 @@
 
 #pragma once
 
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 
 namespace hpcse {
 
+/// Sense-reversing barrier. Arrival is a single atomic decrement, and the last
+/// thread to arrive releases the others by advancing the generation. Waiting
+/// threads spin on the generation for up to spinCount iterations before
+/// falling back to blocking on a condition variable, so short phases never
+/// enter the kernel while long phases do not burn cores. A spin count of zero
+/// always blocks, which is preferable when threads outnumber cores.
 class Barrier {
 
 public:
-  
-  inline Barrier(int nThreads);
+  static constexpr int kDefaultSpinCount = 1 << 14;
+
+  inline Barrier(int nThreads, int spinCount = kDefaultSpinCount);
 
   inline void Synchronize();
 
 private:
+  static inline void Relax();
 
-  int nThreads_, threadsLeft_;
-  bool step_{true};
+  const int nThreads_;
+  const int spinCount_;
+  std::atomic<int> threadsLeft_;
+  std::atomic<unsigned> generation_{0};
+  std::atomic<int> sleeping_{0};
   std::mutex mutex_{};
   std::condition_variable cv_{};
-
 };
 
-Barrier::Barrier(int nThreads) : nThreads_(nThreads), threadsLeft_(nThreads) {}
+Barrier::Barrier(int nThreads, int spinCount)
+    : nThreads_(nThreads), spinCount_(spinCount), threadsLeft_(nThreads) {}
 
 void Barrier::Synchronize() {
-  std::unique_lock<std::mutex> lock(mutex_);
-  --threadsLeft_;
-  if (threadsLeft_ > 0) {
-    auto sleepStep = step_;
-    do {
-      cv_.wait(lock);
-    } while (sleepStep == step_);
-  } else {
-    threadsLeft_ = nThreads_;
-    step_ = !step_;
-    cv_.notify_all();
+  // The generation cannot advance before this thread has arrived
+  const unsigned generation = generation_.load(std::memory_order_relaxed);
+  if (threadsLeft_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    threadsLeft_.store(nThreads_, std::memory_order_relaxed);
+    // Sequentially consistent, so either the waker sees the sleeper or the
+    // sleeper sees the new generation before waiting
+    generation_.fetch_add(1);
+    if (sleeping_.load() > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_all();
+    }
+    return;
+  }
+  for (int i = 0; i < spinCount_; ++i) {
+    if (generation_.load(std::memory_order_acquire) != generation) {
+      return;
+    }
+    Relax();
   }
+  std::unique_lock<std::mutex> lock(mutex_);
+  sleeping_.fetch_add(1);
+  cv_.wait(lock, [this, generation]() { return generation_ != generation; });
+  sleeping_.fetch_sub(1);
+}
+
+void Barrier::Relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
 }
 
 } // End namespace hpcse
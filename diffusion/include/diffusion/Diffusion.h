@@ -3,18 +3,149 @@
 
 #pragma once
 
+#include <functional>
 #include <vector>
+#include "common/Affinity.h"
+#include "common/Checkpoint.h"
+#include "common/ThreadPool.h"
+#include "diffusion/Grid.h"
+#include "diffusion/Storage.h"
 
 namespace hpcse {
 
 using Row_t = std::vector<float>;
 
-using Grid_t = std::vector<Row_t>;
+using Grid_t = Grid<float>;
+
+/// Nested representation used before the introduction of Grid. Snapshots can
+/// be converted with Grid_t::ToNested().
+using NestedGrid_t = std::vector<Row_t>;
+
+/// Consumer of snapshots. Called with the index of the snapshot, the time at
+/// which it was taken and the grid as soon as each snapshot is taken. The grid
+/// is only valid for the duration of the call, so it must be copied if it is to
+/// be kept.
+using SnapshotSink_t =
+    std::function<void(size_t index, float time, Grid_t const &grid)>;
+
+/// Returns a sink appending a copy of every snapshot to output.
+inline SnapshotSink_t CollectSnapshots(std::vector<Grid_t> &output);
+
+/// Placement of the worker threads of the threaded and OpenMP solvers. Each
+/// worker first touches the rows it computes, so with pinning its rows stay on
+/// its own NUMA node. Defaults to no pinning. OpenMP threads stay pinned after
+/// the solver returns.
+void SetDiffusionAffinity(ThreadAffinity const &affinity);
+
+ThreadAffinity const &DiffusionAffinity();
+
+/// Format in which the sequential, threaded and row-decomposed MPI solvers
+/// store the grid. DiffusionGrid always stores single precision. Snapshots are
+/// always passed to sinks in single precision. Defaults to single precision.
+void SetDiffusionStorage(StorageFormat format);
+
+StorageFormat DiffusionStorage();
+
+/// Checkpointing of the sequential and temporally blocked solvers and of
+/// DiffusionGrid. Checkpoints hold the grid and frame buffer, the time, the
+/// step and the index of the next snapshot, and a resumed run passes the
+/// remaining snapshots to the sink exactly as an uninterrupted run would. The
+/// generators of stochastic rounding are not checkpointed, so with 16-bit
+/// storage a resumed run only agrees statistically. Defaults to no
+/// checkpointing.
+void SetDiffusionCheckpointing(Checkpointing const &checkpointing);
+
+Checkpointing const &DiffusionCheckpointing();
+
+/// Runs on the default OpenMP team.
+void Diffusion(unsigned dim, float d, float dt,
+               std::vector<float> const &snapshots,
+               SnapshotSink_t const &sink);
+
+/// Runs nCores workers as tasks of the given pool.
+void Diffusion(unsigned nCores, unsigned dim, float d, float dt,
+               std::vector<float> const &snapshots,
+               SnapshotSink_t const &sink,
+               ThreadPool &pool = ThreadPool::Default());
 
 std::vector<Grid_t> Diffusion(unsigned dim, float d, float dt,
                               std::vector<float> const &snapshots);
 
 std::vector<Grid_t> Diffusion(unsigned nCores, unsigned dim, float d, float dt,
-                              std::vector<float> const &snapshots);
+                              std::vector<float> const &snapshots,
+                              ThreadPool &pool = ThreadPool::Default());
+
+/// Shared-memory solver using temporal blocking: bands of rows are advanced
+/// timeBlock steps while resident in cache before moving on to the next band,
+/// with the bands pipelined across nThreads OpenMP threads. Produces results
+/// identical to Diffusion(dim, d, dt, snapshots) with single precision storage.
+void DiffusionBlocked(unsigned nThreads, unsigned dim, float d, float dt,
+                      std::vector<float> const &snapshots, unsigned timeBlock,
+                      SnapshotSink_t const &sink);
+
+std::vector<Grid_t> DiffusionBlocked(unsigned nThreads, unsigned dim, float d,
+                                     float dt,
+                                     std::vector<float> const &snapshots,
+                                     unsigned timeBlock);
+
+/// Unconditionally stable Peaceman-Rachford alternating direction implicit
+/// solver, so dt is not limited by d*dt/ds^2 <= 1/4 as in the explicit
+/// solvers. Each step solves tridiagonal systems along all rows for half the
+/// timestep, then along all columns, using the Thomas algorithm vectorized
+/// across batches of lines, with the lines split among nThreads OpenMP threads.
+/// The first two steps are taken as implicit Euler steps to damp the sharp
+/// edges of the initial condition, which Crank-Nicolson type schemes otherwise
+/// leave oscillating at large timesteps. Always stores the grid in single
+/// precision.
+void DiffusionImplicit(unsigned nThreads, unsigned dim, float d, float dt,
+                       std::vector<float> const &snapshots,
+                       SnapshotSink_t const &sink);
+
+std::vector<Grid_t> DiffusionImplicit(unsigned nThreads, unsigned dim,
+                                      float d, float dt,
+                                      std::vector<float> const &snapshots);
+
+/// Fully implicit backward Euler solver, stable and free of oscillations for
+/// any timestep. The linear system of each step is solved by conjugate
+/// gradients preconditioned with geometric multigrid V-cycles using red-black
+/// Gauss-Seidel smoothing, costing O(N) work per step for N cells, with every
+/// operation split among nThreads OpenMP threads. Coarser levels aggregate two
+/// by two cells, so any grid dimension is supported.
+void DiffusionMultigrid(unsigned nThreads, unsigned dim, float d, float dt,
+                        std::vector<float> const &snapshots,
+                        SnapshotSink_t const &sink);
+
+/// Variable diffusion constant given for every cell of the grid, including the
+/// boundary. Neighboring cells are coupled through the mean of their diffusion
+/// constants.
+void DiffusionMultigrid(unsigned nThreads, Grid_t const &diffusivity, float dt,
+                        std::vector<float> const &snapshots,
+                        SnapshotSink_t const &sink);
+
+std::vector<Grid_t> DiffusionMultigrid(unsigned nThreads, unsigned dim,
+                                       float d, float dt,
+                                       std::vector<float> const &snapshots);
+
+/// Spectral solver evaluating the solution directly at each snapshot time,
+/// without stepping through the times in between. The initial grid is
+/// transformed once with two-dimensional sine transforms, every mode is decayed
+/// by exp(-d lambda t), where lambda is its eigenvalue of the five-point
+/// Laplacian, and the result is transformed back. This is the exact solution of
+/// the discretization integrated by the stepping solvers, at O(N log N) cost
+/// per snapshot for N cells however far apart snapshots are. Lines are
+/// transformed in parallel by nThreads OpenMP threads.
+void DiffusionSpectral(unsigned nThreads, unsigned dim, float d,
+                       std::vector<float> const &snapshots,
+                       SnapshotSink_t const &sink);
+
+std::vector<Grid_t> DiffusionSpectral(unsigned nThreads, unsigned dim,
+                                      float d,
+                                      std::vector<float> const &snapshots);
+
+SnapshotSink_t CollectSnapshots(std::vector<Grid_t> &output) {
+  return [&output](size_t, float, Grid_t const &grid) {
+    output.emplace_back(grid);
+  };
+}
 
 } // End namespace hpcse
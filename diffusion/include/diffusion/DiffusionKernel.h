@@ -0,0 +1,55 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date November 2015
+
+#pragma once
+
+#include "diffusion/Storage.h"
+
+namespace hpcse {
+
+enum class SimdIsa {
+  scalar,
+  sse,
+  avx2,
+  avx512
+};
+
+/// Five-point stencil update of the elements [jBegin, jEnd) of a single row.
+/// Shared by all backends so that every solver using the same kernel produces
+/// identical results, for any split of the rows into ranges. Dispatches to the
+/// best kernel supported by the executing CPU. The scalar, AVX2 and AVX-512
+/// kernels compute the update with the same fused multiply-adds and agree
+/// bit for bit. The SSE kernel, used on CPUs without FMA, multiplies and adds
+/// separately and rounds differently, so its results differ in the last bits
+/// from those of the other kernels.
+void DiffuseRow(float factor, const float *above, const float *center,
+                const float *below, float *target, int jBegin, int jEnd);
+
+/// Stencil update of rows stored in 16-bit formats. Elements are converted to
+/// single precision in registers, and results are rounded stochastically: up
+/// with a probability equal to their distance from the representable value
+/// below, in units in the last place, so that updates too small to change the
+/// stored value when rounded to nearest still take effect on average. Random
+/// bits are drawn from generators private to the calling thread, so results
+/// depend on which thread updates which rows, and the kernels for different
+/// instruction sets draw them differently.
+void DiffuseRow(float factor, const Half *above, const Half *center,
+                const Half *below, Half *target, int jBegin, int jEnd);
+
+void DiffuseRow(float factor, const BFloat16 *above, const BFloat16 *center,
+                const BFloat16 *below, BFloat16 *target, int jBegin, int jEnd);
+
+/// Most capable instruction set supported by the executing CPU.
+SimdIsa DetectSimdIsa();
+
+/// Instruction set currently used by DiffuseRow.
+SimdIsa DiffusionIsa();
+
+/// Overrides the kernel used by DiffuseRow. Requests for instruction sets not
+/// supported by the CPU fall back to the best supported one. Returns the
+/// instruction set actually selected.
+SimdIsa SetDiffusionIsa(SimdIsa isa);
+
+char const *SimdIsaName(SimdIsa isa);
+
+} // End namespace hpcse
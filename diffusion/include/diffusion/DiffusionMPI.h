@@ -1,13 +1,54 @@
 #pragma once
 
+#include <string>
 #include "diffusion/Diffusion.h"
 
 namespace hpcse {
 
+/// Each rank passes its local block of rows to the sink, whose rows() are only
+/// the rank's own rows; the ghost rows are not part of the snapshot. With
+/// overlap set, the edge rows are computed first and exchanged while the
+/// interior rows are computed. Halos are ghostWidth rows deep and exchanged
+/// every ghostWidth steps, with the rows of the halo advanced redundantly in
+/// between. ghostWidth must not exceed the number of rows of any rank. With
+/// sharedMemory set, the rows of ranks with a neighbor on the same node live in
+/// an MPI-3 shared memory window, and neighbors read each other's edge rows in
+/// place rather than exchanging messages.
+void DiffusionRows(unsigned gridDim, float diffusionConstant, float timeStep,
+                   std::vector<float> const &timesToRecord,
+                   SnapshotSink_t const &sink, bool overlap = true,
+                   unsigned ghostWidth = 1, bool sharedMemory = true);
+
 std::vector<Grid_t> DiffusionRows(unsigned gridDim, float diffusionConstant,
                                   float timeStep,
                                   std::vector<float> const &timesToRecord);
 
+/// Snapshots are gathered on rank 0 as soon as they are taken, and the sink is
+/// only invoked on rank 0. Halos are ghostWidth cells deep and exchanged every
+/// ghostWidth steps, as for DiffusionRows. ghostWidth must not exceed the
+/// number of rows or columns of any rank. Each rank processes its subdomain
+/// with nThreads OpenMP threads, of which only the master thread communicates,
+/// so nThreads above one requires at least funneled MPI thread support. With
+/// sharedMemory set, the subdomains of ranks with a neighbor on the same node
+/// live in an MPI-3 shared memory window. Ghost rows facing such a neighbor
+/// are read in place from its edge rows, and its edge columns are copied into
+/// the ghost columns directly, without exchanging messages. The grid is always
+/// stored in single precision: unlike DiffusionRows, DiffusionGrid has no
+/// 16-bit path, and DiffusionStorage() is ignored.
+void DiffusionGrid(unsigned gridDim, float diffusionConstant, float timeStep,
+                   std::vector<float> const &timesToRecord,
+                   SnapshotSink_t const &sink, unsigned ghostWidth = 1,
+                   unsigned nThreads = 1, bool sharedMemory = true);
+
+/// Snapshots are written to a binary snapshot file at path by all ranks in
+/// parallel using MPI-IO, without gathering the grid on any single rank. With
+/// async set, writes are nonblocking and overlap with the following timesteps.
+void DiffusionGrid(unsigned gridDim, float diffusionConstant, float timeStep,
+                   std::vector<float> const &timesToRecord,
+                   std::string const &path, bool async = false,
+                   unsigned ghostWidth = 1, unsigned nThreads = 1,
+                   bool sharedMemory = true);
+
 std::vector<Grid_t> DiffusionGrid(unsigned gridDim, float diffusionConstant,
                                   float timeStep,
                                   std::vector<float> const &timesToRecord);
@@ -0,0 +1,263 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date November 2015
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include "common/AlignedAllocator.h"
+
+namespace hpcse {
+
+/// Aligned allocator that leaves elements default-initialized when no value is
+/// given, so that pages are first touched by whichever thread writes them.
+template <typename T, unsigned Alignment>
+class FirstTouchAllocator : public AlignedAllocator<T, Alignment> {
+
+public:
+  template <typename U>
+  struct rebind {
+    using other = FirstTouchAllocator<U, Alignment>;
+  };
+
+  using AlignedAllocator<T, Alignment>::construct;
+
+  template <typename U>
+  void construct(U *p) {
+    new (reinterpret_cast<void*>(p)) U;
+  }
+};
+
+/// Two-dimensional grid stored in a single aligned allocation. Each row is
+/// padded so that the first interior element of every row starts on an
+/// Alignment-byte boundary, and an optional ghost layer of width ghost() is
+/// kept around the interior. Rows are accessed through operator[], which
+/// returns a pointer to the first interior element of the row, so ghost cells
+/// are reached with negative indices or indices >= rows()/cols().
+template <typename T, unsigned Alignment = 64>
+class Grid {
+
+  static_assert(Alignment % sizeof(T) == 0,
+                "Alignment must be a multiple of the element size.");
+
+public:
+  using value_type = T;
+  using ContainerType = std::vector<T, FirstTouchAllocator<T, Alignment>>;
+  using Nested_t = std::vector<std::vector<T>>;
+
+  inline Grid();
+
+  inline Grid(int rows, int cols, int ghost = 0, T value = T());
+
+  /// Grid whose memory has not been touched. Every row, including ghost rows,
+  /// must be initialized with FillRows before use, typically by the thread
+  /// that will later work on it so that its pages are placed on that thread's
+  /// NUMA node.
+  static inline Grid Allocate(int rows, int cols, int ghost = 0);
+
+  /// Conversion from the nested vector representation.
+  inline explicit Grid(Nested_t const &nested, int ghost = 0);
+
+  inline T *operator[](int i);
+
+  inline T const *operator[](int i) const;
+
+  inline T &operator()(int i, int j);
+
+  inline T const &operator()(int i, int j) const;
+
+  inline int rows() const;
+
+  inline int cols() const;
+
+  inline int ghost() const;
+
+  /// Distance in elements between the beginning of two consecutive rows.
+  inline int stride() const;
+
+  /// Number of interior rows, for compatibility with the nested layout.
+  inline int size() const;
+
+  /// Beginning of the full allocation, including padding and ghost cells.
+  inline T *data();
+
+  inline T const *data() const;
+
+  /// Number of elements of the full allocation starting at data().
+  inline size_t capacity() const;
+
+  inline void Fill(T value);
+
+  /// Fills the rows [begin, end), including ghost cells and padding. Ghost
+  /// rows are addressed with indices below zero or from rows().
+  inline void FillRows(int begin, int end, T value);
+
+  /// Copies the interior of another grid of the same interior dimensions,
+  /// ignoring ghost width and padding.
+  template <typename U, unsigned AlignmentOther>
+  void CopyInterior(Grid<U, AlignmentOther> const &other);
+
+  /// Conversion to the nested vector representation (interior only).
+  inline Nested_t ToNested() const;
+
+  inline void swap(Grid &other);
+
+private:
+  struct Uninitialized {};
+
+  inline Grid(int rows, int cols, int ghost, Uninitialized);
+
+  static constexpr int kAlignElements = Alignment / sizeof(T);
+
+  static inline int RoundUp(int n);
+
+  int rows_{0}, cols_{0}, ghost_{0};
+  int leading_{0}, stride_{0};
+  ContainerType data_{};
+};
+
+template <typename T, unsigned Alignment>
+Grid<T, Alignment>::Grid() = default;
+
+template <typename T, unsigned Alignment>
+Grid<T, Alignment>::Grid(const int rows, const int cols, const int ghost,
+                         const T value)
+    : rows_(rows), cols_(cols), ghost_(ghost), leading_(RoundUp(ghost)),
+      stride_(RoundUp(leading_ + cols + ghost)),
+      data_(static_cast<size_t>(stride_) * (rows + 2 * ghost), value) {
+  assert(rows >= 0 && cols >= 0 && ghost >= 0);
+}
+
+template <typename T, unsigned Alignment>
+Grid<T, Alignment>::Grid(const int rows, const int cols, const int ghost,
+                         Uninitialized)
+    : rows_(rows), cols_(cols), ghost_(ghost), leading_(RoundUp(ghost)),
+      stride_(RoundUp(leading_ + cols + ghost)),
+      data_(static_cast<size_t>(stride_) * (rows + 2 * ghost)) {
+  assert(rows >= 0 && cols >= 0 && ghost >= 0);
+}
+
+template <typename T, unsigned Alignment>
+Grid<T, Alignment> Grid<T, Alignment>::Allocate(const int rows, const int cols,
+                                                const int ghost) {
+  return Grid(rows, cols, ghost, Uninitialized());
+}
+
+template <typename T, unsigned Alignment>
+Grid<T, Alignment>::Grid(Nested_t const &nested, const int ghost)
+    : Grid(nested.size(), nested.empty() ? 0 : nested[0].size(), ghost) {
+  for (int i = 0; i < rows_; ++i) {
+    assert(static_cast<int>(nested[i].size()) == cols_);
+    std::copy(nested[i].cbegin(), nested[i].cend(), (*this)[i]);
+  }
+}
+
+template <typename T, unsigned Alignment>
+T *Grid<T, Alignment>::operator[](const int i) {
+  return data_.data() + static_cast<ptrdiff_t>(i + ghost_) * stride_ +
+         leading_;
+}
+
+template <typename T, unsigned Alignment>
+T const *Grid<T, Alignment>::operator[](const int i) const {
+  return data_.data() + static_cast<ptrdiff_t>(i + ghost_) * stride_ +
+         leading_;
+}
+
+template <typename T, unsigned Alignment>
+T &Grid<T, Alignment>::operator()(const int i, const int j) {
+  return (*this)[i][j];
+}
+
+template <typename T, unsigned Alignment>
+T const &Grid<T, Alignment>::operator()(const int i, const int j) const {
+  return (*this)[i][j];
+}
+
+template <typename T, unsigned Alignment>
+int Grid<T, Alignment>::rows() const {
+  return rows_;
+}
+
+template <typename T, unsigned Alignment>
+int Grid<T, Alignment>::cols() const {
+  return cols_;
+}
+
+template <typename T, unsigned Alignment>
+int Grid<T, Alignment>::ghost() const {
+  return ghost_;
+}
+
+template <typename T, unsigned Alignment>
+int Grid<T, Alignment>::stride() const {
+  return stride_;
+}
+
+template <typename T, unsigned Alignment>
+int Grid<T, Alignment>::size() const {
+  return rows_;
+}
+
+template <typename T, unsigned Alignment>
+T *Grid<T, Alignment>::data() {
+  return data_.data();
+}
+
+template <typename T, unsigned Alignment>
+T const *Grid<T, Alignment>::data() const {
+  return data_.data();
+}
+
+template <typename T, unsigned Alignment>
+size_t Grid<T, Alignment>::capacity() const {
+  return data_.size();
+}
+
+template <typename T, unsigned Alignment>
+void Grid<T, Alignment>::Fill(const T value) {
+  std::fill(data_.begin(), data_.end(), value);
+}
+
+template <typename T, unsigned Alignment>
+void Grid<T, Alignment>::FillRows(const int begin, const int end,
+                                  const T value) {
+  assert(begin >= -ghost_ && end <= rows_ + ghost_);
+  std::fill((*this)[begin] - leading_, (*this)[end] - leading_, value);
+}
+
+template <typename T, unsigned Alignment>
+template <typename U, unsigned AlignmentOther>
+void Grid<T, Alignment>::CopyInterior(Grid<U, AlignmentOther> const &other) {
+  assert(other.rows() == rows_ && other.cols() == cols_);
+  for (int i = 0; i < rows_; ++i) {
+    std::copy(other[i], other[i] + cols_, (*this)[i]);
+  }
+}
+
+template <typename T, unsigned Alignment>
+typename Grid<T, Alignment>::Nested_t Grid<T, Alignment>::ToNested() const {
+  Nested_t output(rows_);
+  for (int i = 0; i < rows_; ++i) {
+    output[i].assign((*this)[i], (*this)[i] + cols_);
+  }
+  return output;
+}
+
+template <typename T, unsigned Alignment>
+void Grid<T, Alignment>::swap(Grid &other) {
+  std::swap(rows_, other.rows_);
+  std::swap(cols_, other.cols_);
+  std::swap(ghost_, other.ghost_);
+  std::swap(leading_, other.leading_);
+  std::swap(stride_, other.stride_);
+  data_.swap(other.data_);
+}
+
+template <typename T, unsigned Alignment>
+int Grid<T, Alignment>::RoundUp(const int n) {
+  return ((n + kAlignElements - 1) / kAlignElements) * kAlignElements;
+}
+
+} // End namespace hpcse
@@ -0,0 +1,204 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date November 2015
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "diffusion/Grid.h"
+
+namespace hpcse {
+
+/// Format in which grid cells are stored. Updates are always computed in
+/// single precision, and 16-bit formats are only converted when loaded into or
+/// stored from registers, halving the memory traffic of the stencil. Updated
+/// values are rounded stochastically (see DiffuseRow), since with rounding to
+/// nearest every update smaller than half a unit in the last place is lost,
+/// and with small timesteps the grid would not evolve at all. Stochastic
+/// rounding keeps such updates in expectation, but adds noise of about one
+/// unit in the last place per step: snapshots deviate from single precision by
+/// a few tenths of a percent of the maximum with float16, and by about one
+/// percent with bfloat16.
+enum class StorageFormat {
+  float32,
+  float16,
+  bfloat16
+};
+
+/// IEEE 754 binary16 value stored as raw bits: 11 significant bits over a
+/// range of about 6e-8 to 65504.
+struct Half {
+  std::uint16_t bits;
+};
+
+/// Upper half of an IEEE 754 binary32 value stored as raw bits: 8 significant
+/// bits over the full single precision range.
+struct BFloat16 {
+  std::uint16_t bits;
+};
+
+template <typename T> struct StorageFormatOf;
+
+template <> struct StorageFormatOf<float> {
+  static constexpr StorageFormat value = StorageFormat::float32;
+};
+
+template <> struct StorageFormatOf<Half> {
+  static constexpr StorageFormat value = StorageFormat::float16;
+};
+
+template <> struct StorageFormatOf<BFloat16> {
+  static constexpr StorageFormat value = StorageFormat::bfloat16;
+};
+
+inline float ToFloat(float value);
+
+inline float ToFloat(Half value);
+
+inline float ToFloat(BFloat16 value);
+
+/// Rounds to the nearest value representable in T, ties to even.
+template <typename T> inline T FromFloat(float value);
+
+/// Converts n consecutive elements using the same instruction set as
+/// DiffuseRow.
+void ConvertRow(Half const *input, float *output, int n);
+
+void ConvertRow(BFloat16 const *input, float *output, int n);
+
+void ConvertRow(float const *input, Half *output, int n);
+
+void ConvertRow(float const *input, BFloat16 *output, int n);
+
+inline void ConvertRow(float const *input, float *output, int n);
+
+/// Grid in single precision for passing to consumers of snapshots. Grids in
+/// 16-bit formats are converted into output, including ghost cells, which is
+/// reallocated if its dimensions differ. Single precision grids are returned
+/// as they are.
+template <typename T>
+Grid<float> const &AsFloat(Grid<T> const &grid, Grid<float> &output);
+
+inline Grid<float> const &AsFloat(Grid<float> const &grid, Grid<float> &);
+
+/// Deviation of a grid from a reference grid of the same dimensions.
+struct StorageError {
+  double maxAbsolute;
+  double rms;
+  /// Largest absolute deviation relative to the largest magnitude of the
+  /// reference.
+  double maxRelative;
+};
+
+StorageError CompareGrids(Grid<float> const &reference,
+                          Grid<float> const &grid);
+
+char const *StorageFormatName(StorageFormat format);
+
+/// Half the distance from one to the next larger value of the format, the
+/// largest relative error of rounding a value to nearest.
+double UnitRoundoff(StorageFormat format);
+
+/// Parses "float32", "float16" or "bfloat16". Throws std::invalid_argument
+/// for any other input.
+StorageFormat ParseStorageFormat(std::string const &name);
+
+float ToFloat(const float value) { return value; }
+
+float ToFloat(const Half value) {
+  const std::uint32_t sign = static_cast<std::uint32_t>(value.bits & 0x8000)
+                             << 16;
+  const std::uint32_t exponent = (value.bits >> 10) & 0x1f;
+  const std::uint32_t mantissa = value.bits & 0x3ff;
+  std::uint32_t bits;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13); // Infinity or NaN
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else {
+    // Subnormal values are multiples of 2^-24, which is exact in binary32
+    const float magnitude = mantissa * 5.9604644775390625e-8f;
+    return sign != 0 ? -magnitude : magnitude;
+  }
+  float output;
+  std::memcpy(&output, &bits, sizeof(output));
+  return output;
+}
+
+float ToFloat(const BFloat16 value) {
+  const std::uint32_t bits = static_cast<std::uint32_t>(value.bits) << 16;
+  float output;
+  std::memcpy(&output, &bits, sizeof(output));
+  return output;
+}
+
+template <>
+inline float FromFloat<float>(const float value) {
+  return value;
+}
+
+template <>
+inline Half FromFloat<Half>(const float value) {
+  std::uint32_t x;
+  std::memcpy(&x, &value, sizeof(x));
+  const std::uint32_t sign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+  std::uint32_t bits;
+  if (x >= 0x7f800000) {
+    bits = x > 0x7f800000 ? 0x7e00 : 0x7c00; // NaN or infinity
+  } else if (x >= 0x477ff000) {
+    bits = 0x7c00; // Rounds beyond 65504
+  } else if (x >= 0x38800000) {
+    // Normal: rebias the exponent and round the mantissa to 10 bits
+    bits = (x + 0xfff + ((x >> 13) & 1) - 0x38000000) >> 13;
+  } else if (x >= 0x33000000) {
+    // Subnormal: round the full significand to a multiple of 2^-24
+    const std::uint32_t significand = (x & 0x7fffff) | 0x800000;
+    const int shift = 126 - static_cast<int>(x >> 23);
+    const std::uint32_t remainder = significand & ((1u << shift) - 1);
+    const std::uint32_t halfway = 1u << (shift - 1);
+    bits = significand >> shift;
+    if (remainder > halfway || (remainder == halfway && (bits & 1))) {
+      ++bits;
+    }
+  } else {
+    bits = 0;
+  }
+  return Half{static_cast<std::uint16_t>(sign | bits)};
+}
+
+template <>
+inline BFloat16 FromFloat<BFloat16>(const float value) {
+  std::uint32_t x;
+  std::memcpy(&x, &value, sizeof(x));
+  if ((x & 0x7fffffff) > 0x7f800000) {
+    return BFloat16{static_cast<std::uint16_t>((x >> 16) | 0x40)}; // Quiet NaN
+  }
+  return BFloat16{
+      static_cast<std::uint16_t>((x + 0x7fff + ((x >> 16) & 1)) >> 16)};
+}
+
+void ConvertRow(float const *input, float *output, const int n) {
+  std::copy(input, input + n, output);
+}
+
+template <typename T>
+Grid<float> const &AsFloat(Grid<T> const &grid, Grid<float> &output) {
+  const int ghost = grid.ghost();
+  if (output.rows() != grid.rows() || output.cols() != grid.cols() ||
+      output.ghost() != ghost) {
+    output = Grid<float>(grid.rows(), grid.cols(), ghost);
+  }
+  for (int i = -ghost, iEnd = grid.rows() + ghost; i < iEnd; ++i) {
+    ConvertRow(grid[i] - ghost, output[i] - ghost, grid.cols() + 2 * ghost);
+  }
+  return output;
+}
+
+Grid<float> const &AsFloat(Grid<float> const &grid, Grid<float> &) {
+  return grid;
+}
+
+} // End namespace hpcse
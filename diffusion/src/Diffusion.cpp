@@ -5,25 +5,107 @@
 
 namespace hpcse {
 
-std::vector<Grid_t> DiffusionSequential(unsigned dim, float d, float dt,
-                                        std::vector<float> const &snapshots);
+namespace {
 
-std::vector<Grid_t> DiffusionParallel(unsigned nCores, unsigned dim, float d,
-                                      float dt,
-                                      std::vector<float> const &snapshots);
+ThreadAffinity &AffinityInstance() {
+  static ThreadAffinity affinity;
+  return affinity;
+}
 
-std::vector<Grid_t> Diffusion(unsigned dim, float d, float dt,
-                              std::vector<float> const &snapshots) {
-  return DiffusionSequential(dim, d, dt, snapshots);
+} // End anonymous namespace
+
+void SetDiffusionAffinity(ThreadAffinity const &affinity) {
+  AffinityInstance() = affinity;
 }
 
-std::vector<Grid_t> Diffusion(unsigned nCores, unsigned dim, float d, float dt,
-                              std::vector<float> const &snapshots) {
+ThreadAffinity const &DiffusionAffinity() { return AffinityInstance(); }
+
+namespace {
+
+StorageFormat &StorageInstance() {
+  static StorageFormat format = StorageFormat::float32;
+  return format;
+}
+
+} // End anonymous namespace
+
+void SetDiffusionStorage(const StorageFormat format) {
+  StorageInstance() = format;
+}
+
+StorageFormat DiffusionStorage() { return StorageInstance(); }
+
+namespace {
+
+Checkpointing &CheckpointingInstance() {
+  static Checkpointing checkpointing;
+  return checkpointing;
+}
+
+} // End anonymous namespace
+
+void SetDiffusionCheckpointing(Checkpointing const &checkpointing) {
+  CheckpointingInstance() = checkpointing;
+}
+
+Checkpointing const &DiffusionCheckpointing() {
+  return CheckpointingInstance();
+}
+
+/// Runs on an OpenMP team of nThreads threads, or the default team for 0.
+void DiffusionSequential(unsigned nThreads, unsigned dim, float d, float dt,
+                         std::vector<float> const &snapshots,
+                         unsigned timeBlock, SnapshotSink_t const &sink);
+
+void DiffusionParallel(unsigned nCores, unsigned dim, float d, float dt,
+                       std::vector<float> const &snapshots,
+                       SnapshotSink_t const &sink, ThreadPool &pool);
+
+void Diffusion(unsigned dim, float d, float dt,
+               std::vector<float> const &snapshots,
+               SnapshotSink_t const &sink) {
+  DiffusionSequential(0, dim, d, dt, snapshots, 1, sink);
+}
+
+void Diffusion(unsigned nCores, unsigned dim, float d, float dt,
+               std::vector<float> const &snapshots,
+               SnapshotSink_t const &sink, ThreadPool &pool) {
   if (nCores > 1) {
-    return DiffusionParallel(nCores, dim, d, dt, snapshots);
+    DiffusionParallel(nCores, dim, d, dt, snapshots, sink, pool);
   } else {
-    return DiffusionSequential(dim, d, dt, snapshots);
+    DiffusionSequential(1, dim, d, dt, snapshots, 1, sink);
   }
 }
 
+std::vector<Grid_t> Diffusion(unsigned dim, float d, float dt,
+                              std::vector<float> const &snapshots) {
+  std::vector<Grid_t> output;
+  Diffusion(dim, d, dt, snapshots, CollectSnapshots(output));
+  return output;
+}
+
+std::vector<Grid_t> Diffusion(unsigned nCores, unsigned dim, float d, float dt,
+                              std::vector<float> const &snapshots,
+                              ThreadPool &pool) {
+  std::vector<Grid_t> output;
+  Diffusion(nCores, dim, d, dt, snapshots, CollectSnapshots(output), pool);
+  return output;
+}
+
+void DiffusionBlocked(unsigned nThreads, unsigned dim, float d, float dt,
+                      std::vector<float> const &snapshots, unsigned timeBlock,
+                      SnapshotSink_t const &sink) {
+  DiffusionSequential(nThreads, dim, d, dt, snapshots, timeBlock, sink);
+}
+
+std::vector<Grid_t> DiffusionBlocked(unsigned nThreads, unsigned dim, float d,
+                                     float dt,
+                                     std::vector<float> const &snapshots,
+                                     unsigned timeBlock) {
+  std::vector<Grid_t> output;
+  DiffusionBlocked(nThreads, dim, d, dt, snapshots, timeBlock,
+                   CollectSnapshots(output));
+  return output;
+}
+
 } // End namespace hpcse
@@ -1,35 +1,181 @@
 #include <algorithm>
-#include <cmath>
+#include <array>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 #include "common/Timer.h"
 #include "common/Mpi.h"
+#include "common/Trace.h"
 #include "diffusion/Diffusion.h"
 #include "diffusion/DiffusionMPI.h"
+#include "diffusion/DiffusionKernel.h"
+#include "snapshot/SnapshotFile.h"
 
 namespace hpcse {
 
-std::vector<Grid_t> DiffusionGrid(const unsigned gridDim, const float d,
-                                  const float dt,
-                                  std::vector<float> const &_timesToRecord) {
+namespace {
 
-  std::vector<float> timesToRecord(_timesToRecord);
-  const int nSnapshots = timesToRecord.size();
+/// Writes snapshots into a snapshot file shared by all ranks. Each rank sets a
+/// file view selecting its block of every snapshot, so snapshot index is
+/// written collectively at offset index * (local block size). With async set,
+/// the local block is copied into one of two staging buffers and written with
+/// a nonblocking collective that completes while the simulation continues.
+class SnapshotFileView {
 
-  // Construct cartesian grid
-  int nHorizontal, nVertical;
-  const int nRanks = mpi::size();
-  nHorizontal = nVertical = std::sqrt(nRanks);
-  while (true) {
-    int nCells = nHorizontal*nVertical;
-    if (nCells == nRanks) {
-      break;
-    }
-    if (nCells < nRanks) {
-      ++nVertical;
-    } else {
-      --nHorizontal;
+public:
+  SnapshotFileView(std::string const &path, unsigned gridDim, float dt,
+                   size_t nSnapshots, int rowBegin, int nRows, int colBegin,
+                   int nCols, bool async);
+
+  ~SnapshotFileView();
+
+  SnapshotFileView(SnapshotFileView const &) = delete;
+  SnapshotFileView &operator=(SnapshotFileView const &) = delete;
+
+  /// Writes the local block, whose rows are stride elements apart from first.
+  void Write(size_t index, float t, float const *first, int stride);
+
+  /// Waits for pending asynchronous writes.
+  void Flush();
+
+  /// Times of the snapshots written so far, written to the file on
+  /// destruction.
+  std::vector<double> &times();
+
+private:
+  SnapshotFileHeader header_;
+  mpi::File file_;
+  int nRows_, nCols_;
+  bool async_;
+  MPI_Datatype fileType_{}, memoryType_{MPI_DATATYPE_NULL};
+  std::array<std::vector<float>, 2> staging_{};
+  std::array<MPI_Request, 2> requests_{{MPI_REQUEST_NULL, MPI_REQUEST_NULL}};
+  std::vector<double> times_;
+};
+
+SnapshotFileView::SnapshotFileView(std::string const &path,
+                                   const unsigned gridDim, const float dt,
+                                   const size_t nSnapshots, const int rowBegin,
+                                   const int nRows, const int colBegin,
+                                   const int nCols, const bool async)
+    : header_(MakeSnapshotHeader(SnapshotType::float32, gridDim, gridDim, dt,
+                                 nSnapshots)),
+      file_(path, MPI_MODE_CREATE | MPI_MODE_WRONLY), nRows_(nRows),
+      nCols_(nCols), async_(async), times_(nSnapshots) {
+  // Truncates any previous content and covers the padding of the last
+  // snapshot, so the file can be mapped by readers
+  MPI_File_set_size(file_.handle(), SnapshotFileSize(header_));
+  // Tile the local block with the snapshot stride, so consecutive snapshots
+  // are consecutive in the view
+  MPI_Datatype block = mpi::Subarray<float, 2>(
+      {{static_cast<int>(gridDim), static_cast<int>(gridDim)}},
+      {{nRows, nCols}}, {{rowBegin, colBegin}});
+  MPI_Type_create_resized(block, 0, header_.snapshotBytes, &fileType_);
+  MPI_Type_commit(&fileType_);
+  MPI_Type_free(&block);
+  MPI_File_set_view(file_.handle(), header_.dataOffset, MPI_FLOAT, fileType_,
+                    "native", MPI_INFO_NULL);
+  if (async_) {
+    staging_[0].resize(nRows * nCols);
+    staging_[1].resize(nRows * nCols);
+  }
+}
+
+SnapshotFileView::~SnapshotFileView() {
+  MPI_Waitall(2, requests_.data(), MPI_STATUSES_IGNORE);
+  // Header and times are written last, since the actual times are only known
+  // once all snapshots have been taken
+  MPI_File_set_view(file_.handle(), 0, MPI_BYTE, MPI_BYTE, "native",
+                    MPI_INFO_NULL);
+  if (mpi::rank() == 0) {
+    MPI_File_write_at(file_.handle(), 0, &header_, sizeof(header_), MPI_BYTE,
+                      MPI_STATUS_IGNORE);
+    MPI_File_write_at(file_.handle(), sizeof(header_), times_.data(),
+                      times_.size(), MPI_DOUBLE, MPI_STATUS_IGNORE);
+  }
+  MPI_Type_free(&fileType_);
+  if (memoryType_ != MPI_DATATYPE_NULL) {
+    MPI_Type_free(&memoryType_);
+  }
+}
+
+void SnapshotFileView::Write(const size_t index, const float t,
+                             float const *const first, const int stride) {
+  times_[index] = t;
+  const MPI_Offset offset = static_cast<MPI_Offset>(index) * nRows_ * nCols_;
+  if (!async_) {
+    if (memoryType_ == MPI_DATATYPE_NULL) {
+      MPI_Type_vector(nRows_, nCols_, stride, MPI_FLOAT, &memoryType_);
+      MPI_Type_commit(&memoryType_);
     }
+    MPI_File_write_at_all(file_.handle(), offset, first, 1, memoryType_,
+                          MPI_STATUS_IGNORE);
+    return;
   }
-  mpi::CartesianGrid<2> mpiGrid({{nVertical, nHorizontal}}, false);
+  const int buffer = index % 2;
+  mpi::Wait(requests_[buffer]);
+  float *staging = staging_[buffer].data();
+  for (int i = 0; i < nRows_; ++i) {
+    std::copy(first + static_cast<ptrdiff_t>(i) * stride,
+              first + static_cast<ptrdiff_t>(i) * stride + nCols_,
+              staging + i * nCols_);
+  }
+  MPI_File_iwrite_at_all(file_.handle(), offset, staging, nRows_ * nCols_,
+                         MPI_FLOAT, &requests_[buffer]);
+}
+
+void SnapshotFileView::Flush() {
+  MPI_Waitall(2, requests_.data(), MPI_STATUSES_IGNORE);
+}
+
+std::vector<double> &SnapshotFileView::times() { return times_; }
+
+/// Placement in memory of the time levels of a subdomain of rows by cols cells
+/// with ghost cells on every side, laid out as by Grid_t::Allocate(rows, cols,
+/// ghost), one level after the other.
+struct LevelLayout {
+  LevelLayout(const int _rows, const int _cols, const int _ghost)
+      : rows(_rows), cols(_cols), ghost(_ghost), leading(RoundUp(ghost)),
+        stride(RoundUp(leading + cols + ghost)),
+        size(static_cast<size_t>(stride) * (rows + 2 * ghost)) {}
+
+  /// Storage of the given level of the levels starting at base.
+  float *Level(float *const base, const int level) const {
+    return base + level * size;
+  }
+
+  /// First interior cell of row i, where ghost rows are negative or at least
+  /// rows.
+  float *Row(float *const base, const int level, const int i) const {
+    return Level(base, level) + static_cast<ptrdiff_t>(i + ghost) * stride +
+           leading;
+  }
+
+  static int RoundUp(const int n) {
+    constexpr int kAlignElements = 64 / sizeof(float);
+    return (n + kAlignElements - 1) / kAlignElements * kAlignElements;
+  }
+
+  int rows, cols, ghost, leading, stride;
+  size_t size;
+};
+
+void DiffusionGridImpl(const unsigned gridDim, const float d, const float dt,
+                       std::vector<float> const &_timesToRecord,
+                       SnapshotSink_t const *sink, std::string const *path,
+                       const bool async, const unsigned ghostWidth,
+                       const unsigned nThreads, const bool sharedMemory) {
+
+  std::vector<float> timesToRecord(_timesToRecord);
+
+  // Construct cartesian grid, balancing computation against halo traffic for
+  // any number of ranks
+  mpi::CartesianGrid<2> mpiGrid(
+      Decompose<2>(mpi::size(), {{static_cast<int>(gridDim),
+                                  static_cast<int>(gridDim)}}),
+      false);
 
   // Determine local grid
   const int rowBegin = gridDim * mpiGrid.row() / mpiGrid.rowMax();
@@ -38,7 +184,149 @@ std::vector<Grid_t> DiffusionGrid(const unsigned gridDim, const float d,
   const int colBegin = gridDim * mpiGrid.col() / mpiGrid.colMax();
   const int colEnd = gridDim * (mpiGrid.col() + 1) / mpiGrid.colMax();
   const int nCols = colEnd - colBegin;
-  Grid_t grid(nRows + 2, Row_t(nCols + 2)); // Added padding
+  // Every rank must be able to fill its neighbors' halos from its own cells
+  if (ghostWidth < 1 ||
+      ghostWidth > gridDim / std::max(mpiGrid.rowMax(), mpiGrid.colMax())) {
+    throw std::invalid_argument(
+        "Ghost width must be between 1 and the smallest number of rows or "
+        "columns per rank.");
+  }
+  // Only the master thread of each rank communicates
+  if (nThreads < 1 || (nThreads > 1 &&
+                       mpi::threadLevel() < mpi::ThreadLevel::funneled)) {
+    throw std::invalid_argument(
+        "Running multiple threads per rank requires MPI to be initialized "
+        "with at least funneled thread support.");
+  }
+  const int k = ghostWidth;
+  const MPI_Comm cartComm = mpiGrid.comm();
+  const int up = mpiGrid.up().first;
+  const int down = mpiGrid.down().first;
+  const int left = mpiGrid.left().first;
+  const int right = mpiGrid.right().first;
+  auto rowsOf = [gridDim, &mpiGrid](const int r) {
+    return static_cast<int>(gridDim * (r + 1) / mpiGrid.rowMax() -
+                            gridDim * r / mpiGrid.rowMax());
+  };
+  auto colsOf = [gridDim, &mpiGrid](const int c) {
+    return static_cast<int>(gridDim * (c + 1) / mpiGrid.colMax() -
+                            gridDim * c / mpiGrid.colMax());
+  };
+
+  // Both time levels of the subdomain, with k ghost cells on every side, are
+  // stored in one allocation. If any neighbor is on the same node, that is a
+  // segment of a shared window, and no messages are exchanged with neighbors
+  // on the node: ghost rows facing them are addressed through tables of row
+  // pointers, which at the beginning of every exchange point straight at the
+  // neighbors' edge rows, and their edge columns are copied into the ghost
+  // columns with the stride of their rows. Three counters per rank in a
+  // second window synchronize this, counting the exchanges whose edges have
+  // been computed, whose halos are complete, and the neighbors' rows consumed
+  MPI_Comm nodeComm = mpi::SplitShared(cartComm);
+  auto nodeRank = [&](const int neighbor) {
+    return sharedMemory ? mpi::TranslateRank(neighbor, cartComm, nodeComm)
+                        : MPI_UNDEFINED;
+  };
+  const int nodeUp = nodeRank(up);
+  const int nodeDown = nodeRank(down);
+  const int nodeLeft = nodeRank(left);
+  const int nodeRight = nodeRank(right);
+  auto onNode = [](const int r) {
+    return r != MPI_UNDEFINED && r != MPI_PROC_NULL;
+  };
+  const bool sharedUp = onNode(nodeUp);
+  const bool sharedDown = onNode(nodeDown);
+  const bool sharedLeft = onNode(nodeLeft);
+  const bool sharedRight = onNode(nodeRight);
+  const bool shared = sharedUp || sharedDown || sharedLeft || sharedRight;
+  const LevelLayout layout(nRows, nCols, k);
+  constexpr size_t kAlignPadding = 64 / sizeof(float);
+  mpi::SharedWindow<float> window(
+      shared ? 2 * layout.size + kAlignPadding : 0, nodeComm);
+  enum Counter { kEdges, kHalos, kConsumed, kCounters };
+  mpi::SharedWindow<long> counters(shared ? kCounters : 0, nodeComm);
+  std::vector<float, FirstTouchAllocator<float, 64>> privateLevels(
+      shared ? 0 : 2 * layout.size);
+  float *const local =
+      shared ? mpi::AlignUp(window.data()) : privateLevels.data();
+  // Neighbors in the same row of ranks have the same number of rows, and
+  // those in the same column the same number of columns
+  const LevelLayout upLayout(sharedUp ? rowsOf(mpiGrid.row() - 1) : 0, nCols,
+                             k);
+  const LevelLayout downLayout(sharedDown ? rowsOf(mpiGrid.row() + 1) : 0,
+                               nCols, k);
+  const LevelLayout leftLayout(nRows, sharedLeft ? colsOf(mpiGrid.col() - 1)
+                                                 : 0, k);
+  const LevelLayout rightLayout(nRows, sharedRight ? colsOf(mpiGrid.col() + 1)
+                                                   : 0, k);
+  auto segment = [&window](const bool isShared, const int r) {
+    return isShared ? mpi::AlignUp(window.Query(r)) : nullptr;
+  };
+  float *const upLevels = segment(sharedUp, nodeUp);
+  float *const downLevels = segment(sharedDown, nodeDown);
+  float *const leftLevels = segment(sharedLeft, nodeLeft);
+  float *const rightLevels = segment(sharedRight, nodeRight);
+  long *const ownCounters = shared ? counters.data() : nullptr;
+  std::array<long const *, 4> neighborCounters{{
+      sharedUp ? counters.Query(nodeUp) : nullptr,
+      sharedDown ? counters.Query(nodeDown) : nullptr,
+      sharedLeft ? counters.Query(nodeLeft) : nullptr,
+      sharedRight ? counters.Query(nodeRight) : nullptr}};
+  MPI_Comm_free(&nodeComm);
+  std::array<std::vector<float *>, 2> rows;
+  auto detachNeighbors = [&](const int level) {
+    for (int r = 0; r < k; ++r) {
+      rows[level][r] = layout.Row(local, level, r - k);
+      rows[level][nRows + k + r] = layout.Row(local, level, nRows + r);
+    }
+  };
+  auto attachNeighbors = [&](const int level) {
+    for (int r = 0; r < k; ++r) {
+      if (sharedUp) {
+        rows[level][r] =
+            upLayout.Row(upLevels, level, upLayout.rows - k + r);
+      }
+      if (sharedDown) {
+        rows[level][nRows + k + r] = downLayout.Row(downLevels, level, r);
+      }
+    }
+  };
+  for (int level = 0; level < 2; ++level) {
+    rows[level].resize(nRows + 2 * k);
+    for (int i = 0; i < nRows; ++i) {
+      rows[level][k + i] = layout.Row(local, level, i);
+    }
+    detachNeighbors(level);
+  }
+  auto copyColumns = [&](const int level) {
+    for (int i = 0; i < nRows; ++i) {
+      float *const row = layout.Row(local, level, i);
+      if (sharedLeft) {
+        float const *const source =
+            leftLayout.Row(leftLevels, level, i) + leftLayout.cols;
+        std::copy(source - k, source, row - k);
+      }
+      if (sharedRight) {
+        float const *const source = rightLayout.Row(rightLevels, level, i);
+        std::copy(source, source + k, row + nCols);
+      }
+    }
+  };
+  // Counters are stored with release semantics after synchronizing the
+  // window, and loaded with acquire semantics before synchronizing it
+  auto signal = [&](const int counter, const long value) {
+    window.Sync();
+    __atomic_store_n(ownCounters + counter, value, __ATOMIC_RELEASE);
+  };
+  auto waitFor = [&](const int counter, const long value) {
+    for (long const *neighbor : neighborCounters) {
+      while (neighbor != nullptr &&
+             __atomic_load_n(neighbor + counter, __ATOMIC_ACQUIRE) < value) {
+        std::this_thread::yield();
+      }
+    }
+    window.Sync();
+  };
 
   // Initialize local grid values
   const int fillStart = gridDim / 4;
@@ -47,189 +335,440 @@ std::vector<Grid_t> DiffusionGrid(const unsigned gridDim, const float d,
   const int maxRow = fillEnd - rowBegin;
   const int minCol = fillStart - colBegin;
   const int maxCol = fillEnd - colBegin;
-  const int iMax = nRows + 1;
-  const int jMax = nCols + 1;
-  for (int i = -1; i < iMax; ++i) {
+  auto initializeRow = [&](const int i) {
     const bool inRow = i > minRow && i < maxRow;
-    for (int j = -1; j < jMax; ++j) {
-      grid[i + 1][j + 1] = inRow && j > minCol && j < maxCol;
+    for (int level = 0; level < 2; ++level) {
+      float *const row = layout.Row(local, level, i);
+      std::fill(row - layout.leading, row - layout.leading + layout.stride, 0);
+      for (int j = -k; j < nCols + k; ++j) {
+        row[j] = inRow && j > minCol && j < maxCol;
+      }
     }
-  }
-  Grid_t gridBuffer(grid); // Copy into gridBuffer
-
-  // Run diffusion
-  std::sort(timesToRecord.begin(), timesToRecord.end());
-  std::vector<Grid_t> localSnapshots(nSnapshots);
-  auto outputItr = localSnapshots.begin();
-  auto timeItr = timesToRecord.cbegin();
-  const auto timeItrEnd = timesToRecord.cend();
-  const float ds = 2. / gridDim;
-  const float factor = d * dt / (ds * ds);
-  const int iMaxInner = iMax - 1;
-  const int jMaxInner = jMax - 1;
-  float t = 0;
-  auto diffuse = [&grid, &factor](const int i, const int j) {
-    return grid[i][j] +
-           factor * (grid[i - 1][j] + grid[i][j - 1] - 4 * grid[i][j] +
-                     grid[i][j + 1] + grid[i + 1][j]);
   };
-  const std::array<std::pair<int, bool>, 4> neighbors = {
-      {mpiGrid.up(), mpiGrid.down(), mpiGrid.left(), mpiGrid.right()}};
-  std::vector<float> bufferSendLeft(nRows+2);
-  std::vector<float> bufferSendRight(nRows+2);
-  std::vector<float> bufferReceiveLeft(nRows+2);
-  std::vector<float> bufferReceiveRight(nRows+2);
-
-  for (;;t += dt) {
-
-    if (t >= *timeItr) {
-      // Collect snapshot
-      *outputItr++ = grid;
-      if (++timeItr == timeItrEnd) {
-        break;
-      }
-    }
-
-    // Handle edges
-    std::vector<MPI_Request> colReceive;
-    std::vector<MPI_Request> requests;
-    // Horizontal edges 
-    for (int i = 1; i < iMax; ++i) {
-      bufferSendLeft[i]  = diffuse(i, 1);
-      bufferSendRight[i] = diffuse(i, nCols);
-    }
-    if (neighbors[2].second) {
-      requests.emplace_back(mpi::SendAsync(bufferSendLeft.begin(),
-                                           bufferSendLeft.end(),
-                                           neighbors[2].first));
-      colReceive.emplace_back(mpi::ReceiveAsync(bufferReceiveLeft.begin(),
-                                                bufferReceiveLeft.end(),
-                                                neighbors[2].first));
-    }
-    if (neighbors[3].second) {
-      requests.emplace_back(mpi::SendAsync(bufferSendRight.begin(),
-                                           bufferSendRight.end(),
-                                           neighbors[3].first));
-      colReceive.emplace_back(mpi::ReceiveAsync(bufferReceiveRight.begin(),
-                                                bufferReceiveRight.end(),
-                                                neighbors[3].first));
-    }
-    // Top edge
-    for (int j = 1; j < jMax; ++j) {
-      gridBuffer[1][j] = diffuse(1, j);
-    }
-    if (neighbors[0].second) {
-      requests.emplace_back(mpi::SendAsync(
-          gridBuffer[1].begin(), gridBuffer[1].end(), neighbors[0].first));
-      requests.emplace_back(mpi::ReceiveAsync(
-          gridBuffer[0].begin(), gridBuffer[0].end(), neighbors[0].first));
-    }
-    // Bottom edge
-    for (int j = 1; j < jMax; ++j) {
-      gridBuffer[nRows][j] = diffuse(nRows, j);
-    }
-    if (neighbors[1].second) {
-      requests.emplace_back(mpi::SendAsync(gridBuffer[nRows].begin(),
-                                           gridBuffer[nRows].end(),
-                                           neighbors[1].first));
-      requests.emplace_back(mpi::ReceiveAsync(gridBuffer[nRows + 1].begin(),
-                                              gridBuffer[nRows + 1].end(),
-                                              neighbors[1].first));
-    }
-
-    // Retrieve the cols so they can be copied to the grid while computing the
-    // bulk
-    mpi::WaitAll(colReceive);
-
-    // Compute the bulk
-    for (int i = 2; i < iMaxInner; ++i) {
-      gridBuffer[i][0] = bufferReceiveLeft[i];
-      gridBuffer[i][1] = bufferSendLeft[i];
-      for (int j = 2; j < jMaxInner; ++j) {
-        gridBuffer[i][j] = diffuse(i, j);
-      }
-      gridBuffer[i][nCols] = bufferSendRight[i];
-      gridBuffer[i][nCols + 1] = bufferReceiveRight[i];
-    }
-
-    // Wait for all remaining sends and receives to finish
-    mpi::WaitAll(requests);
-
-    gridBuffer.swap(grid);
+  // Rows are first touched with the same static schedule used to compute
+  // them, so each thread's rows are placed on its own NUMA node
+  #pragma omp parallel for num_threads(nThreads) schedule(static)
+  for (int i = 0; i < nRows; ++i) {
+    initializeRow(i);
+  }
+  for (int i = 1; i <= k; ++i) {
+    initializeRow(-i);
+    initializeRow(nRows - 1 + i);
+  }
 
-  } // End main loop
+  // Without a sink, snapshots are written straight to the output file by every
+  // rank
+  std::unique_ptr<SnapshotFileView> snapshotFile;
+  if (sink == nullptr) {
+    snapshotFile.reset(new SnapshotFileView(*path, gridDim, dt,
+                                            timesToRecord.size(), rowBegin,
+                                            nRows, colBegin, nCols, async));
+  }
 
-  // Gather results
+  // With a sink, snapshots are gathered on the root rank as soon as they are
+  // taken: first across the ranks of each row of the MPI grid, then across
+  // rows
   const MPI_Comm rowComm = mpiGrid.Partition<0>();
   const MPI_Comm colComm = mpiGrid.Partition<1>();
   const int rank = mpi::rank();
   const int colRank = mpi::rank(colComm);
   const int rowRank = mpi::rank(rowComm);
-  std::vector<Grid_t> totalSnapshots;
-  if (rank == 0) {
-    totalSnapshots =
-        std::vector<Grid_t>(nSnapshots, Grid_t(gridDim, Row_t(gridDim)));
+  Grid_t globalSnapshot;
+  if (sink != nullptr && rank == 0) {
+    globalSnapshot = Grid_t(gridDim, gridDim);
   }
-  std::vector<Grid_t> rowSnapshots;
-  if (colRank == 0) {
-    rowSnapshots =
-        std::vector<Grid_t>(nSnapshots, Grid_t(nRows, Row_t(gridDim)));
+  Grid_t rowSnapshot;
+  if (sink != nullptr && colRank == 0) {
+    rowSnapshot = Grid_t(nRows, gridDim);
   }
-  std::vector<MPI_Request> requests;
   std::vector<int> colSizes;
   std::vector<int> colOffsets;
   // Generate gather parameters
-  if (colRank == 0) {
+  if (sink != nullptr && colRank == 0) {
     colOffsets.emplace_back(0);
-    for (int i = 0; i < nHorizontal; ++i) {
+    for (int i = 0, iEnd = mpiGrid.colMax(); i < iEnd; ++i) {
       colSizes.emplace_back(gridDim * (i + 1) / mpiGrid.colMax() -
                             gridDim * i / mpiGrid.colMax());
       if (i > 0) {
-        colOffsets.emplace_back(colOffsets[i - 1] + colSizes[i] - 1);
+        colOffsets.emplace_back(colOffsets[i - 1] + colSizes[i - 1]);
       }
     }
   }
-  for (int s = 0; s < nSnapshots; ++s) {
+  auto gatherSnapshot = [&](float const *const *snapshot) {
     // Gather grid rows across columns in each row of MPI ranks
     for (int i = 0; i < nRows; ++i) {
-      typename Row_t::iterator target;
+      float *target = nullptr;
       if (colRank == 0) {
-        target = rowSnapshots[s][i].begin();
+        target = rowSnapshot[i];
       }
-      mpi::Gather(localSnapshots[s][i + 1].begin() + 1,
-                  localSnapshots[s][i + 1].end() - 1, target, colSizes,
+      mpi::Gather(snapshot[i], snapshot[i] + nCols, target, colSizes,
                   colOffsets, 0, colComm);
     }
     // Gather all rows in root rank
     if (colRank == 0) {
       if (rowRank != 0) {
         for (int i = 0; i < nRows; ++i) {
-          mpi::Send(rowSnapshots[s][i].begin(), rowSnapshots[s][i].end(), 0,
-                    0, rowComm);
+          mpi::Send(rowSnapshot[i], rowSnapshot[i] + gridDim, 0, 0, rowComm);
         }
       } else {
+        std::vector<MPI_Request> requests;
         int globalRow = 0;
         for (int i = 0; i < nRows; ++i) {
-          totalSnapshots[s][globalRow] = std::move(rowSnapshots[s][i]);
+          std::copy(rowSnapshot[i], rowSnapshot[i] + gridDim,
+                    globalSnapshot[globalRow]);
           ++globalRow;
         }
         for (int r = 1, rMax = mpiGrid.rowMax(); r < rMax; ++r) {
-          const int currRowBegin = gridDim*r/nVertical;
-          const int currRowEnd = gridDim*(r+1)/nVertical;
+          const int currRowBegin = gridDim*r/rMax;
+          const int currRowEnd = gridDim*(r+1)/rMax;
           const int currNRows = currRowEnd - currRowBegin;
           for (int i = 0; i < currNRows; ++i) {
             requests.emplace_back(mpi::ReceiveAsync(
-                totalSnapshots[s][globalRow].begin(),
-                totalSnapshots[s][globalRow].end(), r, 0, rowComm));
+                globalSnapshot[globalRow], globalSnapshot[globalRow] + gridDim,
+                r, 0, rowComm));
             ++globalRow;
           }
         }
+        mpi::WaitAll(requests);
+      }
+    }
+  };
+
+  // Run diffusion
+  std::sort(timesToRecord.begin(), timesToRecord.end());
+  size_t snapshotIndex = 0;
+  auto timeItr = timesToRecord.cbegin();
+  const auto timeItrEnd = timesToRecord.cend();
+  const float ds = 2. / gridDim;
+  const float factor = d * dt / (ds * ds);
+  float t = 0;
+  // The halo exchange with ranks off the node is set up once as persistent
+  // requests for each of the two time levels: edge rows are sent directly
+  // from the grid and edge columns are described by a strided vector type, so
+  // nothing is packed. Exchanges with missing neighbors or neighbors on the
+  // node use MPI_PROC_NULL and complete immediately. Halos deeper than one
+  // cell also need the diagonal neighbors' corners, so columns are exchanged
+  // first and rows are then exchanged including the ghost columns just
+  // received
+  const bool corners = k > 1;
+  const int rowOffset = corners ? k : 0;
+  const int upPeer = sharedUp ? MPI_PROC_NULL : up;
+  const int downPeer = sharedDown ? MPI_PROC_NULL : down;
+  const int leftPeer = sharedLeft ? MPI_PROC_NULL : left;
+  const int rightPeer = sharedRight ? MPI_PROC_NULL : right;
+  const int stride = layout.stride;
+  MPI_Datatype columns = mpi::Vector<float>(nRows, k, stride);
+  MPI_Datatype haloRows = mpi::Vector<float>(k, nCols + 2 * rowOffset, stride);
+  std::array<std::array<MPI_Request, 8>, 2> exchanges;
+  for (int level = 0; level < 2; ++level) {
+    auto &requests = exchanges[level];
+    float *const first = layout.Row(local, level, 0);
+    MPI_Recv_init(first - k, 1, columns, leftPeer, 0, cartComm, &requests[0]);
+    MPI_Recv_init(first + nCols, 1, columns, rightPeer, 0, cartComm,
+                  &requests[1]);
+    MPI_Send_init(first, 1, columns, leftPeer, 0, cartComm, &requests[2]);
+    MPI_Send_init(first + nCols - k, 1, columns, rightPeer, 0, cartComm,
+                  &requests[3]);
+    MPI_Recv_init(first - k * stride - rowOffset, 1, haloRows, upPeer, 0,
+                  cartComm, &requests[4]);
+    MPI_Recv_init(first + nRows * stride - rowOffset, 1, haloRows, downPeer,
+                  0, cartComm, &requests[5]);
+    MPI_Send_init(first - rowOffset, 1, haloRows, upPeer, 0, cartComm,
+                  &requests[6]);
+    MPI_Send_init(first + (nRows - k) * stride - rowOffset, 1, haloRows,
+                  downPeer, 0, cartComm, &requests[7]);
+  }
+  // Index of the time level holding the current step
+  int level = 0;
+  long epoch = 1;
+  const int extendUp = up != MPI_PROC_NULL;
+  const int extendDown = down != MPI_PROC_NULL;
+  const int extendLeft = left != MPI_PROC_NULL;
+  const int extendRight = right != MPI_PROC_NULL;
+  const int edgeEnd = std::min(k, nRows);
+  const int edgeBegin = std::max(k, nRows - k);
+  int nSteps = 0;
+
+  // Every rank checkpoints its subdomain to its own files. Checkpoints are
+  // taken at the top of the loop, before the snapshot check, and only if all
+  // ranks have finished writing the previous one, so that all ranks checkpoint
+  // the same steps
+  Checkpointing const &checkpointing = DiffusionCheckpointing();
+  std::unique_ptr<CheckpointStore> checkpoints;
+  long step = 0;
+  long nextCheckpoint = checkpointing.interval;
+  const int nRanks = mpi::size();
+  auto putParameters = [&](CheckpointState &state) {
+    state.Put(gridDim);
+    state.Put(d);
+    state.Put(dt);
+    state.Put(k);
+    state.Put(nRanks);
+    state.Put(timesToRecord.size());
+    state.Put(timesToRecord.data(), timesToRecord.size());
+  };
+  if (!checkpointing.path.empty()) {
+    checkpoints.reset(new CheckpointStore(checkpointing.path + "." +
+                                          std::to_string(rank)));
+    // Each rank keeps its previous checkpoint until the next one is complete,
+    // so every rank still holds the latest step checkpointed by all ranks
+    const long latest =
+        checkpointing.resume
+            ? mpi::AllReduce<mpi::Op::min>(checkpoints->Latest())
+            : -1;
+    if (latest >= 0) {
+      if (!checkpoints->Load(latest)) {
+        throw std::runtime_error("Checkpoint of step " +
+                                 std::to_string(latest) +
+                                 " is missing on rank " +
+                                 std::to_string(rank) + ".");
+      }
+      CheckpointState &state = checkpoints->state();
+      CheckpointState expected;
+      putParameters(expected);
+      state.Expect(expected.bytes().data(), expected.bytes().size(),
+                   "configuration");
+      t = state.Get<float>();
+      snapshotIndex = state.Get<size_t>();
+      step = state.Get<long>();
+      // The current step is loaded into the first level, as on every other
+      // rank, so ranks reading each other's rows agree on the level
+      state.Get(layout.Level(local, 0), layout.size);
+      state.Get(layout.Level(local, 1), layout.size);
+      std::vector<double> times(timesToRecord.size());
+      state.Get(times.data(), times.size());
+      if (snapshotFile != nullptr) {
+        snapshotFile->times() = times;
+      }
+      timeItr += snapshotIndex;
+      nextCheckpoint = step + checkpointing.interval;
+    } else {
+      checkpoints->Remove();
+    }
+  }
+  // Called by the master thread only
+  auto checkpoint = [&]() {
+    if (checkpoints == nullptr || checkpointing.interval == 0 ||
+        step < nextCheckpoint ||
+        mpi::AllReduce<mpi::Op::min>(
+            static_cast<int>(checkpoints->Idle())) == 0) {
+      return;
+    }
+    HPCSE_TRACE_SCOPE("checkpoint");
+    CheckpointState &state = checkpoints->Prepare();
+    putParameters(state);
+    state.Put(t);
+    state.Put(snapshotIndex);
+    state.Put(step);
+    state.Put(layout.Level(local, level), layout.size);
+    state.Put(layout.Level(local, level ^ 1), layout.size);
+    std::vector<double> times(timesToRecord.size(), 0);
+    if (snapshotFile != nullptr) {
+      // Snapshots taken before the checkpoint must be complete when it is
+      snapshotFile->Flush();
+      times = snapshotFile->times();
+    }
+    state.Put(times.data(), times.size());
+    checkpoints->Commit(step);
+    nextCheckpoint = step + checkpointing.interval;
+  };
+
+  // Neighbors on the node read the initial rows in place
+  if (shared) {
+    signal(kHalos, epoch);
+    waitFor(kHalos, epoch);
+  }
+
+  // Each rank runs a team of threads sharing its subdomain. Snapshots and halo
+  // exchanges are driven by the master thread only, so MPI needs no more than
+  // funneled thread support, and the other threads proceed with the interior
+  // while the master thread waits for the halos
+  #pragma omp parallel num_threads(nThreads)
+  while (true) {
+
+    #pragma omp master
+    {
+      checkpoint();
+      if (t >= *timeItr) {
+        // Collect snapshot
+        float const *const *const snapshot = rows[level].data() + k;
+        if (snapshotFile != nullptr) {
+          HPCSE_TRACE_SCOPE("snapshot write");
+          snapshotFile->Write(snapshotIndex, t, snapshot[0], stride);
+        } else {
+          {
+            HPCSE_TRACE_SCOPE("gather");
+            gatherSnapshot(snapshot);
+          }
+          if (rank == 0) {
+            HPCSE_TRACE_SCOPE("snapshot sink");
+            (*sink)(snapshotIndex, t, globalSnapshot);
+          }
+        }
+        ++snapshotIndex;
+        ++timeItr;
+      }
+      // Advance time exactly as a step-by-step loop would, stopping at the
+      // next snapshot or when the halo is used up
+      if (timeItr != timeItrEnd) {
+        nSteps = 0;
+        do {
+          t += dt;
+          ++nSteps;
+        } while (t < *timeItr && nSteps < k);
+        step += nSteps;
+        // Only the first step reads the neighbors' edge rows
+        attachNeighbors(level);
+      }
+    }
+    #pragma omp barrier
+    if (timeItr == timeItrEnd) {
+      break;
+    }
+
+    // Until the last step of every k steps, the part of the halo that is
+    // still valid is advanced as well. It shrinks by one cell per step on
+    // every side with a neighbor
+    for (int s = 0; s < nSteps - 1; ++s) {
+      const int depth = k - 1 - s;
+      const int iBegin = -depth * extendUp;
+      const int iEnd = nRows + depth * extendDown;
+      const int jBegin = -depth * extendLeft;
+      const int jEnd = nCols + depth * extendRight;
+      {
+        HPCSE_TRACE_SCOPE("halo compute");
+        float *const *const from = rows[level].data() + k;
+        float *const *const to = rows[level ^ 1].data() + k;
+        #pragma omp for schedule(static)
+        for (int i = iBegin; i < iEnd; ++i) {
+          DiffuseRow(factor, from[i - 1], from[i], from[i + 1], to[i], jBegin,
+                     jEnd);
+        }
+      }
+      #pragma omp master
+      {
+        if (s == 0) {
+          // The next step overwrites the level just read by the neighbors
+          detachNeighbors(level);
+          if (shared) {
+            HPCSE_TRACE_SCOPE("halo wait");
+            signal(kConsumed, epoch);
+            waitFor(kConsumed, epoch);
+          }
+        }
+        level ^= 1;
       }
+      #pragma omp barrier
+    }
+
+    // Compute the edges and start sending them, with the same kernel as the
+    // bulk so that results do not depend on the halo depth
+    float *const *const from = rows[level].data() + k;
+    float *const *const to = rows[level ^ 1].data() + k;
+    {
+      HPCSE_TRACE_SCOPE("edge compute");
+      #pragma omp for schedule(static)
+      for (int i = 0; i < nRows; ++i) {
+        if (i < edgeEnd || i >= edgeBegin) {
+          DiffuseRow(factor, from[i - 1], from[i], from[i + 1], to[i], 0,
+                     nCols);
+        } else {
+          DiffuseRow(factor, from[i - 1], from[i], from[i + 1], to[i], 0,
+                     std::min(k, nCols));
+          DiffuseRow(factor, from[i - 1], from[i], from[i + 1], to[i],
+                     std::max(k, nCols - k), nCols);
+        }
+      }
+    }
+    #pragma omp master
+    {
+      if (shared) {
+        signal(kEdges, epoch + 1);
+      }
+      MPI_Startall(corners ? 4 : 8, exchanges[level ^ 1].data());
+    }
+
+    // Compute the bulk while the halos are in flight
+    {
+      HPCSE_TRACE_SCOPE("bulk compute");
+      #pragma omp for schedule(static) nowait
+      for (int i = k; i < nRows - k; ++i) {
+        DiffuseRow(factor, from[i - 1], from[i], from[i + 1], to[i], k,
+                   nCols - k);
+      }
+    }
+
+    #pragma omp master
+    {
+      HPCSE_TRACE_SCOPE("halo wait");
+      const int target = level ^ 1;
+      auto &requests = exchanges[target];
+      if (corners) {
+        MPI_Waitall(4, requests.data(), MPI_STATUSES_IGNORE);
+      }
+      // The rows read by the neighbors on the node include the ghost columns,
+      // so they are complete once the columns are
+      if (shared) {
+        waitFor(kEdges, epoch + 1);
+        copyColumns(target);
+        signal(kHalos, epoch + 1);
+      }
+      if (corners) {
+        MPI_Startall(4, requests.data() + 4);
+        MPI_Waitall(4, requests.data() + 4, MPI_STATUSES_IGNORE);
+      } else {
+        MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+      }
+      if (shared) {
+        waitFor(kHalos, epoch + 1);
+      }
+      detachNeighbors(level);
+      level = target;
+      ++epoch;
+    }
+    {
+      // Time the other threads spend waiting for the halos, or the master
+      // thread for the others to finish the bulk
+      HPCSE_TRACE_SCOPE("barrier");
+      #pragma omp barrier
+    }
+
+  } // End main loop
+
+  for (auto &requests : exchanges) {
+    for (auto &request : requests) {
+      MPI_Request_free(&request);
     }
   }
-  mpi::WaitAll(requests);
+  MPI_Type_free(&columns);
+  MPI_Type_free(&haloRows);
+}
+
+} // End anonymous namespace
+
+void DiffusionGrid(const unsigned gridDim, const float d, const float dt,
+                   std::vector<float> const &timesToRecord,
+                   SnapshotSink_t const &sink, const unsigned ghostWidth,
+                   const unsigned nThreads, const bool sharedMemory) {
+  DiffusionGridImpl(gridDim, d, dt, timesToRecord, &sink, nullptr, false,
+                    ghostWidth, nThreads, sharedMemory);
+}
 
-  return totalSnapshots;
+void DiffusionGrid(const unsigned gridDim, const float d, const float dt,
+                   std::vector<float> const &timesToRecord,
+                   std::string const &path, const bool async,
+                   const unsigned ghostWidth, const unsigned nThreads,
+                   const bool sharedMemory) {
+  DiffusionGridImpl(gridDim, d, dt, timesToRecord, nullptr, &path, async,
+                    ghostWidth, nThreads, sharedMemory);
+}
+
+std::vector<Grid_t> DiffusionGrid(const unsigned gridDim, const float d,
+                                  const float dt,
+                                  std::vector<float> const &timesToRecord) {
+  std::vector<Grid_t> output;
+  DiffusionGrid(gridDim, d, dt, timesToRecord, CollectSnapshots(output));
+  return output;
 }
 
 } // End namespace hpcse
@@ -0,0 +1,231 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date November 2015
+
+#include <algorithm>
+#include <vector>
+#include "common/AlignedAllocator.h"
+#include "diffusion/Diffusion.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace hpcse {
+
+namespace {
+
+/// Rows solved together in the sweep along rows, filling one AVX-512 register
+/// with one element of each row.
+constexpr int kBatch = 16;
+
+/// Columns assigned to a thread at a time in the sweep along columns.
+constexpr int kColumnBlock = 256;
+
+/// Number of initial timesteps replaced by two implicit Euler steps of half the
+/// timestep each, damping the discontinuities of the initial condition.
+constexpr int kDampingSteps = 2;
+
+using Tile_t = std::vector<float, AlignedAllocator<float>>;
+
+/// Thomas algorithm for the tridiagonal system
+///   (1 + 2h) x_k - h (x_{k-1} + x_{k+1}) = b_k,  k = 1..n,
+/// with x_0 and x_{n+1} given by the boundary. The system is the same for
+/// every line, so the eliminated coefficients are computed once.
+class Thomas {
+
+public:
+  Thomas(const float h, const int n)
+      : h_(h), upper_(n + 2, 0), inverse_(n + 2, 0) {
+    for (int k = 1; k <= n; ++k) {
+      inverse_[k] = 1 / (1 + 2 * h + h * upper_[k - 1]);
+      upper_[k] = -h * inverse_[k];
+    }
+  }
+
+  float h() const { return h_; }
+
+  /// Forward elimination: y_k = (b_k + h y_{k-1}) / m_k, where y_0 = x_0.
+  float const *inverse() const { return inverse_.data(); }
+
+  /// Back substitution: x_k = y_k - u_k x_{k+1}.
+  float const *upper() const { return upper_.data(); }
+
+private:
+  float h_;
+  std::vector<float> upper_;
+  std::vector<float> inverse_;
+};
+
+/// Solves along rows i in [iBegin, iBegin + kBatch), implicitly in j with the
+/// coefficients of thomas and explicitly in i with weight explicitWeight. The
+/// rows are transposed into tile so that the recurrences run across rows in
+/// the vector lanes. Transposition and elimination proceed in square blocks of
+/// kBatch columns that stay in L1. Rows beyond the interior are computed but
+/// not stored.
+void SweepRowBatch(Thomas const &thomas, const float explicitWeight,
+                   Grid_t const &source, Grid_t &target, const int iBegin,
+                   float *__restrict__ tile) {
+  const int jLast = source.cols() - 1;
+  const int count = std::min(kBatch, source.rows() - 1 - iBegin);
+  const float center = 1 - 2 * explicitWeight;
+  const float h = thomas.h();
+  float const *inverse = thomas.inverse();
+  float const *upper = thomas.upper();
+  if (count < kBatch) {
+    std::fill(tile, tile + (jLast + 1) * kBatch, 0.f);
+  }
+  for (int w = 0; w < count; ++w) {
+    tile[w] = source[iBegin + w][0];
+    tile[jLast * kBatch + w] = source[iBegin + w][jLast];
+  }
+  for (int jBlock = 1; jBlock < jLast; jBlock += kBatch) {
+    const int jBlockEnd = std::min(jBlock + kBatch, jLast);
+    for (int w = 0; w < count; ++w) {
+      const float *__restrict__ above = source[iBegin + w - 1];
+      const float *__restrict__ row = source[iBegin + w];
+      const float *__restrict__ below = source[iBegin + w + 1];
+      for (int j = jBlock; j < jBlockEnd; ++j) {
+        tile[j * kBatch + w] =
+            center * row[j] + explicitWeight * (above[j] + below[j]);
+      }
+    }
+    for (int j = jBlock; j < jBlockEnd; ++j) {
+      float *__restrict__ current = tile + j * kBatch;
+      float const *__restrict__ previous = current - kBatch;
+      for (int w = 0; w < kBatch; ++w) {
+        current[w] = (current[w] + h * previous[w]) * inverse[j];
+      }
+    }
+  }
+  for (int jBlockEnd = jLast; jBlockEnd > 1; jBlockEnd -= kBatch) {
+    const int jBlock = std::max(1, jBlockEnd - kBatch);
+    for (int j = jBlockEnd - 1; j >= jBlock; --j) {
+      float *__restrict__ current = tile + j * kBatch;
+      float const *__restrict__ next = current + kBatch;
+      for (int w = 0; w < kBatch; ++w) {
+        current[w] -= upper[j] * next[w];
+      }
+    }
+    for (int w = 0; w < count; ++w) {
+      float *__restrict__ row = target[iBegin + w];
+      for (int j = jBlock; j < jBlockEnd; ++j) {
+        row[j] = tile[j * kBatch + w];
+      }
+    }
+  }
+}
+
+/// Solves along columns j in [jBegin, jEnd), implicitly in i and explicitly in
+/// j. Each recurrence runs down the rows and is vectorized across columns.
+void SweepColumnBlock(Thomas const &thomas, const float explicitWeight,
+                      Grid_t const &source, Grid_t &target, const int jBegin,
+                      const int jEnd) {
+  const int iLast = source.rows() - 1;
+  const float center = 1 - 2 * explicitWeight;
+  const float h = thomas.h();
+  float const *inverse = thomas.inverse();
+  float const *upper = thomas.upper();
+  for (int i = 1; i < iLast; ++i) {
+    const float *__restrict__ row = source[i];
+    const float *__restrict__ previous = target[i - 1];
+    float *__restrict__ current = target[i];
+    const float m = inverse[i];
+    for (int j = jBegin; j < jEnd; ++j) {
+      current[j] = (center * row[j] +
+                    explicitWeight * (row[j - 1] + row[j + 1]) +
+                    h * previous[j]) *
+                   m;
+    }
+  }
+  for (int i = iLast - 1; i > 0; --i) {
+    const float *__restrict__ next = target[i + 1];
+    float *__restrict__ current = target[i];
+    const float u = upper[i];
+    for (int j = jBegin; j < jEnd; ++j) {
+      current[j] -= u * next[j];
+    }
+  }
+}
+
+/// Advances grid by one step, solving along rows into buffer and then along
+/// columns back into grid. Boundary cells are never written, so both grids must
+/// hold the same boundary.
+void Step(Thomas const &thomas, const float explicitWeight, Grid_t &grid,
+          Grid_t &buffer, std::vector<Tile_t> &tiles, const unsigned nThreads) {
+  const int nRowBatches = (grid.rows() - 2 + kBatch - 1) / kBatch;
+  const int nColumnBlocks =
+      (grid.cols() - 2 + kColumnBlock - 1) / kColumnBlock;
+  #pragma omp parallel num_threads(nThreads)
+  {
+#ifdef _OPENMP
+    float *tile = tiles[omp_get_thread_num()].data();
+#else
+    float *tile = tiles[0].data();
+#endif
+    #pragma omp for schedule(static)
+    for (int b = 0; b < nRowBatches; ++b) {
+      SweepRowBatch(thomas, explicitWeight, grid, buffer, 1 + b * kBatch,
+                    tile);
+    }
+    #pragma omp for schedule(static)
+    for (int b = 0; b < nColumnBlocks; ++b) {
+      const int jBegin = 1 + b * kColumnBlock;
+      SweepColumnBlock(thomas, explicitWeight, buffer, grid, jBegin,
+                       std::min(jBegin + kColumnBlock, grid.cols() - 1));
+    }
+  }
+}
+
+} // End anonymous namespace
+
+void DiffusionImplicit(unsigned nThreads, unsigned dim, const float d,
+                       const float dt, std::vector<float> const &snapshots,
+                       SnapshotSink_t const &sink) {
+  nThreads = std::max(1u, nThreads);
+  const float ds = 2./dim;
+  const float factor = d*dt/(ds*ds);
+  // Both Peaceman-Rachford half steps and the implicit Euler quarter steps
+  // used for damping solve the same system
+  const Thomas thomas(factor / 2, dim > 2 ? dim - 2 : 0);
+  const int begin = dim>>2;
+  const int end = dim - begin;
+  Grid_t grid = Grid_t::Allocate(dim, dim);
+  Grid_t buffer = Grid_t::Allocate(dim, dim);
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 0; i < static_cast<int>(dim); ++i) {
+    grid.FillRows(i, i + 1, 0);
+    buffer.FillRows(i, i + 1, 0);
+    if (i >= begin && i < end) {
+      std::fill(grid[i] + begin, grid[i] + end, 1);
+    }
+  }
+  std::vector<Tile_t> tiles(nThreads, Tile_t(dim * kBatch));
+  float t = 0;
+  int step = 0;
+  auto snapshotItr = snapshots.cbegin();
+  auto snapshotEnd = snapshots.cend();
+  size_t snapshotIndex = 0;
+  while (true) {
+    if (t >= *snapshotItr) {
+      sink(snapshotIndex++, t, grid);
+      if (++snapshotItr == snapshotEnd) break;
+    }
+    if (step < kDampingSteps) {
+      Step(thomas, 0, grid, buffer, tiles, nThreads);
+      Step(thomas, 0, grid, buffer, tiles, nThreads);
+    } else {
+      Step(thomas, factor / 2, grid, buffer, tiles, nThreads);
+    }
+    ++step;
+    t += dt;
+  }
+}
+
+std::vector<Grid_t> DiffusionImplicit(unsigned nThreads, unsigned dim,
+                                      float d, float dt,
+                                      std::vector<float> const &snapshots) {
+  std::vector<Grid_t> output;
+  DiffusionImplicit(nThreads, dim, d, dt, snapshots, CollectSnapshots(output));
+  return output;
+}
+
+} // End namespace hpcse
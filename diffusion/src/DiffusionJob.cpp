@@ -1,82 +1,103 @@
 /// \author Johannes de Fine Licht (definelj@student.ethz.ch)
 /// \date October 2015
 
-#include <iostream>
+#include <algorithm>
 #include "DiffusionJob.h"
+#include "common/Timer.h"
+#include "diffusion/DiffusionKernel.h"
 
 namespace hpcse {
 
-DiffusionJob::DiffusionJob(const int rows, const int cols,
-                           const int rowOffset)
-    : grid_(rows, Row_t(cols)), buffer_(grid_) {
+template <typename T>
+DiffusionJob<T>::DiffusionJob(const int rows, const int cols,
+                              const int rowOffset)
+    : rowOffset_(rowOffset), grids_() {
+  Grid<T> &grid = grids_[0];
+  grid = Grid<T>(rows, cols);
   const int minCol = cols>>2;
   const int maxCol = cols - minCol;
   const int minRow = minCol - rowOffset;
   const int maxRow = (cols - minCol) - rowOffset;
   for (int i = 0; i < rows; ++i) {
     const bool inRow = i > minRow && i < maxRow;
+    T *row = grid[i];
     for (int j = 0; j < cols; ++j) {
-      grid_[i][j] = inRow && j > minCol && j < maxCol;
+      row[j] = FromFloat<T>(inRow && j > minCol && j < maxCol);
     }
   }
+  grids_[1] = grid;
 }
 
-std::vector<Grid_t> DiffusionJob::RunDiffusion(
-    const std::shared_ptr<DiffusionJob> above,
-    const std::shared_ptr<DiffusionJob> below, const float d, const float dt,
-    const std::vector<float> snapshots, Barrier &barrier) {
-  std::vector<Grid_t> output(
-      snapshots.size(), Grid_t(grid_.size(), Row_t(grid_[0].size())));
+template <typename T>
+void DiffusionJob<T>::RunDiffusion(const std::shared_ptr<DiffusionJob> above,
+                                const std::shared_ptr<DiffusionJob> below,
+                                const float d, const float dt,
+                                std::vector<float> const &snapshots,
+                                Barrier &barrier, Grid_t &snapshot,
+                                SnapshotSink_t const *sink) {
   float t = 0;
+  long step = 0;
   auto snapshotItr = snapshots.cbegin();
   auto snapshotEnd = snapshots.cend();
-  auto outputItr = output.begin();
-  float ds = 2./grid_[0].size();
+  size_t snapshotIndex = 0;
+  float ds = 2./grids_[0].cols();
   const float factor = d*dt/(ds*ds);
-  const int iEnd = grid_.size()-1;
-  const int jEnd = grid_[0].size()-1;
+  const int iEnd = grids_[0].rows()-1;
+  const int jEnd = grids_[0].cols()-1;
   while (true) {
+    Grid<T> const &current = grids_[step & 1];
+    Grid<T> &next = grids_[(step + 1) & 1];
     if (t >= *snapshotItr) {
-      *outputItr++ = grid_;
+      HPCSE_PROFILE_SCOPE("snapshot");
+      for (int i = 0; i <= iEnd; ++i) {
+        ConvertRow(current[i], snapshot[rowOffset_ + i], current.cols());
+      }
+      // Wait for all jobs to copy their rows, then wait for the sink to be
+      // done with the snapshot before any job can get to the next one
+      barrier.Synchronize();
+      if (sink != nullptr) {
+        (*sink)(snapshotIndex, t, snapshot);
+      }
+      barrier.Synchronize();
+      ++snapshotIndex;
       if (++snapshotItr == snapshotEnd) break; 
     }
-    // Top row
-    if (above != nullptr) {
-      auto aboveRow = above->LastRow();
-      for (int j = 1; j < jEnd; ++j) {
-        buffer_[0][j] =
-            grid_[0][j] +
-            factor * (aboveRow[j] + grid_[0][j - 1] - 4 * grid_[0][j] +
-                      grid_[0][j + 1] + grid_[1][j]);
+    HPCSE_PROFILE_SCOPE("step");
+    // Internal rows first, giving the neighbors time to publish their edges
+    {
+      HPCSE_PROFILE_SCOPE("interior");
+      for (int i = 1; i < iEnd; ++i) {
+        DiffuseRow(factor, current[i - 1], current[i], current[i + 1], next[i],
+                   1, jEnd);
       }
     }
-    // Internal rows
-    for (int i = 1; i < iEnd; ++i) {
-      for (int j = 1; j < jEnd; ++j) {
-        buffer_[i][j] =
-            grid_[i][j] +
-            factor * (grid_[i - 1][j] + grid_[i][j - 1] - 4 * grid_[i][j] +
-                      grid_[i][j + 1] + grid_[i + 1][j]);
+    // Top row
+    if (above != nullptr) {
+      {
+        HPCSE_PROFILE_SCOPE("neighbor wait");
+        above->WaitForStep(step);
       }
+      DiffuseRow(factor, above->LastRow(step), current[0], current[1], next[0],
+                 1, jEnd);
     }
     // Bottom row
     if (below != nullptr) {
-      auto belowRow = below->FirstRow();
-      for (int j = 1; j < jEnd; ++j) {
-        buffer_[iEnd][j] =
-            grid_[iEnd][j] +
-            factor * (grid_[iEnd - 1][j] + grid_[iEnd][j - 1] -
-                      4 * grid_[iEnd][j] + grid_[iEnd][j + 1] + belowRow[j]);
+      {
+        HPCSE_PROFILE_SCOPE("neighbor wait");
+        below->WaitForStep(step);
       }
+      DiffuseRow(factor, current[iEnd - 1], current[iEnd],
+                 below->FirstRow(step), next[iEnd], 1, jEnd);
     }
     t += dt;
-    // Synchronize before swapping frame buffer
-    barrier.Synchronize();
-    grid_.swap(buffer_);
-    // Synchronize again to make sure all swaps have happened
-    barrier.Synchronize();
+    ++step;
+    // Publish the new state to the neighbors
+    step_.store(step, std::memory_order_release);
   }
-  return output;
 }
 
+template class DiffusionJob<float>;
+template class DiffusionJob<Half>;
+template class DiffusionJob<BFloat16>;
+
 } // End namespace hpcse
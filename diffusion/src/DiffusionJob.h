@@ -3,42 +3,81 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <memory>
+#include <thread>
 #include "diffusion/Barrier.h"
 #include "diffusion/Diffusion.h"
 
 namespace hpcse {
 
+/// Band of rows of the threaded solver, with cells stored as T. Snapshots are
+/// converted to single precision when copied into the shared snapshot grid.
+template <typename T>
 class DiffusionJob {
 
 public:
   DiffusionJob(int rows, int cols, int rowOffset);
 
-  inline Row_t const &FirstRow() const;
+  /// First row of the state after the given number of steps.
+  inline T const *FirstRow(long step) const;
 
-  inline Row_t const &LastRow() const;
+  /// Last row of the state after the given number of steps.
+  inline T const *LastRow(long step) const;
 
-  std::vector<Grid_t> RunDiffusion(std::shared_ptr<DiffusionJob> above,
-                                   std::shared_ptr<DiffusionJob> below, float d,
-                                   float dt, std::vector<float> snapshots,
-                                   Barrier &barrier);
+  /// Blocks until the state after the given number of steps is available.
+  inline void WaitForStep(long step) const;
+
+  /// Runs the job until the last snapshot is taken. Jobs only wait for their
+  /// direct neighbors to publish the rows they depend on, and the barrier is
+  /// only used at snapshots: each job copies its rows into the shared snapshot
+  /// grid, after which the sink is invoked by the single job passed a non-null
+  /// sink.
+  void RunDiffusion(std::shared_ptr<DiffusionJob> above,
+                    std::shared_ptr<DiffusionJob> below, float d, float dt,
+                    std::vector<float> const &snapshots, Barrier &barrier,
+                    Grid_t &snapshot, SnapshotSink_t const *sink);
 
   static inline std::shared_ptr<DiffusionJob>
   Allocate(unsigned cols, int rowBegin, int rowEnd);
 
 private:
-  Grid_t grid_, buffer_;
+  static constexpr int kSpinCount = 1 << 10;
+
+  int rowOffset_;
+  // The state after step s is held in grids_[s % 2]. A neighbor can only
+  // overwrite the state it published after step s once this job has published
+  // step s + 1, which requires it to be done reading it
+  std::array<Grid<T>, 2> grids_;
+  std::atomic<long> step_{0};
 };
 
-Row_t const& DiffusionJob::FirstRow() const {
-  return *grid_.cbegin();
+template <typename T>
+T const *DiffusionJob<T>::FirstRow(const long step) const {
+  return grids_[step & 1][0];
+}
+
+template <typename T>
+T const *DiffusionJob<T>::LastRow(const long step) const {
+  Grid<T> const &grid = grids_[step & 1];
+  return grid[grid.rows() - 1];
 }
 
-Row_t const& DiffusionJob::LastRow() const {
-  return *(grid_.cend()-1);
+template <typename T>
+void DiffusionJob<T>::WaitForStep(const long step) const {
+  for (int i = 0; step_.load(std::memory_order_acquire) < step; ++i) {
+    // Yield after spinning for a while, in case the neighbor is waiting for a
+    // core
+    if (i >= kSpinCount) {
+      std::this_thread::yield();
+    }
+  }
 }
 
-std::shared_ptr<DiffusionJob>
-DiffusionJob::Allocate(unsigned cols, int rowBegin, int rowEnd) {
+template <typename T>
+std::shared_ptr<DiffusionJob<T>>
+DiffusionJob<T>::Allocate(unsigned cols, int rowBegin, int rowEnd) {
   return std::make_shared<DiffusionJob>(cols, rowBegin, rowEnd);
 }
 
@@ -0,0 +1,734 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date November 2015
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "diffusion/DiffusionKernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HPCSE_DIFFUSION_X86
+#include <immintrin.h>
+#endif
+
+namespace hpcse {
+
+namespace {
+
+using DiffuseRowKernel = void (*)(float, const float *, const float *,
+                                  const float *, float *, int, int);
+
+template <unsigned Bytes>
+inline bool IsAligned(const void *ptr) {
+  return (reinterpret_cast<std::uintptr_t>(ptr) & (Bytes - 1)) == 0;
+}
+
+/// Elements from j to the next Bytes-aligned target element, at most n.
+template <unsigned Bytes, typename T>
+inline int ToAligned(const T *target, const int j, const int n) {
+  const int misaligned =
+      (reinterpret_cast<std::uintptr_t>(target + j) & (Bytes - 1)) / sizeof(T);
+  return std::min(n, misaligned == 0 ? 0
+                                     : static_cast<int>(Bytes / sizeof(T)) -
+                                           misaligned);
+}
+
+/// Evaluates n < Width elements from j by running the vector kernel on a full
+/// vector copied into buffers. The head and tail of a row are thus computed
+/// with the same instructions as the rest, whereas scalar code may be
+/// contracted and reassociated differently under -ffast-math, so results do
+/// not depend on where a row range starts or ends.
+template <int Width, typename T, typename Kernel>
+void DiffusePartial(Kernel const &kernel, const float factor, const T *above,
+                    const T *center, const T *below, T *target, const int j,
+                    const int n) {
+  alignas(64) T up[Width]{};
+  alignas(64) T down[Width]{};
+  alignas(64) T out[Width]{};
+  T mid[Width + 2]{};
+  std::copy(above + j, above + j + n, up);
+  std::copy(below + j, below + j + n, down);
+  std::copy(center + j - 1, center + j + n + 1, mid);
+  kernel(factor, up, mid + 1, down, out, 0, Width);
+  std::copy(out, out + n, target + j);
+}
+
+/// Elements are processed in blocks of fixed size with the fused operations
+/// spelled out, since under -ffast-math the scalar epilogue of a vectorized
+/// loop may otherwise round differently from its vector body.
+constexpr int kScalarBlock = 8;
+
+void DiffuseRowScalar(const float factor, const float *__restrict__ above,
+                      const float *__restrict__ center,
+                      const float *__restrict__ below,
+                      float *__restrict__ target, int j, const int jEnd) {
+  for (; j + kScalarBlock <= jEnd; j += kScalarBlock) {
+    for (int b = j; b < j + kScalarBlock; ++b) {
+      const float neighbors =
+          (above[b] + below[b]) + (center[b - 1] + center[b + 1]);
+      target[b] =
+          std::fma(factor, std::fma(-4.f, center[b], neighbors), center[b]);
+    }
+  }
+  if (j < jEnd) {
+    DiffusePartial<kScalarBlock>(DiffuseRowScalar, factor, above, center,
+                                 below, target, j, jEnd - j);
+  }
+}
+
+#ifdef HPCSE_DIFFUSION_X86
+
+/// SSE2 has no fused multiply-add, so unlike the other kernels the update is
+/// rounded after the multiplications as well (see DiffuseRow).
+template <bool Aligned>
+__attribute__((target("sse2")))
+void DiffuseRowSseImpl(const float factor, const float *__restrict__ above,
+                       const float *__restrict__ center,
+                       const float *__restrict__ below,
+                       float *__restrict__ target, int j, const int jEnd) {
+  const int head = ToAligned<16>(target, j, jEnd - j);
+  if (head > 0) {
+    DiffusePartial<4>(DiffuseRowSseImpl<false>, factor, above, center, below,
+                      target, j, head);
+    j += head;
+  }
+  const __m128 factorVec = _mm_set1_ps(factor);
+  const __m128 four = _mm_set1_ps(4);
+  for (; j + 4 <= jEnd; j += 4) {
+    const __m128 up = Aligned ? _mm_load_ps(above + j) : _mm_loadu_ps(above + j);
+    const __m128 down =
+        Aligned ? _mm_load_ps(below + j) : _mm_loadu_ps(below + j);
+    const __m128 mid =
+        Aligned ? _mm_load_ps(center + j) : _mm_loadu_ps(center + j);
+    const __m128 left = _mm_loadu_ps(center + j - 1);
+    const __m128 right = _mm_loadu_ps(center + j + 1);
+    const __m128 neighbors =
+        _mm_add_ps(_mm_add_ps(up, down), _mm_add_ps(left, right));
+    const __m128 laplace = _mm_sub_ps(neighbors, _mm_mul_ps(four, mid));
+    _mm_store_ps(target + j, _mm_add_ps(mid, _mm_mul_ps(factorVec, laplace)));
+  }
+  if (j < jEnd) {
+    DiffusePartial<4>(DiffuseRowSseImpl<false>, factor, above, center, below,
+                      target, j, jEnd - j);
+  }
+}
+
+template <bool Aligned>
+__attribute__((target("avx2,fma")))
+void DiffuseRowAvx2Impl(const float factor, const float *__restrict__ above,
+                        const float *__restrict__ center,
+                        const float *__restrict__ below,
+                        float *__restrict__ target, int j, const int jEnd) {
+  const int head = ToAligned<32>(target, j, jEnd - j);
+  if (head > 0) {
+    DiffusePartial<8>(DiffuseRowAvx2Impl<false>, factor, above, center, below,
+                      target, j, head);
+    j += head;
+  }
+  const __m256 factorVec = _mm256_set1_ps(factor);
+  const __m256 four = _mm256_set1_ps(4);
+  for (; j + 8 <= jEnd; j += 8) {
+    const __m256 up =
+        Aligned ? _mm256_load_ps(above + j) : _mm256_loadu_ps(above + j);
+    const __m256 down =
+        Aligned ? _mm256_load_ps(below + j) : _mm256_loadu_ps(below + j);
+    const __m256 mid =
+        Aligned ? _mm256_load_ps(center + j) : _mm256_loadu_ps(center + j);
+    const __m256 left = _mm256_loadu_ps(center + j - 1);
+    const __m256 right = _mm256_loadu_ps(center + j + 1);
+    const __m256 neighbors =
+        _mm256_add_ps(_mm256_add_ps(up, down), _mm256_add_ps(left, right));
+    const __m256 laplace = _mm256_fnmadd_ps(four, mid, neighbors);
+    _mm256_store_ps(target + j, _mm256_fmadd_ps(factorVec, laplace, mid));
+  }
+  if (j < jEnd) {
+    DiffusePartial<8>(DiffuseRowAvx2Impl<false>, factor, above, center, below,
+                      target, j, jEnd - j);
+  }
+}
+
+template <bool Aligned>
+__attribute__((target("avx512f")))
+void DiffuseRowAvx512Impl(const float factor, const float *__restrict__ above,
+                          const float *__restrict__ center,
+                          const float *__restrict__ below,
+                          float *__restrict__ target, int j, const int jEnd) {
+  const int head = ToAligned<64>(target, j, jEnd - j);
+  if (head > 0) {
+    DiffusePartial<16>(DiffuseRowAvx512Impl<false>, factor, above, center,
+                       below, target, j, head);
+    j += head;
+  }
+  const __m512 factorVec = _mm512_set1_ps(factor);
+  const __m512 four = _mm512_set1_ps(4);
+  for (; j + 16 <= jEnd; j += 16) {
+    const __m512 up =
+        Aligned ? _mm512_load_ps(above + j) : _mm512_loadu_ps(above + j);
+    const __m512 down =
+        Aligned ? _mm512_load_ps(below + j) : _mm512_loadu_ps(below + j);
+    const __m512 mid =
+        Aligned ? _mm512_load_ps(center + j) : _mm512_loadu_ps(center + j);
+    const __m512 left = _mm512_loadu_ps(center + j - 1);
+    const __m512 right = _mm512_loadu_ps(center + j + 1);
+    const __m512 neighbors =
+        _mm512_add_ps(_mm512_add_ps(up, down), _mm512_add_ps(left, right));
+    const __m512 laplace = _mm512_fnmadd_ps(four, mid, neighbors);
+    _mm512_store_ps(target + j, _mm512_fmadd_ps(factorVec, laplace, mid));
+  }
+  if (j < jEnd) {
+    DiffusePartial<16>(DiffuseRowAvx512Impl<false>, factor, above, center,
+                       below, target, j, jEnd - j);
+  }
+}
+
+// Aligned loads can be used for the vertical neighbors when all rows share the
+// alignment of the target row, which is always the case for rows of Grid.
+template <unsigned Bytes>
+inline bool CoAligned(const float *above, const float *center,
+                      const float *below, const float *target) {
+  const auto t = reinterpret_cast<std::uintptr_t>(target);
+  return (((reinterpret_cast<std::uintptr_t>(above) ^ t) |
+           (reinterpret_cast<std::uintptr_t>(center) ^ t) |
+           (reinterpret_cast<std::uintptr_t>(below) ^ t)) &
+          (Bytes - 1)) == 0;
+}
+
+void DiffuseRowSse(const float factor, const float *above,
+                   const float *center, const float *below, float *target,
+                   const int jBegin, const int jEnd) {
+  if (CoAligned<16>(above, center, below, target)) {
+    DiffuseRowSseImpl<true>(factor, above, center, below, target, jBegin,
+                            jEnd);
+  } else {
+    DiffuseRowSseImpl<false>(factor, above, center, below, target, jBegin,
+                             jEnd);
+  }
+}
+
+void DiffuseRowAvx2(const float factor, const float *above,
+                    const float *center, const float *below, float *target,
+                    const int jBegin, const int jEnd) {
+  if (CoAligned<32>(above, center, below, target)) {
+    DiffuseRowAvx2Impl<true>(factor, above, center, below, target, jBegin,
+                             jEnd);
+  } else {
+    DiffuseRowAvx2Impl<false>(factor, above, center, below, target, jBegin,
+                              jEnd);
+  }
+}
+
+void DiffuseRowAvx512(const float factor, const float *above,
+                      const float *center, const float *below, float *target,
+                      const int jBegin, const int jEnd) {
+  if (CoAligned<64>(above, center, below, target)) {
+    DiffuseRowAvx512Impl<true>(factor, above, center, below, target, jBegin,
+                               jEnd);
+  } else {
+    DiffuseRowAvx512Impl<false>(factor, above, center, below, target, jBegin,
+                                jEnd);
+  }
+}
+
+#endif // HPCSE_DIFFUSION_X86
+
+DiffuseRowKernel KernelForIsa(const SimdIsa isa) {
+  switch (isa) {
+#ifdef HPCSE_DIFFUSION_X86
+    case SimdIsa::avx512:
+      return DiffuseRowAvx512;
+    case SimdIsa::avx2:
+      return DiffuseRowAvx2;
+    case SimdIsa::sse:
+      return DiffuseRowSse;
+#endif
+    default:
+      return DiffuseRowScalar;
+  }
+}
+
+std::atomic<SimdIsa> &SelectedIsa() {
+  static std::atomic<SimdIsa> isa(DetectSimdIsa());
+  return isa;
+}
+
+std::atomic<DiffuseRowKernel> &SelectedKernel() {
+  static std::atomic<DiffuseRowKernel> kernel(
+      KernelForIsa(SelectedIsa().load()));
+  return kernel;
+}
+
+// Kernels for 16-bit storage load and convert all operands to single
+// precision, evaluate the stencil in the same order as the single precision
+// kernels, and round the result back on store. Rounding to nearest loses every
+// update smaller than half a unit in the last place, so that with small
+// timesteps the grid stops evolving altogether. Results are therefore rounded
+// stochastically: a random number below one unit in the last place is added
+// to the magnitude, which is then truncated, so that a value is rounded up
+// with a probability proportional to its distance from the value below, and
+// updates are kept in expectation.
+
+/// Random bits for stochastic rounding from xorshift generators, one per lane
+/// of the widest vector and per thread.
+struct RoundingStream {
+  alignas(64) std::uint32_t lanes[16];
+  bool seeded;
+};
+
+thread_local RoundingStream roundingStream = {{}, false};
+
+/// Bijective integer hash, which maps only zero to zero.
+inline std::uint32_t MixBits(std::uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  return x ^ (x >> 16);
+}
+
+/// Generator states of the calling thread. Threads draw distinct streams in
+/// the order in which they first round.
+std::uint32_t *RoundingLanes() {
+  if (!roundingStream.seeded) {
+    static std::atomic<std::uint32_t> streams(0);
+    const std::uint32_t stream = streams.fetch_add(1);
+    for (std::uint32_t i = 0; i < 16; ++i) {
+      roundingStream.lanes[i] = MixBits(stream * 16 + i + 1);
+    }
+    roundingStream.seeded = true;
+  }
+  return roundingStream.lanes;
+}
+
+inline std::uint32_t NextRandom(std::uint32_t &state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+/// Number of low bits of a single precision value below the last place of
+/// binary16: 13 for normal values and up to 23 for subnormal ones. Values
+/// below 2^-24 keep only their leading bit and are truncated to zero.
+inline int HalfRoundingShift(const std::uint32_t bits) {
+  const int exponent = static_cast<int>((bits >> 23) & 0xff);
+  return std::min(std::max(126 - exponent, 13), 23);
+}
+
+template <typename T>
+inline T RoundStochastic(float value, std::uint32_t random);
+
+template <>
+inline Half RoundStochastic<Half>(const float value,
+                                  const std::uint32_t random) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const int shift = HalfRoundingShift(bits);
+  const std::uint32_t mask = (1u << shift) - 1;
+  bits = (bits + (random >> (32 - shift))) & ~mask;
+  float truncated;
+  std::memcpy(&truncated, &bits, sizeof(truncated));
+  return FromFloat<Half>(truncated); // Exact
+}
+
+template <>
+inline BFloat16 RoundStochastic<BFloat16>(const float value,
+                                          const std::uint32_t random) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return BFloat16{
+      static_cast<std::uint16_t>((bits + (random & 0xffff)) >> 16)};
+}
+
+template <typename T>
+void DiffuseRow16Scalar(const float factor, const T *__restrict__ above,
+                      const T *__restrict__ center, const T *__restrict__ below,
+                      T *__restrict__ target, int j, const int jEnd) {
+  std::uint32_t &state = RoundingLanes()[0];
+  for (; j < jEnd; ++j) {
+    const float mid = ToFloat(center[j]);
+    const float neighbors = (ToFloat(above[j]) + ToFloat(below[j])) +
+                            (ToFloat(center[j - 1]) + ToFloat(center[j + 1]));
+    target[j] = RoundStochastic<T>(mid + factor * (neighbors - 4 * mid),
+                                   NextRandom(state));
+  }
+}
+
+template <typename From, typename To>
+void ConvertRowScalar(const From *__restrict__ input, To *__restrict__ output,
+                      int j, const int n) {
+  for (; j < n; ++j) {
+    output[j] = FromFloat<To>(ToFloat(input[j]));
+  }
+}
+
+#ifdef HPCSE_DIFFUSION_X86
+
+// The AVX-512 intrinsics of GCC 12 trigger false positives when inlined
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// Half precision is converted in hardware. Brain floating point is the upper
+// half of a single precision value, so it is widened with a shift and rounded
+// with integer arithmetic.
+
+__attribute__((target("avx2,f16c"))) inline __m256 Load8(const Half *p) {
+  return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+}
+
+__attribute__((target("avx2"))) inline __m256 Load8(const BFloat16 *p) {
+  return _mm256_castsi256_ps(_mm256_slli_epi32(
+      _mm256_cvtepu16_epi32(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))),
+      16));
+}
+
+__attribute__((target("avx2,f16c"))) inline void Store8(Half *p,
+                                                        const __m256 value) {
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(p),
+                   _mm256_cvtps_ph(value, _MM_FROUND_TO_NEAREST_INT));
+}
+
+/// Stores the upper halves of the given bits.
+__attribute__((target("avx2"))) inline void StoreUpper8(BFloat16 *p,
+                                                        const __m256i bits) {
+  const __m256i upper = _mm256_srli_epi32(bits, 16);
+  // Packing works within 128-bit lanes, so gather the low halves of both
+  const __m256i packed =
+      _mm256_permute4x64_epi64(_mm256_packus_epi32(upper, upper), 0x08);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(p),
+                   _mm256_castsi256_si128(packed));
+}
+
+__attribute__((target("avx2"))) inline void Store8(BFloat16 *p,
+                                                   const __m256 value) {
+  const __m256i bits = _mm256_castps_si256(value);
+  const __m256i bias = _mm256_add_epi32(
+      _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1)),
+      _mm256_set1_epi32(0x7fff));
+  StoreUpper8(p, _mm256_add_epi32(bits, bias));
+}
+
+__attribute__((target("avx2"))) inline __m256i NextRandom8(__m256i state) {
+  state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+  state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+  return _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+}
+
+/// Stochastically rounding counterparts of Store8 (see RoundStochastic).
+__attribute__((target("avx2,f16c"))) inline void
+StoreStochastic8(Half *p, const __m256 value, const __m256i random) {
+  const __m256i bits = _mm256_castps_si256(value);
+  const __m256i exponent =
+      _mm256_and_si256(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(0xff));
+  // Keeps the top bits of the random number, as many as lie below the last
+  // place of binary16 (see HalfRoundingShift)
+  const __m256i keep = _mm256_min_epi32(
+      _mm256_max_epi32(_mm256_sub_epi32(exponent, _mm256_set1_epi32(94)),
+                       _mm256_set1_epi32(9)),
+      _mm256_set1_epi32(19));
+  // Zeros would become subnormal, which the conversion may handle in
+  // microcode, and truncate back to zero in any case
+  const __m256i noise = _mm256_andnot_si256(
+      _mm256_cmpeq_epi32(exponent, _mm256_setzero_si256()),
+      _mm256_srlv_epi32(random, keep));
+  const __m256i noisy = _mm256_add_epi32(bits, noise);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(p),
+                   _mm256_cvtps_ph(_mm256_castsi256_ps(noisy),
+                                   _MM_FROUND_TO_ZERO));
+}
+
+__attribute__((target("avx2"))) inline void
+StoreStochastic8(BFloat16 *p, const __m256 value, const __m256i random) {
+  StoreUpper8(p, _mm256_add_epi32(
+                     _mm256_castps_si256(value),
+                     _mm256_and_si256(random, _mm256_set1_epi32(0xffff))));
+}
+
+__attribute__((target("avx512f"))) inline __m512 Load16(const Half *p) {
+  return _mm512_cvtph_ps(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+}
+
+__attribute__((target("avx512f"))) inline __m512 Load16(const BFloat16 *p) {
+  return _mm512_castsi512_ps(_mm512_slli_epi32(
+      _mm512_cvtepu16_epi32(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p))),
+      16));
+}
+
+__attribute__((target("avx512f"))) inline void Store16(Half *p,
+                                                      const __m512 value) {
+  _mm256_storeu_si256(
+      reinterpret_cast<__m256i *>(p),
+      _mm512_cvtps_ph(value, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+
+/// Stores the upper halves of the given bits.
+__attribute__((target("avx512f"))) inline void StoreUpper16(BFloat16 *p,
+                                                           const __m512i bits) {
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(p),
+                      _mm512_cvtepi32_epi16(_mm512_srli_epi32(bits, 16)));
+}
+
+__attribute__((target("avx512f"))) inline void Store16(BFloat16 *p,
+                                                      const __m512 value) {
+  const __m512i bits = _mm512_castps_si512(value);
+  const __m512i bias = _mm512_add_epi32(
+      _mm512_and_si512(_mm512_srli_epi32(bits, 16), _mm512_set1_epi32(1)),
+      _mm512_set1_epi32(0x7fff));
+  StoreUpper16(p, _mm512_add_epi32(bits, bias));
+}
+
+__attribute__((target("avx512f"))) inline __m512i NextRandom16(__m512i state) {
+  state = _mm512_xor_si512(state, _mm512_slli_epi32(state, 13));
+  state = _mm512_xor_si512(state, _mm512_srli_epi32(state, 17));
+  return _mm512_xor_si512(state, _mm512_slli_epi32(state, 5));
+}
+
+__attribute__((target("avx512f"))) inline void
+StoreStochastic16(Half *p, const __m512 value, const __m512i random) {
+  const __m512i bits = _mm512_castps_si512(value);
+  const __m512i exponent =
+      _mm512_and_si512(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(0xff));
+  // Keeps the top bits of the random number, as many as lie below the last
+  // place of binary16 (see HalfRoundingShift)
+  const __m512i keep = _mm512_min_epi32(
+      _mm512_max_epi32(_mm512_sub_epi32(exponent, _mm512_set1_epi32(94)),
+                       _mm512_set1_epi32(9)),
+      _mm512_set1_epi32(19));
+  const __m512i noise = _mm512_maskz_srlv_epi32(
+      _mm512_test_epi32_mask(exponent, exponent), random, keep);
+  const __m512i noisy = _mm512_add_epi32(bits, noise);
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(p),
+                      _mm512_cvtps_ph(_mm512_castsi512_ps(noisy),
+                                      _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+}
+
+__attribute__((target("avx512f"))) inline void
+StoreStochastic16(BFloat16 *p, const __m512 value, const __m512i random) {
+  StoreUpper16(p, _mm512_add_epi32(
+                      _mm512_castps_si512(value),
+                      _mm512_and_si512(random, _mm512_set1_epi32(0xffff))));
+}
+
+template <typename T>
+__attribute__((target("avx2,fma,f16c")))
+void DiffuseRow16Avx2(const float factor, const T *__restrict__ above,
+                    const T *__restrict__ center, const T *__restrict__ below,
+                    T *__restrict__ target, int j, const int jEnd) {
+  const __m256 factorVec = _mm256_set1_ps(factor);
+  const __m256 four = _mm256_set1_ps(4);
+  std::uint32_t *const lanes = RoundingLanes();
+  __m256i random = _mm256_load_si256(reinterpret_cast<const __m256i *>(lanes));
+  for (; j + 8 <= jEnd; j += 8) {
+    const __m256 mid = Load8(center + j);
+    const __m256 neighbors =
+        _mm256_add_ps(_mm256_add_ps(Load8(above + j), Load8(below + j)),
+                      _mm256_add_ps(Load8(center + j - 1), Load8(center + j + 1)));
+    const __m256 laplace = _mm256_fnmadd_ps(four, mid, neighbors);
+    random = NextRandom8(random);
+    StoreStochastic8(target + j, _mm256_fmadd_ps(factorVec, laplace, mid),
+                     random);
+  }
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), random);
+  if (j < jEnd) {
+    DiffusePartial<8>(DiffuseRow16Avx2<T>, factor, above, center, below,
+                      target, j, jEnd - j);
+  }
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+void DiffuseRow16Avx512(const float factor, const T *__restrict__ above,
+                      const T *__restrict__ center, const T *__restrict__ below,
+                      T *__restrict__ target, int j, const int jEnd) {
+  const __m512 factorVec = _mm512_set1_ps(factor);
+  const __m512 four = _mm512_set1_ps(4);
+  std::uint32_t *const lanes = RoundingLanes();
+  __m512i random = _mm512_load_si512(lanes);
+  for (; j + 16 <= jEnd; j += 16) {
+    const __m512 mid = Load16(center + j);
+    const __m512 neighbors = _mm512_add_ps(
+        _mm512_add_ps(Load16(above + j), Load16(below + j)),
+        _mm512_add_ps(Load16(center + j - 1), Load16(center + j + 1)));
+    const __m512 laplace = _mm512_fnmadd_ps(four, mid, neighbors);
+    random = NextRandom16(random);
+    StoreStochastic16(target + j, _mm512_fmadd_ps(factorVec, laplace, mid),
+                      random);
+  }
+  _mm512_store_si512(lanes, random);
+  if (j < jEnd) {
+    DiffusePartial<16>(DiffuseRow16Avx512<T>, factor, above, center, below,
+                       target, j, jEnd - j);
+  }
+}
+
+template <typename T>
+__attribute__((target("avx2,f16c")))
+void ConvertRowAvx2(const T *__restrict__ input, float *__restrict__ output,
+                    const int n) {
+  int j = 0;
+  for (; j + 8 <= n; j += 8) {
+    _mm256_storeu_ps(output + j, Load8(input + j));
+  }
+  ConvertRowScalar(input, output, j, n);
+}
+
+template <typename T>
+__attribute__((target("avx2,f16c")))
+void ConvertRowAvx2(const float *__restrict__ input, T *__restrict__ output,
+                    const int n) {
+  int j = 0;
+  for (; j + 8 <= n; j += 8) {
+    Store8(output + j, _mm256_loadu_ps(input + j));
+  }
+  ConvertRowScalar(input, output, j, n);
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+void ConvertRowAvx512(const T *__restrict__ input, float *__restrict__ output,
+                      const int n) {
+  int j = 0;
+  for (; j + 16 <= n; j += 16) {
+    _mm512_storeu_ps(output + j, Load16(input + j));
+  }
+  ConvertRowScalar(input, output, j, n);
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+void ConvertRowAvx512(const float *__restrict__ input, T *__restrict__ output,
+                      const int n) {
+  int j = 0;
+  for (; j + 16 <= n; j += 16) {
+    Store16(output + j, _mm512_loadu_ps(input + j));
+  }
+  ConvertRowScalar(input, output, j, n);
+}
+
+#pragma GCC diagnostic pop
+
+#endif // HPCSE_DIFFUSION_X86
+
+// The 16-bit kernels are dispatched on every call rather than through a
+// function pointer, since there is one per format. Every CPU supporting AVX2
+// also supports F16C, and SSE falls back to the scalar kernels.
+
+template <typename T>
+void DiffuseRowStorage(const float factor, const T *above, const T *center,
+                       const T *below, T *target, const int jBegin,
+                       const int jEnd) {
+  switch (SelectedIsa().load(std::memory_order_relaxed)) {
+#ifdef HPCSE_DIFFUSION_X86
+    case SimdIsa::avx512:
+      DiffuseRow16Avx512(factor, above, center, below, target, jBegin, jEnd);
+      return;
+    case SimdIsa::avx2:
+      DiffuseRow16Avx2(factor, above, center, below, target, jBegin, jEnd);
+      return;
+#endif
+    default:
+      DiffuseRow16Scalar(factor, above, center, below, target, jBegin, jEnd);
+  }
+}
+
+template <typename From, typename To>
+void ConvertRowStorage(const From *input, To *output, const int n) {
+  switch (SelectedIsa().load(std::memory_order_relaxed)) {
+#ifdef HPCSE_DIFFUSION_X86
+    case SimdIsa::avx512:
+      ConvertRowAvx512(input, output, n);
+      return;
+    case SimdIsa::avx2:
+      ConvertRowAvx2(input, output, n);
+      return;
+#endif
+    default:
+      ConvertRowScalar(input, output, 0, n);
+  }
+}
+
+} // End anonymous namespace
+
+void DiffuseRow(const float factor, const float *above, const float *center,
+                const float *below, float *target, const int jBegin,
+                const int jEnd) {
+  SelectedKernel().load(std::memory_order_relaxed)(factor, above, center,
+                                                   below, target, jBegin, jEnd);
+}
+
+void DiffuseRow(const float factor, const Half *above, const Half *center,
+                const Half *below, Half *target, const int jBegin,
+                const int jEnd) {
+  DiffuseRowStorage(factor, above, center, below, target, jBegin, jEnd);
+}
+
+void DiffuseRow(const float factor, const BFloat16 *above,
+                const BFloat16 *center, const BFloat16 *below,
+                BFloat16 *target, const int jBegin, const int jEnd) {
+  DiffuseRowStorage(factor, above, center, below, target, jBegin, jEnd);
+}
+
+void ConvertRow(Half const *input, float *output, const int n) {
+  ConvertRowStorage(input, output, n);
+}
+
+void ConvertRow(BFloat16 const *input, float *output, const int n) {
+  ConvertRowStorage(input, output, n);
+}
+
+void ConvertRow(float const *input, Half *output, const int n) {
+  ConvertRowStorage(input, output, n);
+}
+
+void ConvertRow(float const *input, BFloat16 *output, const int n) {
+  ConvertRowStorage(input, output, n);
+}
+
+SimdIsa DetectSimdIsa() {
+#ifdef HPCSE_DIFFUSION_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return SimdIsa::avx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return SimdIsa::avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return SimdIsa::sse;
+  }
+#endif
+  return SimdIsa::scalar;
+}
+
+SimdIsa DiffusionIsa() {
+  return SelectedIsa().load();
+}
+
+SimdIsa SetDiffusionIsa(SimdIsa isa) {
+  const SimdIsa supported = DetectSimdIsa();
+  if (static_cast<int>(isa) > static_cast<int>(supported)) {
+    isa = supported;
+  }
+  SelectedIsa().store(isa);
+  SelectedKernel().store(KernelForIsa(isa));
+  return isa;
+}
+
+char const *SimdIsaName(const SimdIsa isa) {
+  switch (isa) {
+    case SimdIsa::avx512:
+      return "AVX-512";
+    case SimdIsa::avx2:
+      return "AVX2";
+    case SimdIsa::sse:
+      return "SSE";
+    default:
+      return "scalar";
+  }
+}
+
+} // End namespace hpcse
@@ -0,0 +1,401 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date November 2015
+
+#include <algorithm>
+#include <vector>
+#include "diffusion/Diffusion.h"
+
+namespace hpcse {
+
+namespace {
+
+constexpr int kPreSmoothing = 2;
+constexpr int kPostSmoothing = 2;
+
+/// Levels are coarsened until neither side has more interior cells than this.
+constexpr int kCoarsestCells = 4;
+
+/// Sweeps solving the coarsest level, enough to converge on a few cells.
+constexpr int kCoarsestSweeps = 32;
+
+/// Conjugate gradients stop once the residual has been reduced by this factor,
+/// or after kMaxIterations iterations, since single precision cannot always
+/// get there.
+constexpr double kTolerance = 1e-5;
+constexpr int kMaxIterations = 30;
+
+/// One level of the multigrid hierarchy for the system
+///   m_p u_p + sum_q k_pq (u_p - u_q) = b_p,
+/// where q runs over the four neighbors of cell p. All grids have a ring of
+/// boundary cells, so interior cells are [1, rows] x [1, cols]. Every level
+/// solves for corrections, so the boundary of the solution is zero.
+struct Level {
+  int rows;
+  int cols;
+  Grid_t solution;
+  Grid_t rhs;
+  Grid_t residual;
+  /// Coefficient m_p of each cell.
+  Grid_t mass;
+  /// Coupling of (i, j - 1) and (i, j), for j in [1, cols + 1].
+  Grid_t couplingX;
+  /// Coupling of (i - 1, j) and (i, j), for i in [1, rows + 1].
+  Grid_t couplingY;
+  Grid_t diagonal;
+  Grid_t inverseDiagonal;
+};
+
+/// Grid of zeros first touched with the same static schedule used by all
+/// operations on it.
+Grid_t Zeros(const int rows, const int cols, const unsigned nThreads) {
+  Grid_t grid = Grid_t::Allocate(rows, cols);
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 0; i < rows; ++i) {
+    grid.FillRows(i, i + 1, 0);
+  }
+  return grid;
+}
+
+Level AllocateLevel(const int rows, const int cols, const unsigned nThreads) {
+  return Level{rows,
+               cols,
+               Zeros(rows + 2, cols + 2, nThreads),
+               Zeros(rows + 2, cols + 2, nThreads),
+               Zeros(rows + 2, cols + 2, nThreads),
+               Zeros(rows + 2, cols + 2, nThreads),
+               Zeros(rows + 2, cols + 2, nThreads),
+               Zeros(rows + 2, cols + 2, nThreads),
+               Zeros(rows + 2, cols + 2, nThreads),
+               Zeros(rows + 2, cols + 2, nThreads)};
+}
+
+void ComputeDiagonal(Level &level, const unsigned nThreads) {
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i <= level.rows; ++i) {
+    for (int j = 1; j <= level.cols; ++j) {
+      level.diagonal[i][j] = level.mass[i][j] + level.couplingX[i][j] +
+                             level.couplingX[i][j + 1] +
+                             level.couplingY[i][j] + level.couplingY[i + 1][j];
+      level.inverseDiagonal[i][j] = 1 / level.diagonal[i][j];
+    }
+  }
+}
+
+/// Backward Euler on the grid of diffusion constants, where neighboring cells
+/// are coupled by the mean of their diffusion constants.
+Level FinestLevel(Grid_t const &diffusivity, const float dt, const float ds,
+                  const unsigned nThreads) {
+  const int rows = diffusivity.rows() - 2;
+  const int cols = diffusivity.cols() - 2;
+  Level level = AllocateLevel(rows, cols, nThreads);
+  const float scale = 0.5f * dt / (ds * ds);
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i <= rows + 1; ++i) {
+    for (int j = 1; j <= cols + 1; ++j) {
+      if (i <= rows) {
+        level.mass[i][j] = 1;
+        level.couplingX[i][j] =
+            scale * (diffusivity[i][j - 1] + diffusivity[i][j]);
+      }
+      if (j <= cols) {
+        level.couplingY[i][j] =
+            scale * (diffusivity[i - 1][j] + diffusivity[i][j]);
+      }
+    }
+  }
+  ComputeDiagonal(level, nThreads);
+  return level;
+}
+
+/// Aggregates blocks of two by two cells, the last of which may cover a single
+/// row or column. Masses of the aggregated cells are summed, as are the
+/// couplings crossing between aggregates, which are then halved to match
+/// discretizing the operator directly on the coarser grid.
+Level CoarseLevel(Level const &fine, const unsigned nThreads) {
+  const int rows = (fine.rows + 1) / 2;
+  const int cols = (fine.cols + 1) / 2;
+  Level level = AllocateLevel(rows, cols, nThreads);
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i <= rows + 1; ++i) {
+    const int iFine = std::min(2 * i - 1, fine.rows + 1);
+    const int iFineEnd = std::min(2 * i + 1, fine.rows + 1);
+    for (int j = 1; j <= cols + 1; ++j) {
+      const int jFine = std::min(2 * j - 1, fine.cols + 1);
+      const int jFineEnd = std::min(2 * j + 1, fine.cols + 1);
+      if (i <= rows) {
+        float mass = 0;
+        float couplingX = 0;
+        for (int k = iFine; k < iFineEnd; ++k) {
+          couplingX += fine.couplingX[k][jFine];
+          for (int l = jFine; l < jFineEnd; ++l) {
+            mass += fine.mass[k][l];
+          }
+        }
+        level.mass[i][j] = mass;
+        level.couplingX[i][j] = 0.5f * couplingX;
+      }
+      if (j <= cols) {
+        float couplingY = 0;
+        for (int l = jFine; l < jFineEnd; ++l) {
+          couplingY += fine.couplingY[iFine][l];
+        }
+        level.couplingY[i][j] = 0.5f * couplingY;
+      }
+    }
+  }
+  ComputeDiagonal(level, nThreads);
+  return level;
+}
+
+/// Red-black Gauss-Seidel, updating the cells of color firstColor first. Cells
+/// of one color only depend on cells of the other, so each half sweep is split
+/// among threads by rows, and the result does not depend on the number of
+/// threads.
+void Smooth(Level &level, const int nSweeps, const int firstColor,
+            const unsigned nThreads) {
+  for (int s = 0; s < 2 * nSweeps; ++s) {
+    const int color = (firstColor + s) & 1;
+    #pragma omp parallel for schedule(static) num_threads(nThreads)
+    for (int i = 1; i <= level.rows; ++i) {
+      float *u = level.solution[i];
+      const float *above = level.solution[i - 1];
+      const float *below = level.solution[i + 1];
+      const float *b = level.rhs[i];
+      const float *kx = level.couplingX[i];
+      const float *kyAbove = level.couplingY[i];
+      const float *kyBelow = level.couplingY[i + 1];
+      const float *inverse = level.inverseDiagonal[i];
+      for (int j = 1 + ((i + 1 + color) & 1); j <= level.cols; j += 2) {
+        u[j] = (b[j] + kx[j] * u[j - 1] + kx[j + 1] * u[j + 1] +
+                kyAbove[j] * above[j] + kyBelow[j] * below[j]) *
+               inverse[j];
+      }
+    }
+  }
+}
+
+/// Computes r = b - A x, where x includes the boundary.
+void Residual(Level const &level, Grid_t const &x, Grid_t const &b, Grid_t &r,
+              const unsigned nThreads) {
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i <= level.rows; ++i) {
+    const float *u = x[i];
+    const float *above = x[i - 1];
+    const float *below = x[i + 1];
+    const float *rhs = b[i];
+    const float *kx = level.couplingX[i];
+    const float *kyAbove = level.couplingY[i];
+    const float *kyBelow = level.couplingY[i + 1];
+    const float *diagonal = level.diagonal[i];
+    float *residual = r[i];
+    for (int j = 1; j <= level.cols; ++j) {
+      residual[j] = rhs[j] + kx[j] * u[j - 1] + kx[j + 1] * u[j + 1] +
+                    kyAbove[j] * above[j] + kyBelow[j] * below[j] -
+                    diagonal[j] * u[j];
+    }
+  }
+}
+
+/// Computes y = A x, where x has a zero boundary.
+void Apply(Level const &level, Grid_t const &x, Grid_t &y,
+           const unsigned nThreads) {
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i <= level.rows; ++i) {
+    const float *u = x[i];
+    const float *above = x[i - 1];
+    const float *below = x[i + 1];
+    const float *kx = level.couplingX[i];
+    const float *kyAbove = level.couplingY[i];
+    const float *kyBelow = level.couplingY[i + 1];
+    const float *diagonal = level.diagonal[i];
+    float *output = y[i];
+    for (int j = 1; j <= level.cols; ++j) {
+      output[j] = diagonal[j] * u[j] - kx[j] * u[j - 1] -
+                  kx[j + 1] * u[j + 1] - kyAbove[j] * above[j] -
+                  kyBelow[j] * below[j];
+    }
+  }
+}
+
+/// Inner product over the interior. Rows are summed in a fixed order, so the
+/// result does not depend on the number of threads.
+double Dot(Level const &level, Grid_t const &x, Grid_t const &y,
+           std::vector<double> &rowSums, const unsigned nThreads) {
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i <= level.rows; ++i) {
+    double sum = 0;
+    for (int j = 1; j <= level.cols; ++j) {
+      sum += x[i][j] * y[i][j];
+    }
+    rowSums[i] = sum;
+  }
+  double sum = 0;
+  for (int i = 1; i <= level.rows; ++i) {
+    sum += rowSums[i];
+  }
+  return sum;
+}
+
+/// Sums the residual of each aggregate into the right hand side of the coarse
+/// level, and clears its solution.
+void Restrict(Level const &fine, Level &coarse, const unsigned nThreads) {
+  // Aggregates covering a single fine column
+  const int jFull = fine.cols / 2;
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i <= coarse.rows; ++i) {
+    const float *upper = fine.residual[2 * i - 1];
+    // Aggregates covering a single fine row sum the zero boundary below
+    const float *lower = fine.residual[std::min(2 * i, fine.rows + 1)];
+    float *rhs = coarse.rhs[i];
+    for (int j = 1; j <= jFull; ++j) {
+      rhs[j] = upper[2 * j - 1] + upper[2 * j] + lower[2 * j - 1] +
+               lower[2 * j];
+    }
+    if (jFull < coarse.cols) {
+      rhs[coarse.cols] = upper[fine.cols] + lower[fine.cols];
+    }
+    std::fill(coarse.solution[i] + 1, coarse.solution[i] + coarse.cols + 1,
+              0.f);
+  }
+}
+
+/// Adds the correction of each aggregate to all of its cells.
+void Prolongate(Level const &coarse, Level &fine, const unsigned nThreads) {
+  const int jFull = fine.cols / 2;
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i <= fine.rows; ++i) {
+    const float *correction = coarse.solution[(i + 1) / 2];
+    float *u = fine.solution[i];
+    for (int j = 1; j <= jFull; ++j) {
+      u[2 * j - 1] += correction[j];
+      u[2 * j] += correction[j];
+    }
+    if (jFull < coarse.cols) {
+      u[fine.cols] += correction[coarse.cols];
+    }
+  }
+}
+
+/// Improves the solution of level l, starting from its current value. Post
+/// smoothing visits the colors in reverse order, so the cycle is a symmetric
+/// operator when started from zero.
+void VCycle(std::vector<Level> &levels, const size_t l,
+            const unsigned nThreads) {
+  Level &level = levels[l];
+  if (l == levels.size() - 1) {
+    Smooth(level, kCoarsestSweeps / 2, 0, nThreads);
+    Smooth(level, kCoarsestSweeps / 2, 1, nThreads);
+    return;
+  }
+  Smooth(level, kPreSmoothing, 0, nThreads);
+  Residual(level, level.solution, level.rhs, level.residual, nThreads);
+  Restrict(level, levels[l + 1], nThreads);
+  VCycle(levels, l + 1, nThreads);
+  Prolongate(levels[l + 1], level, nThreads);
+  Smooth(level, kPostSmoothing, 1, nThreads);
+}
+
+} // End anonymous namespace
+
+void DiffusionMultigrid(unsigned nThreads, Grid_t const &diffusivity,
+                        const float dt, std::vector<float> const &snapshots,
+                        SnapshotSink_t const &sink) {
+  nThreads = std::max(1u, nThreads);
+  const float ds = 2./diffusivity.cols();
+  std::vector<Level> levels;
+  levels.emplace_back(FinestLevel(diffusivity, dt, ds, nThreads));
+  while (std::max(levels.back().rows, levels.back().cols) > kCoarsestCells) {
+    levels.emplace_back(CoarseLevel(levels.back(), nThreads));
+  }
+  Level &finest = levels[0];
+  // The residual of conjugate gradients is the right hand side of the finest
+  // level, and the preconditioned residual its solution
+  Grid_t &residual = finest.rhs;
+  Grid_t &preconditioned = finest.solution;
+  Grid_t grid = Zeros(diffusivity.rows(), diffusivity.cols(), nThreads);
+  Grid_t previous = Zeros(grid.rows(), grid.cols(), nThreads);
+  Grid_t direction = Zeros(grid.rows(), grid.cols(), nThreads);
+  Grid_t product = Zeros(grid.rows(), grid.cols(), nThreads);
+  std::vector<double> rowSums(grid.rows());
+  const int rowBegin = grid.rows()>>2;
+  const int rowEnd = grid.rows() - rowBegin;
+  const int colBegin = grid.cols()>>2;
+  const int colEnd = grid.cols() - colBegin;
+  for (int i = rowBegin; i < rowEnd; ++i) {
+    std::fill(grid[i] + colBegin, grid[i] + colEnd, 1);
+  }
+  auto precondition = [&]() {
+    preconditioned.FillRows(0, preconditioned.rows(), 0);
+    VCycle(levels, 0, nThreads);
+  };
+  float t = 0;
+  auto snapshotItr = snapshots.cbegin();
+  auto snapshotEnd = snapshots.cend();
+  size_t snapshotIndex = 0;
+  while (true) {
+    if (t >= *snapshotItr) {
+      sink(snapshotIndex++, t, grid);
+      if (++snapshotItr == snapshotEnd) break;
+    }
+    // Solve with the previous solution as both the right hand side and the
+    // initial guess
+    #pragma omp parallel for schedule(static) num_threads(nThreads)
+    for (int i = 1; i <= finest.rows; ++i) {
+      std::copy(grid[i] + 1, grid[i] + finest.cols + 1, previous[i] + 1);
+    }
+    Residual(finest, grid, previous, residual, nThreads);
+    precondition();
+    #pragma omp parallel for schedule(static) num_threads(nThreads)
+    for (int i = 1; i <= finest.rows; ++i) {
+      std::copy(preconditioned[i] + 1, preconditioned[i] + finest.cols + 1,
+                direction[i] + 1);
+    }
+    double rho = Dot(finest, residual, preconditioned, rowSums, nThreads);
+    const double initial = Dot(finest, residual, residual, rowSums, nThreads);
+    for (int k = 0; k < kMaxIterations && rho > 0; ++k) {
+      Apply(finest, direction, product, nThreads);
+      const float alpha =
+          rho / Dot(finest, direction, product, rowSums, nThreads);
+      #pragma omp parallel for schedule(static) num_threads(nThreads)
+      for (int i = 1; i <= finest.rows; ++i) {
+        for (int j = 1; j <= finest.cols; ++j) {
+          grid[i][j] += alpha * direction[i][j];
+          residual[i][j] -= alpha * product[i][j];
+        }
+      }
+      if (Dot(finest, residual, residual, rowSums, nThreads) <=
+          kTolerance * kTolerance * initial) {
+        break;
+      }
+      precondition();
+      const double rhoNext =
+          Dot(finest, residual, preconditioned, rowSums, nThreads);
+      const float beta = rhoNext / rho;
+      rho = rhoNext;
+      #pragma omp parallel for schedule(static) num_threads(nThreads)
+      for (int i = 1; i <= finest.rows; ++i) {
+        for (int j = 1; j <= finest.cols; ++j) {
+          direction[i][j] = preconditioned[i][j] + beta * direction[i][j];
+        }
+      }
+    }
+    t += dt;
+  }
+}
+
+void DiffusionMultigrid(unsigned nThreads, unsigned dim, float d, float dt,
+                        std::vector<float> const &snapshots,
+                        SnapshotSink_t const &sink) {
+  DiffusionMultigrid(nThreads, Grid_t(dim, dim, 0, d), dt, snapshots, sink);
+}
+
+std::vector<Grid_t> DiffusionMultigrid(unsigned nThreads, unsigned dim,
+                                       float d, float dt,
+                                       std::vector<float> const &snapshots) {
+  std::vector<Grid_t> output;
+  DiffusionMultigrid(nThreads, dim, d, dt, snapshots,
+                     CollectSnapshots(output));
+  return output;
+}
+
+} // End namespace hpcse
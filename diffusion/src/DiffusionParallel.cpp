@@ -1,57 +1,81 @@
 /// \author Johannes de Fine Licht (definelj@student.ethz.ch)
 /// \date October 2015
 
-#include <future>
 #include <memory>
+#include <thread>
 #include <vector>
+#include "common/ThreadPool.h"
 #include "diffusion/Diffusion.h"
 #include "diffusion/Barrier.h"
 #include "DiffusionJob.h"
 
 namespace hpcse {
 
-std::vector<Grid_t> DiffusionParallel(unsigned nCores, unsigned dim, float d,
-                                      float dt,
-                                      std::vector<float> const &snapshots) {
+template <typename T>
+void DiffusionParallel(unsigned nCores, unsigned dim, float d, float dt,
+                       std::vector<float> const &snapshots,
+                       SnapshotSink_t const &sink, ThreadPool &pool) {
+  using Job_t = DiffusionJob<T>;
   unsigned rowsPerCore = dim / nCores;
-  std::vector<std::shared_ptr<DiffusionJob>> workers;
+  std::vector<std::shared_ptr<Job_t>> workers;
+  ThreadAffinity const &affinity = DiffusionAffinity();
   { 
-    // Let each worker allocate and initialize their own set of rows
-    std::vector<std::future<std::shared_ptr<DiffusionJob>>> futures;
+    // Let each worker allocate and initialize their own set of rows, pinned to
+    // the same CPU it will later run on. Pool threads are only pinned for the
+    // duration of each task, so later users of the pool are unaffected
+    std::vector<std::future<std::shared_ptr<Job_t>>> futures;
     for (unsigned i = 0; i < nCores; ++i) {
-      futures.emplace_back(std::async(std::launch::async,
-                                      DiffusionJob::Allocate, rowsPerCore, dim,
-                                      i * rowsPerCore));
+      futures.emplace_back(pool.Submit([rowsPerCore, dim, i, &affinity]() {
+        ScopedPin pin(affinity, i);
+        return Job_t::Allocate(rowsPerCore, dim, i * rowsPerCore);
+      }));
     }
     for (unsigned i = 0; i < nCores; ++i) {
       workers.emplace_back(futures[i].get());
     }
   }
-  std::vector<Grid_t> output(snapshots.size());
+  // Single snapshot shared by all workers and reused for every snapshot
+  Grid_t snapshot(rowsPerCore * nCores, dim);
   {
-    // Let workers run independently, synchronizing at each timestep
-    std::vector<std::future<std::vector<Grid_t>>> futures;
-    Barrier barrier(nCores);
+    // Let workers run independently, synchronizing at each timestep. Only spin
+    // while waiting if every worker can have a core to itself
+    std::vector<std::future<void>> futures;
+    Barrier barrier(nCores, nCores <= std::thread::hardware_concurrency()
+                                ? Barrier::kDefaultSpinCount
+                                : 0);
     for (unsigned i = 0; i < nCores; ++i) {
-      futures.emplace_back(std::async(
-          std::launch::async,
-          [d, dt, &snapshots, &barrier](std::shared_ptr<DiffusionJob> job,
-                                        std::shared_ptr<DiffusionJob> above,
-                                        std::shared_ptr<DiffusionJob> below) {
-            return job->RunDiffusion(above, below, d, dt, snapshots, barrier);
+      futures.emplace_back(pool.Submit(
+          [d, dt, &snapshots, &barrier, &snapshot, &affinity, i](
+              std::shared_ptr<Job_t> job, std::shared_ptr<Job_t> above,
+              std::shared_ptr<Job_t> below,
+              SnapshotSink_t const *jobSink) {
+            ScopedPin pin(affinity, i);
+            job->RunDiffusion(above, below, d, dt, snapshots, barrier,
+                              snapshot, jobSink);
           },
           workers[i], i > 0 ? workers[i - 1] : nullptr,
-          i < nCores - 1 ? workers[i + 1] : nullptr));
+          i < nCores - 1 ? workers[i + 1] : nullptr,
+          i == 0 ? &sink : nullptr));
     }
     for (auto &f : futures) {
-      auto partialSnapshot = f.get();
-      for (int i = 0, iEnd = snapshots.size(); i < iEnd; ++i) {
-        output[i].insert(output[i].end(), partialSnapshot[i].cbegin(),
-                         partialSnapshot[i].cend());
-      }
+      f.get();
     }
   }
-  return output;
+}
+
+void DiffusionParallel(unsigned nCores, unsigned dim, float d, float dt,
+                       std::vector<float> const &snapshots,
+                       SnapshotSink_t const &sink, ThreadPool &pool) {
+  switch (DiffusionStorage()) {
+    case StorageFormat::float16:
+      DiffusionParallel<Half>(nCores, dim, d, dt, snapshots, sink, pool);
+      break;
+    case StorageFormat::bfloat16:
+      DiffusionParallel<BFloat16>(nCores, dim, d, dt, snapshots, sink, pool);
+      break;
+    default:
+      DiffusionParallel<float>(nCores, dim, d, dt, snapshots, sink, pool);
+  }
 }
 
 } // End namespace hpcse
@@ -1,93 +1,290 @@
 /// \author Johannes de Fine Licht (definelj@student.ethz.ch)
 /// \date October 2015
 
-#include <cassert>
-#include <memory>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 #include <mpi.h>
-#include "diffusion/Diffusion.h"
+#include "common/Mpi.h"
+#include "common/Trace.h"
+#include "diffusion/DiffusionMPI.h"
+#include "diffusion/DiffusionKernel.h"
+#include "diffusion/Storage.h"
 
 namespace hpcse {
 
-std::vector<Grid_t> DiffusionRows(const unsigned dim, const float d,
-                                  const float dt,
-                                  std::vector<float> const &snapshots) {
+namespace {
+
+/// Grid cells are stored as T, and converted to single precision for the sink.
+template <typename T>
+void DiffusionRowsImpl(const unsigned dim, const float d, const float dt,
+                       std::vector<float> const &snapshots,
+                       SnapshotSink_t const &sink, const bool overlap,
+                       const unsigned ghostWidth, const bool sharedMemory) {
 
   // MPI initialization
   int rank, nRanks;
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &nRanks);
+  auto rowsOf = [dim, nRanks](const int r) {
+    return static_cast<int>(dim*(r+1)/nRanks - dim*r/nRanks);
+  };
   const unsigned rowBegin = dim*rank/nRanks;
-  const unsigned rowEnd = dim*(rank+1)/nRanks;
-  const unsigned nRows = rowEnd - rowBegin;
-  Grid_t grid(nRows+2, Row_t(dim)); // Added padding
+  const int nRows = rowsOf(rank);
+  // Every rank must be able to fill its neighbors' halos from its own rows
+  if (ghostWidth < 1 || ghostWidth > dim / nRanks) {
+    throw std::invalid_argument(
+        "Ghost width must be between 1 and the smallest number of rows per "
+        "rank.");
+  }
+  const int k = ghostWidth;
+  // Exchanges with MPI_PROC_NULL at the outer boundaries complete immediately
+  const int north = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+  const int south = rank < nRanks - 1 ? rank + 1 : MPI_PROC_NULL;
+  const int extendNorth = north != MPI_PROC_NULL;
+  const int extendSouth = south != MPI_PROC_NULL;
+  MPI_Comm nodeComm = mpi::SplitShared();
+  const int nodeNorth =
+      sharedMemory ? mpi::TranslateRank(north, MPI_COMM_WORLD, nodeComm)
+                   : MPI_UNDEFINED;
+  const int nodeSouth =
+      sharedMemory ? mpi::TranslateRank(south, MPI_COMM_WORLD, nodeComm)
+                   : MPI_UNDEFINED;
+  const bool sharedNorth =
+      nodeNorth != MPI_UNDEFINED && nodeNorth != MPI_PROC_NULL;
+  const bool sharedSouth =
+      nodeSouth != MPI_UNDEFINED && nodeSouth != MPI_PROC_NULL;
+  const bool shared = sharedNorth || sharedSouth;
 
-  // Initialize grid
+  // The two time levels are addressed through tables of row pointers from -k
+  // to nRows + k. Ghost rows are private, k rows to the north followed by k
+  // rows to the south. The rank's own rows are allocated in a shared window if
+  // a neighbor is on the same node, so that the neighbor loads the edge rows
+  // in place: at the beginning of every exchange the ghost rows facing a
+  // neighbor sharing memory point straight at its edge rows. Two counters
+  // per rank in a second window synchronize this. The first counts the edge
+  // rows published, and the second the neighbors' edges consumed, so that
+  // with deeper halos a rank does not overwrite a level before its neighbors
+  // have read it
+  std::array<Grid<T>, 2> ghosts{{Grid<T>(2 * k, dim), Grid<T>(2 * k, dim)}};
+  const int stride = ghosts[0].stride();
+  const size_t levelSize = static_cast<size_t>(nRows) * stride;
+  constexpr size_t kAlignPadding = 64 / sizeof(T);
+  mpi::SharedWindow<T> window(shared ? 2 * levelSize + kAlignPadding : 0,
+                              nodeComm);
+  mpi::SharedWindow<long> counters(shared ? 2 : 0, nodeComm);
+  Grid<T> privateRows(shared ? 0 : 2 * nRows, dim);
+  T *const local = shared ? mpi::AlignUp(window.data()) : privateRows.data();
+  T *const northRows =
+      sharedNorth ? mpi::AlignUp(window.Query(nodeNorth)) : nullptr;
+  T *const southRows =
+      sharedSouth ? mpi::AlignUp(window.Query(nodeSouth)) : nullptr;
+  long *const published = shared ? counters.data() : nullptr;
+  long *const consumed = shared ? counters.data() + 1 : nullptr;
+  long const *const northCounters =
+      sharedNorth ? counters.Query(nodeNorth) : nullptr;
+  long const *const southCounters =
+      sharedSouth ? counters.Query(nodeSouth) : nullptr;
+  MPI_Comm_free(&nodeComm);
+  const int nRowsNorth = sharedNorth ? rowsOf(rank - 1) : 0;
+  const int nRowsSouth = sharedSouth ? rowsOf(rank + 1) : 0;
+  std::array<std::vector<T *>, 2> rows;
+  auto detachNeighbors = [&](const int level) {
+    for (int r = 0; r < k; ++r) {
+      rows[level][r] = ghosts[level][r];
+      rows[level][nRows + k + r] = ghosts[level][k + r];
+    }
+  };
+  auto attachNeighbors = [&](const int level) {
+    for (int r = 0; r < k; ++r) {
+      if (sharedNorth) {
+        rows[level][r] = northRows + (level * nRowsNorth + nRowsNorth - k + r) *
+                                         static_cast<size_t>(stride);
+      }
+      if (sharedSouth) {
+        rows[level][nRows + k + r] =
+            southRows + (level * nRowsSouth + r) * static_cast<size_t>(stride);
+      }
+    }
+  };
+  for (int level = 0; level < 2; ++level) {
+    rows[level].resize(nRows + 2 * k);
+    for (int i = 0; i < nRows; ++i) {
+      rows[level][k + i] = local + level * levelSize +
+                           static_cast<size_t>(i) * stride;
+    }
+    detachNeighbors(level);
+  }
+  // Counters are stored with release semantics after synchronizing the
+  // window, and loaded with acquire semantics before synchronizing it
+  auto signal = [&](long *const counter, const long value) {
+    window.Sync();
+    __atomic_store_n(counter, value, __ATOMIC_RELEASE);
+  };
+  auto waitFor = [&](const int index, const long value) {
+    for (long const *neighbor : {northCounters, southCounters}) {
+      while (neighbor != nullptr &&
+             __atomic_load_n(neighbor + index, __ATOMIC_ACQUIRE) < value) {
+        std::this_thread::yield();
+      }
+    }
+    window.Sync();
+  };
+
+  // Initialize both time levels, including the ghost rows, which start out
+  // holding the neighbors' initial values
   const int minCol = dim>>2;
   const int maxCol = dim - minCol;
   const int minRow = minCol - rowBegin;
   const int maxRow = (dim - minCol) - rowBegin;
   const int jMax = dim;
-  for (int i = -1, iMax = nRows+1; i < iMax; ++i) {
-    const bool inRow = i > minRow && i < maxRow;
-    for (int j = 0; j < jMax; ++j) {
-      grid[i+1][j] = inRow && j > minCol && j < maxCol;
+  for (int level = 0; level < 2; ++level) {
+    for (int i = -k, iMax = nRows+k; i < iMax; ++i) {
+      const bool inRow = i > minRow && i < maxRow;
+      T *row = rows[level][k + i];
+      for (int j = 0; j < jMax; ++j) {
+        row[j] = FromFloat<T>(inRow && j > minCol && j < maxCol);
+      }
     }
   }
-  Grid_t buffer(grid);
+  long epoch = 1;
+  if (shared) {
+    signal(published, epoch);
+    waitFor(0, epoch);
+  }
+  Grid_t snapshot(nRows, dim);
 
   // Run diffusion
-  std::vector<Grid_t> output(snapshots.size());
-  auto outputItr = output.begin();
+  size_t snapshotIndex = 0;
   auto snapshotItr = snapshots.cbegin();
   const auto snapshotEnd = snapshots.cend();
   const float ds = 2./dim;
   const float factor = d*dt/(ds*ds);
-  const int iMax = nRows+1;
+  const int jEnd = jMax-1;
+  // k consecutive rows are sent and received as one message to neighbors not
+  // sharing memory. Rows are described in bytes, so the same type works for
+  // every storage format
+  MPI_Datatype halo = mpi::Vector<char>(k, dim * sizeof(T), stride * sizeof(T));
+  const int northPeer = sharedNorth ? MPI_PROC_NULL : north;
+  const int southPeer = sharedSouth ? MPI_PROC_NULL : south;
+  std::array<MPI_Request, 4> requests;
+  int level = 0;
+  auto diffuseRows = [&](const int begin, const int end) {
+    T *const *const from = rows[level].data() + k;
+    T *const *const to = rows[level ^ 1].data() + k;
+    for (int i = begin; i < end; ++i) {
+      DiffuseRow(factor, from[i - 1], from[i], from[i + 1], to[i], 1, jEnd);
+    }
+  };
+  auto startExchange = [&]() {
+    if (shared) {
+      signal(published, epoch + 1);
+    }
+    T *const *const next = rows[level ^ 1].data();
+    MPI_Irecv(next[0], 1, halo, northPeer, 0, MPI_COMM_WORLD, &requests[0]);
+    MPI_Irecv(next[nRows + k], 1, halo, southPeer, 0, MPI_COMM_WORLD,
+              &requests[1]);
+    MPI_Isend(next[k], 1, halo, northPeer, 0, MPI_COMM_WORLD, &requests[2]);
+    MPI_Isend(next[nRows], 1, halo, southPeer, 0, MPI_COMM_WORLD,
+              &requests[3]);
+  };
   float t = 0;
   while (true) {
     if (t >= *snapshotItr) {
-      *outputItr++ = grid;
+      HPCSE_TRACE_SCOPE("snapshot");
+      for (int i = 0; i < nRows; ++i) {
+        ConvertRow(rows[level][k + i], snapshot[i], dim);
+      }
+      sink(snapshotIndex++, t, snapshot);
       if (++snapshotItr == snapshotEnd) break; 
     }
-    for (int i = 1; i < iMax; ++i) {
-      for (int j = 1; j < jMax; ++j) {
-        buffer[i][j] =
-            grid[i][j] +
-            factor * (grid[i - 1][j] + grid[i][j - 1] - 4 * grid[i][j] +
-                      grid[i][j + 1] + grid[i + 1][j]);
+    // Advance time exactly as a step-by-step loop would, stopping at the next
+    // snapshot or when the halo is used up
+    int nSteps = 0;
+    do {
+      t += dt;
+      ++nSteps;
+    } while (t < *snapshotItr && nSteps < k);
+    // Only the first step reads the neighbors' edges
+    attachNeighbors(level);
+    // Until the last step, also advance the part of the halo that is still
+    // valid, which shrinks by one row per step
+    for (int s = 0; s < nSteps - 1; ++s) {
+      {
+        HPCSE_TRACE_SCOPE("halo compute");
+        diffuseRows(-(k - 1 - s) * extendNorth,
+                    nRows + (k - 1 - s) * extendSouth);
       }
+      if (s == 0) {
+        // The next step overwrites the level just read by the neighbors
+        detachNeighbors(level);
+        if (shared) {
+          HPCSE_TRACE_SCOPE("halo wait");
+          signal(consumed, epoch);
+          waitFor(1, epoch);
+        }
+      }
+      level ^= 1;
     }
-    MPI_Request northSend, southSend;
-    if (rank != 0) {
-      assert(MPI_Isend(buffer[1].data(), dim, MPI_FLOAT, rank - 1, 0,
-                       MPI_COMM_WORLD, &northSend) == MPI_SUCCESS);
-    } 
-    if (rank != nRanks-1) {
-      assert(MPI_Isend(buffer[nRows].data(), dim, MPI_FLOAT, rank + 1, 0,
-                       MPI_COMM_WORLD, &southSend) == MPI_SUCCESS);
-    }
-    if (rank != 0) {
-      MPI_Status northReceive;
-      assert(MPI_Recv(buffer[0].data(), dim, MPI_FLOAT, rank - 1, 0,
-                      MPI_COMM_WORLD, &northReceive) == MPI_SUCCESS);
-    }
-    if (rank != nRanks-1) {
-      MPI_Status southReceive;
-      assert(MPI_Recv(buffer[nRows].data(), dim, MPI_FLOAT, rank + 1, 0,
-                      MPI_COMM_WORLD, &southReceive) == MPI_SUCCESS);
-    }
-    if (rank != 0) {
-      MPI_Status northStatus;
-      assert(MPI_Wait(&northSend, &northStatus) == MPI_SUCCESS);
+    // The last step only computes the local rows, and refreshes the halo
+    if (overlap) {
+      // Compute the edge rows first, so they are in flight while computing
+      // the interior
+      {
+        HPCSE_TRACE_SCOPE("edge compute");
+        diffuseRows(0, std::min(k, nRows));
+        diffuseRows(std::max(k, nRows - k), nRows);
+        startExchange();
+      }
+      HPCSE_TRACE_SCOPE("bulk compute");
+      diffuseRows(k, nRows - k);
+    } else {
+      HPCSE_TRACE_SCOPE("bulk compute");
+      diffuseRows(0, nRows);
+      startExchange();
     }
-    if (rank != nRanks-1) {
-      MPI_Status southStatus;
-      assert(MPI_Wait(&southSend, &southStatus) == MPI_SUCCESS);
+    {
+      HPCSE_TRACE_SCOPE("halo wait");
+      MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+      if (shared) {
+        waitFor(0, epoch + 1);
+      }
     }
-    grid.swap(buffer);
-    t += dt;
+    detachNeighbors(level);
+    level ^= 1;
+    ++epoch;
   }
+  MPI_Type_free(&halo);
+}
+
+} // End anonymous namespace
+
+void DiffusionRows(const unsigned dim, const float d, const float dt,
+                   std::vector<float> const &snapshots,
+                   SnapshotSink_t const &sink, const bool overlap,
+                   const unsigned ghostWidth, const bool sharedMemory) {
+  switch (DiffusionStorage()) {
+    case StorageFormat::float16:
+      DiffusionRowsImpl<Half>(dim, d, dt, snapshots, sink, overlap,
+                              ghostWidth, sharedMemory);
+      break;
+    case StorageFormat::bfloat16:
+      DiffusionRowsImpl<BFloat16>(dim, d, dt, snapshots, sink, overlap,
+                                  ghostWidth, sharedMemory);
+      break;
+    default:
+      DiffusionRowsImpl<float>(dim, d, dt, snapshots, sink, overlap,
+                               ghostWidth, sharedMemory);
+  }
+}
+
+std::vector<Grid_t> DiffusionRows(const unsigned dim, const float d,
+                                  const float dt,
+                                  std::vector<float> const &snapshots) {
+  std::vector<Grid_t> output;
+  DiffusionRows(dim, d, dt, snapshots, CollectSnapshots(output));
   return output;
 }
 
@@ -1,64 +1,287 @@
 /// \author Johannes de Fine Licht (definelj@student.ethz.ch)
 /// \date October 2015
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
 #include "diffusion/Diffusion.h"
+#include "diffusion/DiffusionKernel.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace hpcse {
 
-Grid_t InitializeGrid(const unsigned dim);
+namespace {
 
-void Diffuse(const float factor, Grid_t const &grid, Grid_t &buffer);
+// Approximate amount of cache targeted by a band of rows in the temporally
+// blocked solver, counting both frame buffers.
+constexpr int kBandCacheBytes = 1 << 19;
 
-std::vector<Grid_t> DiffusionSequential(unsigned dim, const float d,
-                                        const float dt,
-                                        std::vector<float> const &snapshots) {
-  auto grid = InitializeGrid(dim);
-  std::vector<Grid_t> output(
-      snapshots.size(), Grid_t(grid.size(), Grid_t::value_type(grid.size())));
+/// Size of the OpenMP team for nThreads, where 0 selects the default team.
+int TeamSize(const unsigned nThreads) {
+#ifdef _OPENMP
+  return nThreads > 0 ? nThreads : omp_get_max_threads();
+#else
+  (void)nThreads;
+  return 1;
+#endif
+}
+
+} // End anonymous namespace
+
+void PinThreads(int nThreads);
+
+template <typename T>
+Grid<T> InitializeGrid(int nThreads, const unsigned dim);
+
+template <typename T>
+Grid<T> AllocateBuffer(int nThreads, Grid<T> const &grid);
+
+template <typename T>
+void Diffuse(int nThreads, const float factor, Grid<T> const &grid,
+             Grid<T> &buffer);
+
+template <typename T>
+void DiffuseBlocked(int nThreads, float factor, Grid<T> &grid,
+                    Grid<T> &buffer, int nSteps, int bandRows);
+
+/// Grid cells are stored as T, and converted to single precision for the sink.
+template <typename T>
+void DiffusionSequential(const unsigned nThreads, unsigned dim, const float d,
+                         const float dt, std::vector<float> const &snapshots,
+                         const unsigned timeBlock,
+                         SnapshotSink_t const &sink) {
+  const int team = TeamSize(nThreads);
+  PinThreads(team);
+  auto grid = InitializeGrid<T>(team, dim);
   float t = 0;
   float ds = 2./dim;
   const float factor = d*dt/(ds*ds);
   auto snapshotItr = snapshots.cbegin();
   auto snapshotEnd = snapshots.cend();
-  auto outputItr = output.begin();
+  size_t snapshotIndex = 0;
   // Frame buffer to be swapped between iterations
-  Grid_t buffer(grid);
-  while (true) {
-    if (t >= *snapshotItr) {
-      *outputItr++ = grid;
-      if (++snapshotItr == snapshotEnd) break; 
+  Grid<T> buffer = AllocateBuffer(team, grid);
+  Grid_t snapshot;
+  // Checkpoints are taken at the top of the loop, before the snapshot check,
+  // so a resumed run continues exactly where the checkpointed run left off
+  Checkpointing const &checkpointing = DiffusionCheckpointing();
+  std::unique_ptr<CheckpointStore> checkpoints;
+  long step = 0;
+  long nextCheckpoint = checkpointing.interval;
+  const StorageFormat format = StorageFormatOf<T>::value;
+  if (!checkpointing.path.empty()) {
+    checkpoints.reset(new CheckpointStore(checkpointing.path));
+    if (checkpointing.resume && checkpoints->Load(checkpoints->Latest())) {
+      CheckpointState &state = checkpoints->state();
+      state.Expect(dim, "grid dimension");
+      state.Expect(d, "diffusion constant");
+      state.Expect(dt, "timestep");
+      state.Expect(format, "storage format");
+      state.Expect(snapshots.size(), "number of snapshots");
+      state.Expect(snapshots.data(), snapshots.size(), "snapshot times");
+      t = state.Get<float>();
+      snapshotIndex = state.Get<size_t>();
+      step = state.Get<long>();
+      state.Get(grid.data(), grid.capacity());
+      state.Get(buffer.data(), buffer.capacity());
+      snapshotItr += snapshotIndex;
+      nextCheckpoint = step + checkpointing.interval;
+    } else {
+      checkpoints->Remove();
     }
-    Diffuse(factor, grid, buffer);
-    grid.swap(buffer);
-    t += dt;
   }
-  return output;
+  // Skipped while the previous checkpoint is still being written, and retried
+  // at the next iteration
+  auto checkpoint = [&]() {
+    if (checkpoints == nullptr || checkpointing.interval == 0 ||
+        step < nextCheckpoint || !checkpoints->Idle()) {
+      return;
+    }
+    CheckpointState &state = checkpoints->Prepare();
+    state.Put(dim);
+    state.Put(d);
+    state.Put(dt);
+    state.Put(format);
+    state.Put(snapshots.size());
+    state.Put(snapshots.data(), snapshots.size());
+    state.Put(t);
+    state.Put(snapshotIndex);
+    state.Put(step);
+    state.Put(grid.data(), grid.capacity());
+    state.Put(buffer.data(), buffer.capacity());
+    checkpoints->Commit(step);
+    nextCheckpoint = step + checkpointing.interval;
+  };
+  if (timeBlock <= 1) {
+    while (true) {
+      checkpoint();
+      if (t >= *snapshotItr) {
+        sink(snapshotIndex++, t, AsFloat(grid, snapshot));
+        if (++snapshotItr == snapshotEnd) break; 
+      }
+      Diffuse(team, factor, grid, buffer);
+      grid.swap(buffer);
+      t += dt;
+      ++step;
+    }
+  } else {
+    const int bandRows =
+        std::max<int>(2, kBandCacheBytes / (2 * sizeof(T) * dim) -
+                             static_cast<int>(timeBlock));
+    while (true) {
+      checkpoint();
+      if (t >= *snapshotItr) {
+        sink(snapshotIndex++, t, AsFloat(grid, snapshot));
+        if (++snapshotItr == snapshotEnd) break; 
+      }
+      // Advance time exactly as the unblocked loop would, stopping at the
+      // next snapshot or when the time block is full
+      int nSteps = 0;
+      do {
+        t += dt;
+        ++nSteps;
+      } while (t < *snapshotItr && nSteps < static_cast<int>(timeBlock));
+      DiffuseBlocked(team, factor, grid, buffer, nSteps, bandRows);
+      step += nSteps;
+    }
+  }
+}
+
+void DiffusionSequential(const unsigned nThreads, unsigned dim, const float d,
+                         const float dt, std::vector<float> const &snapshots,
+                         const unsigned timeBlock,
+                         SnapshotSink_t const &sink) {
+  switch (DiffusionStorage()) {
+    case StorageFormat::float16:
+      DiffusionSequential<Half>(nThreads, dim, d, dt, snapshots, timeBlock,
+                                sink);
+      break;
+    case StorageFormat::bfloat16:
+      DiffusionSequential<BFloat16>(nThreads, dim, d, dt, snapshots,
+                                    timeBlock, sink);
+      break;
+    default:
+      DiffusionSequential<float>(nThreads, dim, d, dt, snapshots, timeBlock,
+                                 sink);
+  }
 }
 
-Grid_t InitializeGrid(const unsigned dim) {
-  Grid_t grid(dim, Grid_t::value_type(dim));
-  const unsigned begin = dim>>2;
-  const unsigned end = dim - begin;
-  #pragma omp parallel for
-  for (unsigned i = begin; i < end; ++i) {
-    for (unsigned j = begin; j < end; ++j) {
-      grid[i][j] = 1;
+void PinThreads(const int nThreads) {
+  ThreadAffinity const &affinity = DiffusionAffinity();
+  if (affinity.policy() == ThreadAffinity::Policy::none) {
+    return;
+  }
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(nThreads)
+  affinity.Pin(omp_get_thread_num());
+#else
+  (void)nThreads;
+  affinity.Pin(0);
+#endif
+}
+
+/// Rows are first touched with the same static schedule used by Diffuse, so
+/// each thread's rows are placed on its own NUMA node.
+template <typename T>
+Grid<T> InitializeGrid(const int nThreads, const unsigned dim) {
+  Grid<T> grid = Grid<T>::Allocate(dim, dim);
+  const int begin = dim>>2;
+  const int end = dim - begin;
+  const int iEnd = dim - 1;
+  auto initializeRow = [&grid, begin, end](const int i) {
+    grid.FillRows(i, i + 1, FromFloat<T>(0));
+    if (i >= begin && i < end) {
+      std::fill(grid[i] + begin, grid[i] + end, FromFloat<T>(1));
     }
+  };
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i < iEnd; ++i) {
+    initializeRow(i);
+  }
+  initializeRow(0);
+  if (iEnd > 0) {
+    initializeRow(iEnd);
   }
   return grid;
 }
 
-void Diffuse(const float factor, Grid_t const &grid, Grid_t &buffer) {
-  const int iEnd = grid.size()-1;
-  #pragma omp parallel for
+template <typename T>
+Grid<T> AllocateBuffer(const int nThreads, Grid<T> const &grid) {
+  Grid<T> buffer = Grid<T>::Allocate(grid.rows(), grid.cols());
+  const int iEnd = grid.rows() - 1;
+  auto copyRow = [&grid, &buffer](const int i) {
+    buffer.FillRows(i, i + 1, FromFloat<T>(0));
+    std::copy(grid[i], grid[i] + grid.cols(), buffer[i]);
+  };
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int i = 1; i < iEnd; ++i) {
+    copyRow(i);
+  }
+  copyRow(0);
+  if (iEnd > 0) {
+    copyRow(iEnd);
+  }
+  return buffer;
+}
+
+template <typename T>
+void Diffuse(const int nThreads, const float factor, Grid<T> const &grid,
+             Grid<T> &buffer) {
+  const int iEnd = grid.rows()-1;
+  const int jEnd = grid.cols()-1;
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
   for (int i = 1; i < iEnd; ++i) {
-    for (int j = 1; j < iEnd; ++j) {
-      buffer[i][j] =
-          grid[i][j] +
-          factor * (grid[i - 1][j] + grid[i][j - 1] - 4 * grid[i][j] +
-                    grid[i][j + 1] + grid[i + 1][j]);
+    DiffuseRow(factor, grid[i - 1], grid[i], grid[i + 1], buffer[i], 1, jEnd);
+  }
+}
+
+/// Advances the grid nSteps timesteps using skewed temporal blocking. The
+/// interior rows are split into bands of bandRows rows, and each band is
+/// advanced all nSteps steps before moving on to the next, with the band
+/// shifted up by one row per step so that every row it reads has already
+/// been computed at the previous step. Bands are processed in a pipeline:
+/// band b may compute step s as soon as band b - 1 has completed it. Each
+/// element is computed exactly as in Diffuse, so results are identical, except
+/// for the random bits of stochastic rounding with 16-bit storage.
+template <typename T>
+void DiffuseBlocked(const int nThreads, const float factor, Grid<T> &grid,
+                    Grid<T> &buffer, const int nSteps, const int bandRows) {
+  const int iEnd = grid.rows()-1;
+  const int jEnd = grid.cols()-1;
+  const int nBands = std::max(1, (iEnd - 1) / bandRows);
+  Grid<T> *levels[2] = {&grid, &buffer};
+  std::unique_ptr<std::atomic<int>[]> progress(new std::atomic<int>[nBands]);
+  for (int b = 0; b < nBands; ++b) {
+    progress[b].store(0, std::memory_order_relaxed);
+  }
+  #pragma omp parallel for schedule(static, 1) num_threads(nThreads)
+  for (int b = 0; b < nBands; ++b) {
+    const int bandBegin = 1 + b * bandRows;
+    const bool lastBand = b == nBands - 1;
+    for (int s = 0; s < nSteps; ++s) {
+      if (b > 0) {
+        while (progress[b - 1].load(std::memory_order_acquire) <= s) {
+          std::this_thread::yield();
+        }
+      }
+      Grid<T> const &source = *levels[s & 1];
+      Grid<T> &target = *levels[(s + 1) & 1];
+      const int iBegin = std::max(1, bandBegin - s);
+      const int iStop =
+          lastBand ? iEnd : std::max(1, bandBegin + bandRows - s);
+      for (int i = iBegin; i < iStop; ++i) {
+        DiffuseRow(factor, source[i - 1], source[i], source[i + 1], target[i],
+                   1, jEnd);
+      }
+      progress[b].store(s + 1, std::memory_order_release);
     }
   }
+  if (nSteps & 1) {
+    grid.swap(buffer);
+  }
 }
 
 } // End namespace hpcse
@@ -0,0 +1,122 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date November 2015
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "common/Fft.h"
+#include "diffusion/Diffusion.h"
+
+namespace hpcse {
+
+namespace {
+
+/// Side of the square blocks in which matrices are transposed.
+constexpr int kTransposeBlock = 32;
+
+using Matrix_t = std::vector<double>;
+
+/// Applies the sine transform to every row of the n x n matrix, two rows at a
+/// time.
+void TransformRows(SineTransform const &transform, Matrix_t &matrix,
+                   const unsigned nThreads) {
+  const int n = transform.size();
+  #pragma omp parallel num_threads(nThreads)
+  {
+    Fft::Workspace workspace;
+    std::vector<double> zeros(n);
+    #pragma omp for schedule(static)
+    for (int i = 0; i < n; i += 2) {
+      // An odd last row is transformed alongside zeros
+      double *second = i + 1 < n ? &matrix[(i + 1) * n] : zeros.data();
+      transform.Transform(&matrix[i * n], second, workspace);
+    }
+  }
+}
+
+void Transpose(Matrix_t const &input, Matrix_t &output, const int n,
+               const unsigned nThreads) {
+  #pragma omp parallel for schedule(static) num_threads(nThreads)
+  for (int iBlock = 0; iBlock < n; iBlock += kTransposeBlock) {
+    const int iEnd = std::min(iBlock + kTransposeBlock, n);
+    for (int jBlock = 0; jBlock < n; jBlock += kTransposeBlock) {
+      const int jEnd = std::min(jBlock + kTransposeBlock, n);
+      for (int i = iBlock; i < iEnd; ++i) {
+        for (int j = jBlock; j < jEnd; ++j) {
+          output[j * n + i] = input[i * n + j];
+        }
+      }
+    }
+  }
+}
+
+} // End anonymous namespace
+
+void DiffusionSpectral(unsigned nThreads, unsigned dim, const float d,
+                       std::vector<float> const &snapshots,
+                       SnapshotSink_t const &sink) {
+  nThreads = std::max(1u, nThreads);
+  // Interior cells, surrounded by the boundary held at zero
+  const int n = dim > 2 ? dim - 2 : 0;
+  const double ds = 2./dim;
+  const SineTransform transform(n);
+  const int begin = dim>>2;
+  const int end = dim - begin;
+  Matrix_t matrix(n * n, 0);
+  Matrix_t transposed(n * n);
+  for (int i = std::max(begin, 1); i < std::min(end, n + 1); ++i) {
+    for (int j = std::max(begin, 1); j < std::min(end, n + 1); ++j) {
+      matrix[(i - 1) * n + (j - 1)] = 1;
+    }
+  }
+  // Coefficients of the modes, stored transposed. Each transform is scaled by
+  // 2 / (n + 1), so that applying it again recovers the cells
+  TransformRows(transform, matrix, nThreads);
+  Transpose(matrix, transposed, n, nThreads);
+  TransformRows(transform, transposed, nThreads);
+  const double scale = 4. / ((n + 1) * (n + 1));
+  Matrix_t coefficients(transposed.size());
+  std::transform(transposed.cbegin(), transposed.cend(), coefficients.begin(),
+                 [scale](const double c) { return scale * c; });
+  // Eigenvalues of the second difference operator for each mode k = 1..n,
+  // so that the result is the solution of the same discretization the
+  // stepping solvers integrate
+  const double pi = std::acos(-1.);
+  std::vector<double> eigenvalues(n);
+  for (int k = 0; k < n; ++k) {
+    const double s = std::sin(pi * (k + 1) / (2 * (n + 1)));
+    eigenvalues[k] = 4 * s * s / (ds * ds);
+  }
+  std::vector<double> decay(n);
+  Grid_t grid(dim, dim);
+  for (size_t s = 0; s < snapshots.size(); ++s) {
+    const float t = snapshots[s];
+    for (int k = 0; k < n; ++k) {
+      decay[k] = std::exp(-d * t * eigenvalues[k]);
+    }
+    #pragma omp parallel for schedule(static) num_threads(nThreads)
+    for (int k = 0; k < n; ++k) {
+      for (int l = 0; l < n; ++l) {
+        transposed[k * n + l] = coefficients[k * n + l] * decay[k] * decay[l];
+      }
+    }
+    TransformRows(transform, transposed, nThreads);
+    Transpose(transposed, matrix, n, nThreads);
+    TransformRows(transform, matrix, nThreads);
+    #pragma omp parallel for schedule(static) num_threads(nThreads)
+    for (int i = 0; i < n; ++i) {
+      std::copy(&matrix[i * n], &matrix[i * n] + n, grid[i + 1] + 1);
+    }
+    sink(s, t, grid);
+  }
+}
+
+std::vector<Grid_t> DiffusionSpectral(unsigned nThreads, unsigned dim,
+                                      float d,
+                                      std::vector<float> const &snapshots) {
+  std::vector<Grid_t> output;
+  DiffusionSpectral(nThreads, dim, d, snapshots, CollectSnapshots(output));
+  return output;
+}
+
+} // End namespace hpcse
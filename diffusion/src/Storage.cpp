@@ -0,0 +1,66 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date November 2015
+
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include "diffusion/Storage.h"
+
+namespace hpcse {
+
+StorageError CompareGrids(Grid<float> const &reference,
+                          Grid<float> const &grid) {
+  assert(reference.rows() == grid.rows() && reference.cols() == grid.cols());
+  StorageError error{0, 0, 0};
+  double maxMagnitude = 0;
+  for (int i = 0; i < grid.rows(); ++i) {
+    for (int j = 0; j < grid.cols(); ++j) {
+      const double deviation = std::abs(grid[i][j] - reference[i][j]);
+      error.maxAbsolute = std::max(error.maxAbsolute, deviation);
+      error.rms += deviation * deviation;
+      maxMagnitude = std::max<double>(maxMagnitude, std::abs(reference[i][j]));
+    }
+  }
+  const double nCells = static_cast<double>(grid.rows()) * grid.cols();
+  if (nCells > 0) {
+    error.rms = std::sqrt(error.rms / nCells);
+  }
+  if (maxMagnitude > 0) {
+    error.maxRelative = error.maxAbsolute / maxMagnitude;
+  }
+  return error;
+}
+
+char const *StorageFormatName(const StorageFormat format) {
+  switch (format) {
+    case StorageFormat::float16:
+      return "float16";
+    case StorageFormat::bfloat16:
+      return "bfloat16";
+    default:
+      return "float32";
+  }
+}
+
+double UnitRoundoff(const StorageFormat format) {
+  switch (format) {
+    case StorageFormat::float16:
+      return std::ldexp(1., -11);
+    case StorageFormat::bfloat16:
+      return std::ldexp(1., -8);
+    default:
+      return std::ldexp(1., -24);
+  }
+}
+
+StorageFormat ParseStorageFormat(std::string const &name) {
+  for (auto format : {StorageFormat::float32, StorageFormat::float16,
+                      StorageFormat::bfloat16}) {
+    if (name == StorageFormatName(format)) {
+      return format;
+    }
+  }
+  throw std::invalid_argument("Unknown storage format \"" + name + "\".");
+}
+
+} // End namespace hpcse
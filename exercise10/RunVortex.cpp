@@ -4,14 +4,40 @@
 #include <vector>
 #include "common/Mpi.h"
 #include "common/Timer.h"
+#include "snapshot/SnapshotFile.h"
 #include "vortex/Vortex.h"
 
 using namespace hpcse;
 
 int main(int argc, char *argv[]) {
+  // Snapshots are written to snapshots.snp unless --csv is passed, in which
+  // case the text format is written to snapshots.txt
+  bool csv = false;
+  Checkpointing checkpointing;
+  std::string tracePath;
+  for (; argc > 1 && std::string(argv[1]).compare(0, 2, "--") == 0;
+       --argc, ++argv) {
+    const std::string flag(argv[1]);
+    if (flag == "--csv") {
+      csv = true;
+    } else if (flag.compare(0, 13, "--checkpoint=") == 0) {
+      checkpointing.path = flag.substr(13);
+    } else if (flag.compare(0, 22, "--checkpoint-interval=") == 0) {
+      checkpointing.interval = std::stoi(flag.substr(22));
+    } else if (flag == "--resume") {
+      checkpointing.resume = true;
+    } else if (flag.compare(0, 8, "--trace=") == 0) {
+      tracePath = flag.substr(8);
+    } else {
+      argc = 0;
+      break;
+    }
+  }
   if (argc < 4) {
-    std::cerr
-        << "Usage: <number of vortices> <timestep> <times to record>...\n";
+    std::cerr << "Usage: [--csv] [--checkpoint=<path> "
+                 "[--checkpoint-interval=<steps>] [--resume]] "
+                 "[--trace=<Chrome trace file>] <number of vortices> "
+                 "<timestep> <times to record>...\n";
     return 1;
   }
   mpi::Context context;
@@ -22,28 +48,47 @@ int main(int argc, char *argv[]) {
     timeToRecord.emplace_back(std::stof(argv[i]));
   }
   const int nIterations = timeToRecord.back() / timestep + 1;
+  if (!tracePath.empty()) {
+    if (!kTraceCompiled && mpi::rank() == 0) {
+      std::cerr << "Warning: built without HPCSE_TRACE, so the trace will be "
+                   "empty." << std::endl;
+    }
+    Tracer::Get().Enable();
+  }
   Timer timer;
   if (mpi::rank() == 0) {
     std::cout << "Running " << nParticles << " particles for " << nIterations
               << " iterations..." << std::flush;
   }
   timer.Start();
-  auto snapshots = Vortex(nParticles, 1, timestep, timeToRecord);
+  auto snapshots =
+      Vortex(nParticles, 1, timestep, timeToRecord, checkpointing);
   double elapsed = timer.Stop();
+  if (!tracePath.empty()) {
+    mpi::WriteTrace(tracePath);
+  }
   if (mpi::rank() == 0) {
     std::ofstream benchmarkFile("benchmarks.txt",
                                 std::ofstream::out | std::ofstream::app);
     benchmarkFile << mpi::size() << "," << nParticles << "," << nIterations
                   << "," << elapsed << "\n";
     std::cout << " Finished in " << elapsed << " seconds.\n";
-    std::ofstream snapshotFile("snapshots.txt",
-                               std::ofstream::out | std::ofstream::trunc);
-    for (size_t i = 0; i < snapshots.size(); ++i) {
-      snapshotFile << timeToRecord[i];
-      for (auto &j : snapshots[i]) {
-        snapshotFile << "," << j;
+    if (csv) {
+      std::ofstream snapshotFile("snapshots.txt",
+                                 std::ofstream::out | std::ofstream::trunc);
+      for (size_t i = 0; i < snapshots.size(); ++i) {
+        snapshotFile << timeToRecord[i];
+        for (auto &j : snapshots[i]) {
+          snapshotFile << "," << j;
+        }
+        snapshotFile << "\n";
+      }
+    } else {
+      SnapshotWriter writer("snapshots.snp", SnapshotType::float64, 1,
+                            nParticles, timestep, timeToRecord);
+      for (size_t i = 0; i < snapshots.size(); ++i) {
+        writer.Write(i, timeToRecord[i], snapshots[i].data());
       }
-      snapshotFile << "\n";
     }
   }
   return 0;
@@ -1,14 +1,18 @@
 import matplotlib.pyplot as plt
 import numpy as np
+import os
 import sys
 
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                os.pardir, "snapshot"))
+from snapshotfile import read_snapshots
+
 if len(sys.argv) < 2:
   print("Usage: <path to input file>")
   sys.exit(1)
 
-data = np.loadtxt(sys.argv[1], delimiter=",")
-time = data[:, 0]
-data = data[:, 1:]
+time, data = read_snapshots(sys.argv[1], time_column=True)
+data = data[:, 0, :]
 nSnapshots = data.shape[0]
 nParticles = data.shape[1]
 y = np.zeros(nParticles)
@@ -1,8 +1,10 @@
 /// \author Johannes de Fine Licht (definelj@student.ethz.ch)
 /// \date October 2015
 
+#include "common/Timer.h"
 #include "diffusion/Barrier.h"
 
+#include <algorithm>
 #include <iostream>
 #include <thread>
 #include <vector>
@@ -45,11 +47,36 @@ void NoRace() {
   }
 }
 
+/// Time per synchronization with the given number of threads and spin count.
+double TimeBarrier(const int nThreads, const int spinCount) {
+  constexpr int kIterations = 100000;
+  Barrier barrier(nThreads, spinCount);
+  Timer timer;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nThreads; ++i) {
+    threads.emplace_back([&barrier]() {
+      for (int j = 0; j < kIterations; ++j) {
+        barrier.Synchronize();
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  return timer.Stop() / kIterations;
+}
+
 int main() {
   std::cout << "Running without barrier:\n";
   Race();
   std::cout << "\nRunning with barrier:\n";
   NoRace();
   std::cout << "\n";
+  const int nThreads = std::max(2u, std::thread::hardware_concurrency());
+  std::cout << "Time per synchronization with " << nThreads
+            << " threads:\n  blocking: " << 1e6 * TimeBarrier(nThreads, 0)
+            << " us\n  spinning: "
+            << 1e6 * TimeBarrier(nThreads, Barrier::kDefaultSpinCount)
+            << " us\n";
   return 0;
 }
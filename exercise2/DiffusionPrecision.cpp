@@ -0,0 +1,63 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date November 2015
+
+#include "common/Timer.h"
+#include "diffusion/Diffusion.h"
+#include "diffusion/Storage.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace hpcse;
+
+/// Runs the solver with every storage format and reports the deviation of each
+/// snapshot from the single precision reference, along with the runtime.
+int main(int argc, char const *argv[]) {
+  if (argc < 6) {
+    std::cerr << "Usage: <cores> <diffusion constant> <grid dimension> "
+                 "<timestep> <time for snapshot...>"
+              << std::endl;
+    return 1;
+  }
+  unsigned nCores = std::stoi(argv[1]);
+  float d = std::stof(argv[2]);
+  unsigned dim = std::stoi(argv[3]);
+  float dt = std::stof(argv[4]);
+  std::vector<float> snapshots;
+  for (int i = 5; i < argc; ++i) {
+    snapshots.push_back(std::stof(argv[i]));
+  }
+  std::sort(snapshots.begin(), snapshots.end());
+
+  std::vector<Grid_t> reference;
+  Timer timer;
+  for (auto format : {StorageFormat::float32, StorageFormat::float16,
+                      StorageFormat::bfloat16}) {
+    SetDiffusionStorage(format);
+    std::vector<StorageError> errors;
+    double elapsedComparing = 0;
+    Timer compareTimer;
+    auto compare = [&](size_t index, float, Grid_t const &grid) {
+      compareTimer.Start();
+      if (format == StorageFormat::float32) {
+        reference.emplace_back(grid);
+      } else {
+        errors.emplace_back(CompareGrids(reference[index], grid));
+      }
+      elapsedComparing += compareTimer.Stop();
+    };
+    timer.Start();
+    Diffusion(nCores, dim, d, dt, snapshots, compare);
+    const double elapsed = timer.Stop() - elapsedComparing;
+    std::cout << StorageFormatName(format) << ": " << elapsed << " seconds\n";
+    for (size_t i = 0; i < errors.size(); ++i) {
+      std::cout << "  t = " << snapshots[i]
+                << ": max error " << errors[i].maxAbsolute << " ("
+                << 100 * errors[i].maxRelative << "%), rms error "
+                << errors[i].rms << "\n";
+    }
+  }
+  return 0;
+}
@@ -1,24 +1,61 @@
 /// \author Johannes de Fine Licht (definelj@student.ethz.ch)
 /// \date October 2015
 
+#include "common/Timer.h"
 #include "diffusion/Diffusion.h"
+#include "diffusion/DiffusionKernel.h"
+#include "snapshot/SnapshotFile.h"
 
 #include <algorithm> // std::sort
 #include <cassert>
 #include <chrono>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
-#include <iterator>
+#include <memory>
 #include <string>    // std::stoi, std::stof
 #include <vector>
 
 using namespace hpcse;
 
 int main(int argc, char const *argv[]) {
+  // The explicit solvers are used unless one of the implicit solvers, which are
+  // stable for any timestep, or the spectral solver, which ignores the
+  // timestep, is requested
+  enum class Solver { explicitEuler, adi, multigrid, spectral };
+  Solver solver = Solver::explicitEuler;
+  // Steps the explicit solver advances each band of rows while it is in cache,
+  // where 1 disables temporal blocking
+  unsigned timeBlock = 1;
+  Checkpointing checkpointing;
+  for (; argc > 1 && std::string(argv[1]).compare(0, 2, "--") == 0;
+       --argc, ++argv) {
+    const std::string flag(argv[1]);
+    if (flag == "--implicit") {
+      solver = Solver::adi;
+    } else if (flag == "--multigrid") {
+      solver = Solver::multigrid;
+    } else if (flag == "--spectral") {
+      solver = Solver::spectral;
+    } else if (flag.compare(0, 13, "--time-block=") == 0) {
+      timeBlock = std::stoi(flag.substr(13));
+    } else if (flag.compare(0, 13, "--checkpoint=") == 0) {
+      checkpointing.path = flag.substr(13);
+    } else if (flag.compare(0, 22, "--checkpoint-interval=") == 0) {
+      checkpointing.interval = std::stoi(flag.substr(22));
+    } else if (flag == "--resume") {
+      checkpointing.resume = true;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
   if (argc < 7) {
-    std::cerr << "Usage: <cores> <diffusion constant> <grid dimension> "
-                 "<timestep> <output file> <time for "
-                 "snapshot...>"
+    std::cerr << "Usage: [--implicit|--multigrid|--spectral|"
+                 "--time-block=<steps>] "
+                 "[--checkpoint=<path> [--checkpoint-interval=<steps>] "
+                 "[--resume]] <cores> <diffusion constant> <grid dimension> "
+                 "<timestep> <output file> <time for snapshot...>"
               << std::endl;
     return 1;
   }
@@ -26,31 +63,121 @@ int main(int argc, char const *argv[]) {
   float d = std::stof(argv[2]);
   unsigned dim = std::stoi(argv[3]);
   float dt = std::stof(argv[4]);
-  std::ofstream outputStream(argv[5]);
-  assert(outputStream.is_open());
+  const std::string outPath(argv[5]);
   std::vector<float> snapshots;
   for (int i = 6; i < argc; ++i) {
     snapshots.push_back(std::stof(argv[i]));
   }
   std::sort(snapshots.begin(), snapshots.end());
+  if (timeBlock < 1) {
+    std::cerr << "The time block must be at least one step." << std::endl;
+    return 1;
+  }
+  // Only the sequential and temporally blocked solvers are checkpointed
+  if (!checkpointing.path.empty() &&
+      (solver != Solver::explicitEuler || (nCores > 1 && timeBlock == 1))) {
+    std::cerr << "Checkpointing requires the explicit solver on a single core "
+                 "or with temporal blocking."
+              << std::endl;
+    return 1;
+  }
+  SetDiffusionCheckpointing(checkpointing);
+  // Thread placement is read from the environment: none, compact, scatter or a
+  // CPU list such as 0-3,8
+  if (char const *affinity = std::getenv("HPCSE_AFFINITY")) {
+    SetDiffusionAffinity(ThreadAffinity::Parse(affinity));
+  }
+  // Grid storage is likewise read from the environment: float32, float16 or
+  // bfloat16
+  if (char const *storage = std::getenv("HPCSE_STORAGE")) {
+    SetDiffusionStorage(ParseStorageFormat(storage));
+  }
+  // A step changes values of order one by about d * dt, which 16-bit storage
+  // only resolves on average
+  const StorageFormat storage = DiffusionStorage();
+  if (solver == Solver::explicitEuler && storage != StorageFormat::float32 &&
+      d * dt < UnitRoundoff(storage)) {
+    std::cerr << "Warning: updates of about " << d * dt
+              << " per step are below the rounding error of "
+              << StorageFormatName(storage) << " storage ("
+              << UnitRoundoff(storage)
+              << ") and only take effect through stochastic rounding. Expect "
+                 "deviations from float32 of a few tenths of a percent with "
+                 "float16 and about one percent with bfloat16." << std::endl;
+  }
   std::cout << "Running on " << nCores << " core(s) for " << dim << "x" << dim
-            << " grid with timestep " << dt << " for "
-            << *(snapshots.cend() - 1) / dt << " iterations...\n";
+            << " grid ";
+  if (solver == Solver::spectral) {
+    std::cout << "at " << snapshots.size()
+              << " snapshot time(s) using the spectral solver...\n";
+  } else {
+    std::cout << "with timestep " << dt << " for "
+              << *(snapshots.cend() - 1) / dt << " iterations using ";
+    if (solver == Solver::adi) {
+      std::cout << "the ADI solver...\n";
+    } else if (solver == Solver::multigrid) {
+      std::cout << "the multigrid solver...\n";
+    } else {
+      std::cout << SimdIsaName(DiffusionIsa()) << " kernels and "
+                << StorageFormatName(DiffusionStorage()) << " storage";
+      if (timeBlock > 1) {
+        std::cout << " in time blocks of " << timeBlock << " steps";
+      }
+      std::cout << "...\n";
+    }
+  }
+  // Write snapshots as soon as they are taken, excluding the time spent
+  // writing from the measurement. Paths ending in .txt or .csv are written as
+  // text, all others as binary snapshot files. A resumed run keeps the
+  // snapshots written before its checkpoint and replaces the rest.
+  const bool csv = IsCsvPath(outPath);
+  std::ofstream outputStream;
+  std::unique_ptr<SnapshotWriter> writer;
+  Timer writeTimer;
+  double elapsedWriting = 0;
+  auto writeSnapshot = [&](size_t index, float t, Grid_t const &grid) {
+    writeTimer.Start();
+    if (csv) {
+      if (!outputStream.is_open()) {
+        if (checkpointing.resume) {
+          TruncateCsv(outPath, index);
+        }
+        outputStream.open(outPath, checkpointing.resume ? std::ios::app
+                                                        : std::ios::trunc);
+        assert(outputStream.is_open());
+      }
+      WriteCsv(outputStream, grid[0], grid.rows(), grid.cols(), grid.stride());
+      // Flushed before the solver continues, so every snapshot taken before a
+      // checkpoint is in the file when the checkpoint is written
+      outputStream.flush();
+    } else {
+      if (writer == nullptr) {
+        writer.reset(new SnapshotWriter(outPath, SnapshotType::float32,
+                                        grid.rows(), grid.cols(), dt,
+                                        snapshots, checkpointing.resume));
+      }
+      writer->Write(index, t, grid[0], grid.stride());
+    }
+    elapsedWriting += writeTimer.Stop();
+  };
   auto start = std::chrono::system_clock::now();
-  auto results = Diffusion(nCores, dim, d, dt, snapshots);
+  if (solver == Solver::adi) {
+    DiffusionImplicit(nCores, dim, d, dt, snapshots, writeSnapshot);
+  } else if (solver == Solver::multigrid) {
+    DiffusionMultigrid(nCores, dim, d, dt, snapshots, writeSnapshot);
+  } else if (solver == Solver::spectral) {
+    DiffusionSpectral(nCores, dim, d, snapshots, writeSnapshot);
+  } else if (timeBlock > 1) {
+    DiffusionBlocked(nCores, dim, d, dt, snapshots, timeBlock, writeSnapshot);
+  } else {
+    Diffusion(nCores, dim, d, dt, snapshots, writeSnapshot);
+  }
   auto elapsed = 1e-6 *
                  std::chrono::duration_cast<std::chrono::microseconds>(
                      std::chrono::system_clock::now() - start)
-                     .count();
+                     .count() -
+                 elapsedWriting;
   std::cout << "Finished in " << elapsed << " seconds." << std::endl;
-  for (auto &grid : results) {
-    for (auto &row : grid) {
-      std::copy(row.cbegin(), row.cend()-1,
-                std::ostream_iterator<float>(outputStream, ","));
-      outputStream << *(row.cend()-1) << "\n";
-    }
-    outputStream << "\n";
-  }
   return 0;
 }
 
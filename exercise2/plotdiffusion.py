@@ -1,17 +1,17 @@
 #!/usr/bin/env python3
 import matplotlib.pyplot as plt
-import numpy as np
+import os
 import sys
 
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                os.pardir, "snapshot"))
+from snapshotfile import read_snapshots
+
 if len(sys.argv) < 2 or len(sys.argv) > 3:
   print("Usage: <path to input file> [<path to output image file>]")
   sys.exit(1)
 
-data = np.loadtxt(sys.argv[1], delimiter=",")
-dim = data.shape[1];
-snapshots = []
-for i in range(int(data.shape[0] / dim)):
-  snapshots.append(data[i*dim:(i+1)*dim, :])
+_, snapshots = read_snapshots(sys.argv[1])
 if len(snapshots) != 4:
   print("Expected 4 snapshots, but received {}.".format(len(snapshots)))
   sys.exit(1)
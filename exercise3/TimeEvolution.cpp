@@ -21,30 +21,27 @@ int main(const int argc, char const *const argv[]) {
   for (unsigned i = 0; i < nSamples; ++i) {
     samples.emplace_back(i*tPerSample);
   }
-  // std::vectorception...
+  // Reduce each snapshot to N and mu^2 as soon as it is taken
   const std::vector<float> ds{1, 2, 5};
-  std::vector<std::vector<Grid_t>> results;
-  for (auto &d : ds) {
-    std::cout << "Running diffusion for D = " << d << "...\n";
-    results.emplace_back(Diffusion(nCores, 128, d, 1e-5, samples));
-  }
   std::vector<std::vector<float>> n(3, std::vector<float>(nSamples));
   std::vector<std::vector<float>> mu(n);
   for (size_t i = 0, iEnd = ds.size(); i < iEnd; ++i) {
-    std::cout << "Computing N and mu^2 for D = " << ds[i] << "...\n";
-    #pragma omp parallel for
-    for (size_t j = 0; j < nSamples; ++j) {
-      float nSum = 0;
-      float muSum = 0;
-      for (size_t x = 0, xEnd = results[i][j].size(); x < xEnd; ++x) {
-        for (size_t y = 0, yEnd = results[i][j][x].size(); y < yEnd; ++y) {
-          nSum  += results[i][j][x][y];
-          muSum += results[i][j][x][y]*(x*x + y*y);
-        }
-      } 
-      n[i][j] = nSum;
-      mu[i][j] = muSum;
-    }
+    std::cout << "Running diffusion and computing N and mu^2 for D = " << ds[i]
+              << "...\n";
+    Diffusion(nCores, 128, ds[i], 1e-5, samples,
+              [&n, &mu, i](size_t j, float, Grid_t const &grid) {
+                float nSum = 0;
+                float muSum = 0;
+                #pragma omp parallel for reduction(+ : nSum, muSum)
+                for (int x = 0; x < grid.rows(); ++x) {
+                  for (int y = 0, yEnd = grid.cols(); y < yEnd; ++y) {
+                    nSum  += grid[x][y];
+                    muSum += grid[x][y]*(x*x + y*y);
+                  }
+                }
+                n[i][j] = nSum;
+                mu[i][j] = muSum;
+              });
   }
   std::ofstream outfile(path);
   for (size_t i = 0, iEnd = ds.size(); i < iEnd; ++i) {
@@ -1,22 +1,57 @@
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <fstream>
 #include <iostream>
-#include <iterator>
+#include <memory>
+#include <string>
 #include <mpi.h>
+#include "common/Mpi.h"
+#include "common/Timer.h"
 #include "diffusion/DiffusionMPI.h"
+#include "snapshot/SnapshotFile.h"
 
 using namespace hpcse;
 
 int main(int argc, char const *argv[]) {
+  // Halo exchange overlaps with computing the interior and goes through shared
+  // memory between ranks on the same node unless disabled, and halos are
+  // exchanged every step unless a deeper ghost region is requested. Cells are
+  // stored in single precision unless a 16-bit format is requested
+  bool overlap = true;
+  bool sharedMemory = true;
+  unsigned ghostWidth = 1;
+  std::string tracePath;
+  for (; argc > 1 && std::string(argv[1]).compare(0, 2, "--") == 0;
+       --argc, ++argv) {
+    const std::string flag(argv[1]);
+    if (flag == "--no-overlap") {
+      overlap = false;
+    } else if (flag == "--no-shared") {
+      sharedMemory = false;
+    } else if (flag.compare(0, 10, "--storage=") == 0) {
+      SetDiffusionStorage(ParseStorageFormat(flag.substr(10)));
+    } else if (flag.compare(0, 8, "--ghost=") == 0) {
+      ghostWidth = std::stoi(flag.substr(8));
+    } else if (flag.compare(0, 8, "--trace=") == 0) {
+      tracePath = flag.substr(8);
+    } else {
+      argc = 0;
+      break;
+    }
+  }
   if (argc < 6) {
-    std::cerr << "Usage: <diffusion constant> <grid dimension> "
-                 "<timestep> <output file> <time for "
-                 "snapshot...>"
+    std::cerr << "Usage: [--no-overlap] [--no-shared] [--ghost=<width>] "
+                 "[--storage=float32|float16|bfloat16] [--trace=<Chrome trace "
+                 "file>] <diffusion constant> <grid dimension> <timestep> "
+                 "<output file> <time for snapshot...>"
               << std::endl;
     return 1;
   }
-  assert(MPI_Init(nullptr, nullptr) == MPI_SUCCESS);
+  if (MPI_Init(nullptr, nullptr) != MPI_SUCCESS) {
+    std::cerr << "Failed to initialize MPI." << std::endl;
+    return 1;
+  }
   float d = std::stof(argv[1]);
   unsigned dim = std::stoi(argv[2]);
   float dt = std::stof(argv[3]);
@@ -32,52 +67,96 @@ int main(int argc, char const *argv[]) {
     std::cout << "Running on " << nRanks << " thread(s) for " << dim << "x" << dim
               << " grid with timestep " << dt << " for "
               << *(timeToRecord.cend() - 1) / dt << " iterations...\n";
+    // A step changes values of order one by about d * dt, which 16-bit
+    // storage only resolves on average
+    const StorageFormat storage = DiffusionStorage();
+    if (storage != StorageFormat::float32 && d * dt < UnitRoundoff(storage)) {
+      std::cerr << "Warning: updates of about " << d * dt
+                << " per step are below the rounding error of "
+                << StorageFormatName(storage) << " storage ("
+                << UnitRoundoff(storage)
+                << ") and only take effect through stochastic rounding. "
+                   "Expect deviations from float32 of a few tenths of a "
+                   "percent with float16 and about one percent with "
+                   "bfloat16." << std::endl;
+    }
   }
-  auto start = std::chrono::system_clock::now();
-  auto snapshots = DiffusionRows(dim, d, dt, timeToRecord);
-  auto elapsedInner = 1e-6 *
-                      std::chrono::duration_cast<std::chrono::microseconds>(
-                          std::chrono::system_clock::now() - start)
-                          .count();
-  if (rank != 0) {
-    for (auto &s : snapshots) {
-      for (auto row = s.begin()+1, rowEnd = s.end()-1; row != rowEnd; ++row) {
-        MPI_Ssend(row->data(), dim, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
-      }
+  // Gather and write each snapshot as soon as it is taken, keeping track of
+  // the time spent gathering and writing
+  std::ofstream outputStream;
+  std::unique_ptr<SnapshotWriter> writer;
+  Grid_t result;
+  if (rank == 0) {
+    if (IsCsvPath(outPath)) {
+      outputStream.open(outPath);
+      assert(outputStream.is_open());
+    } else {
+      writer.reset(new SnapshotWriter(outPath, SnapshotType::float32, dim, dim,
+                                      dt, timeToRecord));
     }
-  } else {
-    // Gather results
-    std::vector<Grid_t> results(snapshots.size(), Grid_t(dim, Row_t(dim, 0)));
-    for (int i = 0, iMax = snapshots.size(); i < iMax; ++i) {
-      for (unsigned j = 0, jEnd = snapshots[i].size()-2; j < jEnd; ++j) {
-        results[i][j] = std::move(snapshots[i][j+1]);
+    result = Grid_t(dim, dim);
+  }
+  Timer sinkTimer;
+  double elapsedGather = 0;
+  double elapsedWriting = 0;
+  auto gatherSnapshot = [&](size_t index, float t, Grid_t const &local) {
+    sinkTimer.Start();
+    if (rank != 0) {
+      for (int i = 0, iEnd = local.rows(); i < iEnd; ++i) {
+        MPI_Ssend(local[i], dim, MPI_FLOAT, 0, 0, MPI_COMM_WORLD);
       }
-      for (int j = 1; j < nRanks; ++j) {
-        const unsigned rowBegin = dim*j/nRanks;
-        const unsigned rowEnd = dim*(j+1)/nRanks;
-        const unsigned nRows = rowEnd - rowBegin;
-        for (unsigned k = 0; k < nRows; ++k) {
-          assert(MPI_Recv(results[i][rowBegin + k].data(), dim, MPI_FLOAT, j, 0,
-                          MPI_COMM_WORLD, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+      elapsedGather += sinkTimer.Stop();
+      return;
+    }
+    for (int j = 0, jEnd = local.rows(); j < jEnd; ++j) {
+      std::copy(local[j], local[j] + dim, result[j]);
+    }
+    for (int j = 1; j < nRanks; ++j) {
+      const unsigned rowBegin = dim*j/nRanks;
+      const unsigned rowEnd = dim*(j+1)/nRanks;
+      const unsigned nRows = rowEnd - rowBegin;
+      for (unsigned k = 0; k < nRows; ++k) {
+        // Received outside of any assert, which NDEBUG would compile out and
+        // leave the sending ranks blocked
+        if (MPI_Recv(result[rowBegin + k], dim, MPI_FLOAT, j, 0,
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+          std::cerr << "Failed to receive row " << rowBegin + k
+                    << " from rank " << j << "." << std::endl;
+          MPI_Abort(MPI_COMM_WORLD, 1);
         }
       }
     }
-    auto elapsedOuter = 1e-6 *
-                   std::chrono::duration_cast<std::chrono::microseconds>(
-                       std::chrono::system_clock::now() - start)
-                       .count();
-    std::cout << "Finished in " << elapsedOuter << " (" << elapsedInner
-              << ") seconds.\n";
-    std::ofstream outputStream(outPath);
-    assert(outputStream.is_open());
-    for (auto &grid : results) {
-      for (auto &row : grid) {
-        std::copy(row.cbegin(), row.cend()-1,
-                  std::ostream_iterator<float>(outputStream, ","));
-        outputStream << *(row.cend()-1) << "\n";
-      }
-      outputStream << "\n";
+    elapsedGather += sinkTimer.Stop();
+    sinkTimer.Start();
+    if (writer != nullptr) {
+      writer->Write(index, t, result[0], result.stride());
+    } else {
+      WriteCsv(outputStream, result[0], result.rows(), result.cols(),
+               result.stride());
     }
+    elapsedWriting += sinkTimer.Stop();
+  };
+  if (!tracePath.empty()) {
+    if (!kTraceCompiled && rank == 0) {
+      std::cerr << "Warning: built without HPCSE_TRACE, so the trace will be "
+                   "empty." << std::endl;
+    }
+    Tracer::Get().Enable();
+  }
+  auto start = std::chrono::system_clock::now();
+  DiffusionRows(dim, d, dt, timeToRecord, gatherSnapshot, overlap, ghostWidth,
+                sharedMemory);
+  auto elapsedOuter = 1e-6 *
+                      std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::system_clock::now() - start)
+                          .count() -
+                      elapsedWriting;
+  if (rank == 0) {
+    std::cout << "Finished in " << elapsedOuter << " ("
+              << elapsedOuter - elapsedGather << ") seconds.\n";
+  }
+  if (!tracePath.empty()) {
+    mpi::WriteTrace(tracePath);
   }
   MPI_Finalize();
   return 0;
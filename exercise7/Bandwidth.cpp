@@ -4,6 +4,7 @@
 #include <functional>
 #include <iostream>
 #include <string>
+#include "common/PerfCounters.h"
 #include "common/Timer.h"
 #include "immintrin.h"
 
@@ -29,6 +30,10 @@ int main(int argc, char const *argv[]) {
     return 1;
   }
   const size_t iMax =  std::stol(argv[1]);
+  // Traffic is assumed to be the buffer size. Where hardware counters are
+  // available, the traffic measured from last level cache misses is reported
+  // as well, which differs once the buffers fit in cache
+  PerfCounters counters;
   for (int i = 2; i < argc; ++i) {
     const size_t memSize = std::stol(argv[i]);
     const size_t numFloats = memSize/4;
@@ -37,17 +42,24 @@ int main(int argc, char const *argv[]) {
     auto doCopy = [&](std::function<void(size_t, float[], float[])> const &f,
                       std::string const &name) {
       float *tgt = new float[numFloats];
+      counters.Start();
       Timer timer;
       for (size_t i = 0; i < iMax; ++i) {
         f(numFloats, src, tgt);
       }
       double elapsed = timer.Stop();
+      counters.Stop();
       for (size_t i = 0; i < numFloats; ++i) {
         assert(tgt[i] == 1);
       }
       double elapsedAvg = elapsed / iMax;
       std::cout << name << ": " << memSize << "B done in " << elapsedAvg
-                << " seconds: " << 1e-9 * memSize / elapsedAvg << " GB/s.\n";
+                << " seconds: " << 1e-9 * memSize / elapsedAvg << " GB/s";
+      if (counters.Has("memory_bytes")) {
+        const double bytes = counters.Get("memory_bytes");
+        std::cout << " (" << 1e-9 * bytes / elapsed << " GB/s measured)";
+      }
+      std::cout << ".\n";
       delete[] tgt;
     };
     doCopy(CopyLoop, "Loop");
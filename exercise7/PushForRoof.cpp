@@ -2,6 +2,7 @@
 #include <cassert>
 #include <functional>
 #include <iostream>
+#include "common/PerfCounters.h"
 #include "common/Timer.h"
 #include "immintrin.h"
 #ifdef HPCSE_USE_VC
@@ -155,16 +156,38 @@ int main(int argc, char const *argv[]) {
   float source[elementsPerRun] __attribute__((aligned(64)));
   std::fill(source, source+elementsPerRun, 1.);
 
-  auto runBenchmark = [&source, iMax, nFlops, nBytes](
+  // Operation and byte counts above are assumed from the source. Where
+  // hardware counters are available, the measured counts are reported as well
+  PerfCounters counters;
+  auto runBenchmark = [&source, &counters, iMax, nFlops, nBytes](
       std::string const &name,
       std::function<double(size_t, const float[], float[])> const &f) {
     float target[elementsPerRun] __attribute__((aligned(64)));
     std::fill(target, target+elementsPerRun, 0.);
+    counters.Start();
     double elapsed = f(iMax, source, target);
+    counters.Stop();
     VerifyOutput(iMax, target);
     std::cout << name << ":\n  " << 1e-9 * (nFlops / elapsed) << " GFLOPS\n  "
               << 1e-9 * (nBytes / elapsed) << " GB/s\n";
+    if (counters.Has("flops")) {
+      const double flops = counters.Get("flops");
+      std::cout << "  " << 1e-9 * (flops / elapsed) << " GFLOPS measured\n";
+    }
+    if (counters.Has("memory_bytes")) {
+      const double bytes = counters.Get("memory_bytes");
+      std::cout << "  " << 1e-9 * (bytes / elapsed)
+                << " GB/s measured from memory\n";
+    }
+    if (counters.Has("ipc")) {
+      const double ipc = counters.Get("ipc");
+      std::cout << "  " << ipc << " instructions per cycle\n";
+    }
   };
+  if (!counters.available()) {
+    std::cout << "Hardware counters unavailable, reporting assumed counts "
+                 "only.\n";
+  }
 
   runBenchmark("Vanilla", Vanilla);
   runBenchmark("Autovectorization", AutoVectorization);
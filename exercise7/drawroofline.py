@@ -1,8 +1,27 @@
 #!/usr/bin/env python3
+import json
 import matplotlib.pyplot as plt
 import numpy as np
 import sys
 
+# Benchmark results written by RunBenchmarks are given as .json files, and
+# kernels with measured operations and memory traffic are placed at their
+# measured intensity. Any other argument is the output image
+benchmarkPaths = [arg for arg in sys.argv[1:] if arg.endswith(".json")]
+outputPaths = [arg for arg in sys.argv[1:] if not arg.endswith(".json")]
+measured = []
+for path in benchmarkPaths:
+  with open(path) as benchmarkFile:
+    for benchmark in json.load(benchmarkFile)["benchmarks"]:
+      counters = benchmark.get("counters", {})
+      if "flops" in counters and counters.get("memory_bytes", 0) > 0:
+        measured.append((benchmark["name"],
+                         counters["flops"]/counters["memory_bytes"],
+                         1e-9*counters["flops"]/
+                         benchmark["seconds"]["median"]))
+if len(benchmarkPaths) > 0 and len(measured) == 0:
+  print("No benchmarks with measured FLOP and memory counters found.")
+
 nSamples = 10000
 peakFlops = 576
 peakMem = 59.7
@@ -24,14 +43,16 @@ ax.plot(np.array([diffusionFlop, diffusionFlop]),
 ax.plot(np.array([flopsPerByte[0], flopsPerByte[-1]]),
         np.array([peakAchieved, peakAchieved]),
         "--g", linewidth=2, label="Peak throughput achieved")
+for name, intensity, gflops in measured:
+  ax.plot(intensity, gflops, "o", markersize=8, label=name)
 ax.set_xscale("log", basex=2)
 ax.set_yscale("log")
 ax.set_xlabel("FLOP/B")
 ax.set_ylabel("GFLOP/s")
 ax.set_title("Roofline model for 24-core Ivy Bridge Euler node", fontsize=17)
 ax.legend(loc=4, fontsize=17)
-if len(sys.argv) > 1:
-  fig.savefig(sys.argv[1], bbox_inches="tight")
+if len(outputPaths) > 0:
+  fig.savefig(outputPaths[0], bbox_inches="tight")
 else:
   fig.show()
   input("Press enter to exit...")
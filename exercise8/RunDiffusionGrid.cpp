@@ -4,29 +4,58 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include "common/Decomposition.h"
 #include "common/Mpi.h"
 #include "common/Timer.h"
 #include "diffusion/DiffusionMPI.h"
+#include "snapshot/SnapshotFile.h"
 
 using namespace hpcse;
 
 int main(int argc, char *argv[]) {
 
-  mpi::Context context(argc, argv);
+  // Threads within a rank leave all communication to the master thread
+  mpi::Context context(argc, argv, mpi::ThreadLevel::funneled);
 
-  if ((mpi::size() & 0x1) == 1) {
-    if (mpi::rank() == 0) {
-      std::cerr << "MPI must be run with an even number of ranks to form a "
-                   "cartesian grid.\n";
+  // Retrieve arguments
+  bool asyncIo = false;
+  unsigned ghostWidth = 1;
+  unsigned nThreads = 1;
+  // Halos of neighbors on the same node are read through shared memory
+  bool sharedMemory = true;
+  Checkpointing checkpointing;
+  std::string tracePath;
+  for (; argc > 1 && std::string(argv[1]).compare(0, 2, "--") == 0;
+       --argc, ++argv) {
+    const std::string flag(argv[1]);
+    if (flag == "--async-io") {
+      asyncIo = true;
+    } else if (flag.compare(0, 8, "--ghost=") == 0) {
+      ghostWidth = std::stoi(flag.substr(8));
+    } else if (flag.compare(0, 10, "--threads=") == 0) {
+      nThreads = std::stoi(flag.substr(10));
+    } else if (flag == "--no-shared") {
+      sharedMemory = false;
+    } else if (flag.compare(0, 13, "--checkpoint=") == 0) {
+      checkpointing.path = flag.substr(13);
+    } else if (flag.compare(0, 22, "--checkpoint-interval=") == 0) {
+      checkpointing.interval = std::stoi(flag.substr(22));
+    } else if (flag == "--resume") {
+      checkpointing.resume = true;
+    } else if (flag.compare(0, 8, "--trace=") == 0) {
+      tracePath = flag.substr(8);
+    } else {
+      argc = 0;
+      break;
     }
-    return 1;
   }
-
-  // Retrieve arguments
   if (argc < 6) {
     if (mpi::rank() == 0) {
-      std::cerr << "Usage: <diffusion constant> <grid dimension> "
-                   "<timestep> <output file> <time for "
+      std::cerr << "Usage: [--async-io] [--ghost=<width>] [--threads=<threads "
+                   "per rank>] [--no-shared] [--checkpoint=<path> "
+                   "[--checkpoint-interval=<steps>] [--resume]] "
+                   "[--trace=<Chrome trace file>] <diffusion constant> <grid "
+                   "dimension> <timestep> <output file> <time for "
                    "snapshot...>"
                 << std::endl;
     }
@@ -40,29 +69,68 @@ int main(int argc, char *argv[]) {
   for (int i = 5; i < argc; ++i) {
     timeToRecord.push_back(std::stof(argv[i]));
   }
+  SetDiffusionCheckpointing(checkpointing);
+  if (!tracePath.empty()) {
+    if (!kTraceCompiled && mpi::rank() == 0) {
+      std::cerr << "Warning: built without HPCSE_TRACE, so the trace will be "
+                   "empty." << std::endl;
+    }
+    Tracer::Get().Enable();
+  }
 
   if (mpi::rank() == 0) {
-    std::cout << "Running on " << mpi::size() << " thread(s) for " << dim << "x"
-              << dim << " grid with timestep " << dt << " for "
+    std::cout << "Running on " << mpi::size() << " rank(s) with " << nThreads
+              << " thread(s) each for " << dim << "x" << dim
+              << " grid with timestep " << dt << " for "
               << *(timeToRecord.cend() - 1) / dt << " iterations...\n";
+    // Same decomposition as chosen by DiffusionGrid
+    const auto decomposition = Decompose<2>(
+        mpi::size(), {{static_cast<int>(dim), static_cast<int>(dim)}});
+    std::cout << "Process grid is " << decomposition.ranks[0] << "x"
+              << decomposition.ranks[1] << " with an expected imbalance of "
+              << 100 * decomposition.imbalance << "%.\n";
   }
 
   Timer timer;
-  auto snapshots = DiffusionGrid(dim, d, dt, timeToRecord);
-  double elapsed = timer.Stop();
+  double elapsedWriting = 0;
+  if (IsCsvPath(outPath)) {
+    // The sink is only called on rank 0, which writes each snapshot as soon
+    // as it has been gathered. A resumed run keeps the snapshots written
+    // before its checkpoint and replaces the rest
+    std::ofstream outputStream;
+    Timer writeTimer;
+    auto writeSnapshot = [&](size_t index, float, Grid_t const &grid) {
+      writeTimer.Start();
+      if (!outputStream.is_open()) {
+        if (checkpointing.resume) {
+          TruncateCsv(outPath, index);
+        }
+        outputStream.open(outPath, checkpointing.resume ? std::ios::app
+                                                        : std::ios::trunc);
+        assert(outputStream.is_open());
+      }
+      WriteCsv(outputStream, grid[0], grid.rows(), grid.cols(), grid.stride());
+      // Snapshots preceding a checkpoint must survive an interruption
+      outputStream.flush();
+      elapsedWriting += writeTimer.Stop();
+    };
+    timer.Start();
+    DiffusionGrid(dim, d, dt, timeToRecord, writeSnapshot, ghostWidth,
+                  nThreads, sharedMemory);
+  } else {
+    // Binary snapshots are written by all ranks in parallel, and the time
+    // spent writing is included in the measurement
+    timer.Start();
+    DiffusionGrid(dim, d, dt, timeToRecord, outPath, asyncIo, ghostWidth,
+                  nThreads, sharedMemory);
+  }
+  double elapsed = timer.Stop() - elapsedWriting;
 
   if (mpi::rank() == 0) {
     std::cout << "Finished in " << elapsed << " seconds.\n";
-    std::ofstream outputStream(outPath);
-    assert(outputStream.is_open());
-    for (auto &grid : snapshots) {
-      for (auto &row : grid) {
-        std::copy(row.cbegin(), row.cend()-1,
-                  std::ostream_iterator<float>(outputStream, ","));
-        outputStream << *(row.cend()-1) << "\n";
-      }
-      outputStream << "\n";
-    }
+  }
+  if (!tracePath.empty()) {
+    mpi::WriteTrace(tracePath);
   }
 
   return 0;
@@ -1,13 +1,16 @@
 #pragma once
 
 #include <vector>
+#include "common/ThreadPool.h"
 
 namespace hpcse {
 
+/// Measurement steps are split across nCores tasks of the given pool.
 std::vector<float> RigidDisks(unsigned nCores, unsigned nx, unsigned ny,
                               float l, float d0Factor,
                               unsigned stepsEquilibrium, unsigned steps,
-                              unsigned nBins);
+                              unsigned nBins,
+                              ThreadPool &pool = ThreadPool::Default());
 
 std::vector<float> RigidDisks(unsigned nx, unsigned ny, float l, float d0Factor,
                               unsigned stepsEquilibrium, unsigned steps,
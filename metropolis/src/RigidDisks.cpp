@@ -3,10 +3,12 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <functional>
 #include <future>
 #include <iostream>
 #include <random>
 #include <utility>
+#include "common/Timer.h"
 
 namespace hpcse {
 
@@ -17,7 +19,8 @@ std::vector<float> RigidDisks(const unsigned nThreads, const unsigned nx,
                               const unsigned ny, const float l,
                               const float diameterFactor,
                               const unsigned stepsEquilibrium,
-                              const unsigned steps, const unsigned nBins) {
+                              const unsigned steps, const unsigned nBins,
+                              ThreadPool &pool) {
 
   auto startTotal = std::chrono::system_clock::now();
 
@@ -52,6 +55,7 @@ std::vector<float> RigidDisks(const unsigned nThreads, const unsigned nx,
       std::mt19937 &rngDisplacement,
       std::uniform_int_distribution<size_t> &uniformIndex,
       std::uniform_real_distribution<float> &uniformDisplacement) {
+    HPCSE_PROFILE_SCOPE("step");
     const auto iMoved = uniformIndex(rngIndex);
     std::pair<float, float> newPos = disks[iMoved];
     newPos.first += uniformDisplacement(rngDisplacement);
@@ -79,6 +83,7 @@ std::vector<float> RigidDisks(const unsigned nThreads, const unsigned nx,
 
   // Run to equilibrium
   for (unsigned i = 0; i < stepsEquilibrium; ++i) {
+    HPCSE_PROFILE_SCOPE("equilibrium sweep");
     for (unsigned j = 0; j < nTot; /* Only increment when successful */) {
       j += doStepSequential();
     }
@@ -93,9 +98,13 @@ std::vector<float> RigidDisks(const unsigned nThreads, const unsigned nx,
     const auto jEnd = disks.cend() - 1;
     const auto kEnd = disks.cend();
     for (unsigned i = 0; i < steps; ++i) {
-      for (unsigned j = 0; j < nTot; /* Only increment when successful */) {
-        j += doStepLocal();
+      {
+        HPCSE_PROFILE_SCOPE("measurement sweep");
+        for (unsigned j = 0; j < nTot; /* Only increment when successful */) {
+          j += doStepLocal();
+        }
       }
+      HPCSE_PROFILE_SCOPE("histogram");
       for (auto j = disks.cbegin(); j != jEnd; ++j) {
         // Compare only to other disks not already paired
         for (auto k = j + 1; k != kEnd; ++k) {
@@ -112,7 +121,7 @@ std::vector<float> RigidDisks(const unsigned nThreads, const unsigned nx,
   if (nThreads > 1) {
     std::vector<std::future<std::vector<float>>> futures;
     for (unsigned i = 0; i < nThreads; ++i) {
-      futures.emplace_back(std::async(std::launch::async, [&]() {
+      futures.emplace_back(pool.Submit([&, i]() {
         // Copy disks from each thread
         std::vector<std::pair<float, float>> localDisks(disks);
         // Initialize local RNGs
@@ -2,13 +2,16 @@
 /// \date September 2015
 
 #include <functional>
+#include "common/ThreadPool.h"
 
 namespace hpcse {
 
 double RiemannSequential(std::function<double(double)> const &f, double begin,
                          double end, const int n);
 
+/// Integrates each of nThreads subintervals as a task of the given pool.
 double RiemannParallel(std::function<double(double)> const &f, double begin,
-                       double end, const int n, const int nThreads);
+                       double end, const int n, const int nThreads,
+                       ThreadPool &pool = ThreadPool::Default());
 
 } // End namespace hpcse
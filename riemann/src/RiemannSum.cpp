@@ -25,14 +25,15 @@ double RiemannSequential(std::function<double(double)> const &f, double begin,
 }
 
 double RiemannParallel(std::function<double(double)> const &f, double begin,
-                       double end, const int n, const int nThreads) {
+                       double end, const int n, const int nThreads,
+                       ThreadPool &pool) {
   double threadStep = (end - begin) / static_cast<double>(nThreads);
   int threadN = n / nThreads;
   std::vector<std::future<double>> futures;
   for (int i = 0; i < nThreads; ++i) {
-    futures.push_back(std::async(std::launch::async, RiemannSequential, f,
-                                 begin + i * threadStep,
-                                 begin + (i + 1) * threadStep, threadN));
+    futures.push_back(pool.Submit(RiemannSequential, std::cref(f),
+                                  begin + i * threadStep,
+                                  begin + (i + 1) * threadStep, threadN));
   }
   double sum = 0;
   for (auto &f : futures) {
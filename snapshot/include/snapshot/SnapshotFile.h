@@ -0,0 +1,200 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date December 2015
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace hpcse {
+
+/// Binary snapshot file layout (native byte order):
+///
+///   [0, 64)                     SnapshotFileHeader
+///   [64, 64 + 8 * nSnapshots)   time of each snapshot as double
+///   [dataOffset, ...)           nSnapshots dense rows x cols payloads, each
+///                               starting snapshotBytes after the previous
+///
+/// dataOffset is page aligned and snapshotBytes is a multiple of 64, so every
+/// payload can be used in place after mapping the file into memory.
+enum class SnapshotType : std::uint32_t {
+  float32 = 0,
+  float64 = 1
+};
+
+struct SnapshotFileHeader {
+  char magic[8];
+  std::uint32_t version;
+  SnapshotType type;
+  std::uint64_t nSnapshots;
+  std::uint64_t rows;
+  std::uint64_t cols;
+  double timestep;
+  std::uint64_t dataOffset;
+  std::uint64_t snapshotBytes;
+};
+
+static_assert(sizeof(SnapshotFileHeader) == 64,
+              "Snapshot file header must be 64 bytes.");
+
+template <typename T> struct SnapshotTypeOf;
+
+template <> struct SnapshotTypeOf<float> {
+  static constexpr SnapshotType value = SnapshotType::float32;
+};
+
+template <> struct SnapshotTypeOf<double> {
+  static constexpr SnapshotType value = SnapshotType::float64;
+};
+
+/// Header for a file holding nSnapshots snapshots of the given shape, for
+/// writers that lay out the file themselves (e.g. with MPI-IO).
+SnapshotFileHeader MakeSnapshotHeader(SnapshotType type, size_t rows,
+                                      size_t cols, double timestep,
+                                      size_t nSnapshots);
+
+/// Total size in bytes of a complete file with the given header.
+std::uint64_t SnapshotFileSize(SnapshotFileHeader const &header);
+
+/// Returns true if the file at the given path starts with the snapshot magic.
+bool IsSnapshotFile(std::string const &path);
+
+/// Returns true for output paths ending in .txt or .csv, which the run
+/// executables write as comma-separated text rather than as snapshot files.
+bool IsCsvPath(std::string const &path);
+
+/// Writes a rows x cols snapshot as comma-separated text followed by an empty
+/// line. Row i is read from data + i * rowStride.
+template <typename T>
+void WriteCsv(std::ostream &stream, T const *data, size_t rows, size_t cols,
+              size_t rowStride);
+
+/// Truncates a file written with WriteCsv after its first nSnapshots
+/// snapshots, so that a run resumed from a checkpoint can append the rest.
+/// Throws std::runtime_error if the file holds fewer snapshots.
+void TruncateCsv(std::string const &path, size_t nSnapshots);
+
+/// Writes snapshots of a fixed shape to a binary snapshot file. The number of
+/// snapshots is fixed when the file is created, and snapshots can be written in
+/// any order as soon as they become available.
+class SnapshotWriter {
+
+public:
+  /// With resume set, an existing file with the same header is reopened
+  /// without discarding its snapshots, so that a run resumed from a checkpoint
+  /// can write the rest. Otherwise any existing file is replaced.
+  SnapshotWriter(std::string const &path, SnapshotType type, size_t rows,
+                 size_t cols, double timestep, std::vector<float> const &times,
+                 bool resume = false);
+
+  ~SnapshotWriter();
+
+  SnapshotWriter(SnapshotWriter const &) = delete;
+  SnapshotWriter &operator=(SnapshotWriter const &) = delete;
+
+  /// Writes snapshot number index taken at the given time. Row i of the
+  /// snapshot is read from data + i * rowStride.
+  template <typename T>
+  void Write(size_t index, double time, T const *data, size_t rowStride);
+
+  /// Writes a snapshot with contiguous rows.
+  template <typename T>
+  void Write(size_t index, double time, T const *data);
+
+  /// Pads the file to its full size and closes it. Called by the destructor.
+  void Close();
+
+private:
+  void WriteImpl(size_t index, double time, SnapshotType type,
+                 char const *data, size_t rowStrideBytes);
+
+  std::ofstream file_;
+  SnapshotFileHeader header_;
+};
+
+/// Read-only view of a snapshot file mapped into memory.
+class SnapshotReader {
+
+public:
+  /// Throws std::runtime_error if the file cannot be mapped or is not a valid
+  /// snapshot file.
+  explicit SnapshotReader(std::string const &path);
+
+  ~SnapshotReader();
+
+  SnapshotReader(SnapshotReader const &) = delete;
+  SnapshotReader &operator=(SnapshotReader const &) = delete;
+
+  inline size_t size() const;
+
+  inline size_t rows() const;
+
+  inline size_t cols() const;
+
+  inline SnapshotType type() const;
+
+  inline double timestep() const;
+
+  inline double Time(size_t index) const;
+
+  /// Pointer to the dense rows x cols payload of a snapshot. Throws
+  /// std::runtime_error if T does not match the stored type.
+  template <typename T>
+  T const *Data(size_t index) const;
+
+private:
+  void const *DataImpl(size_t index, SnapshotType type) const;
+
+  void *mapping_{nullptr};
+  size_t mappingSize_{0};
+  SnapshotFileHeader const *header_{nullptr};
+  double const *times_{nullptr};
+};
+
+template <typename T>
+void WriteCsv(std::ostream &stream, T const *data, const size_t rows,
+              const size_t cols, const size_t rowStride) {
+  for (size_t i = 0; i < rows; ++i, data += rowStride) {
+    std::copy(data, data + cols - 1, std::ostream_iterator<T>(stream, ","));
+    stream << data[cols - 1] << "\n";
+  }
+  stream << "\n";
+}
+
+template <typename T>
+void SnapshotWriter::Write(const size_t index, const double time,
+                           T const *data, const size_t rowStride) {
+  WriteImpl(index, time, SnapshotTypeOf<T>::value,
+            reinterpret_cast<char const *>(data), rowStride * sizeof(T));
+}
+
+template <typename T>
+void SnapshotWriter::Write(const size_t index, const double time,
+                           T const *data) {
+  Write(index, time, data, header_.cols);
+}
+
+size_t SnapshotReader::size() const { return header_->nSnapshots; }
+
+size_t SnapshotReader::rows() const { return header_->rows; }
+
+size_t SnapshotReader::cols() const { return header_->cols; }
+
+SnapshotType SnapshotReader::type() const { return header_->type; }
+
+double SnapshotReader::timestep() const { return header_->timestep; }
+
+double SnapshotReader::Time(const size_t index) const { return times_[index]; }
+
+template <typename T>
+T const *SnapshotReader::Data(const size_t index) const {
+  return reinterpret_cast<T const *>(
+      DataImpl(index, SnapshotTypeOf<T>::value));
+}
+
+} // End namespace hpcse
@@ -0,0 +1,42 @@
+"""Reads snapshots written by the run executables, either as binary snapshot
+files or as comma-separated text. Shared by the plotting scripts, which add
+this directory to their module search path."""
+import numpy as np
+
+
+def is_csv_path(path):
+  """Mirrors IsCsvPath of the snapshot library: paths ending in .txt or .csv
+  hold comma-separated text rather than a snapshot file."""
+  return path.endswith(".txt") or path.endswith(".csv")
+
+
+def read_snapshot_file(path):
+  """Returns (times, snapshots) from a binary snapshot file written by the
+  snapshot library, mapping the payload into memory."""
+  header = np.fromfile(path, dtype=np.dtype([
+      ("magic", "S8"), ("version", "u4"), ("type", "u4"), ("n", "u8"),
+      ("rows", "u8"), ("cols", "u8"), ("timestep", "f8"),
+      ("dataOffset", "u8"), ("snapshotBytes", "u8")]), count=1)[0]
+  if header["magic"] != b"HPCSESNP":
+    raise ValueError("{} is not a snapshot file.".format(path))
+  n, rows, cols = int(header["n"]), int(header["rows"]), int(header["cols"])
+  dtype = np.float32 if header["type"] == 0 else np.float64
+  times = np.fromfile(path, dtype=np.float64, count=n, offset=64)
+  stride = int(header["snapshotBytes"]) // np.dtype(dtype).itemsize
+  data = np.memmap(path, dtype=dtype, mode="r",
+                   offset=int(header["dataOffset"]), shape=(n, stride))
+  return times, data[:, :rows*cols].reshape(n, rows, cols)
+
+
+def read_snapshots(path, time_column=False):
+  """Returns (times, snapshots) with snapshots shaped (n, rows, cols), reading
+  text or binary depending on the path. Text written with a leading time
+  column holds one single-row snapshot per line, otherwise snapshots are
+  square blocks of lines without times, for which times is None."""
+  if not is_csv_path(path):
+    return read_snapshot_file(path)
+  data = np.loadtxt(path, delimiter=",", ndmin=2)
+  if time_column:
+    return data[:, 0], data[:, np.newaxis, 1:]
+  dim = data.shape[1]
+  return None, data[:data.shape[0] // dim * dim].reshape(-1, dim, dim)
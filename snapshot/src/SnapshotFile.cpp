@@ -0,0 +1,217 @@
+/// \author Johannes de Fine Licht (definelj@student.ethz.ch)
+/// \date December 2015
+
+#include "snapshot/SnapshotFile.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace hpcse {
+
+namespace {
+
+constexpr char kMagic[8] = {'H', 'P', 'C', 'S', 'E', 'S', 'N', 'P'};
+constexpr std::uint32_t kVersion = 1;
+constexpr std::uint64_t kDataAlignment = 4096;
+constexpr std::uint64_t kSnapshotAlignment = 64;
+
+inline std::uint64_t RoundUp(const std::uint64_t n,
+                             const std::uint64_t alignment) {
+  return ((n + alignment - 1) / alignment) * alignment;
+}
+
+inline std::uint64_t TypeSize(const SnapshotType type) {
+  return type == SnapshotType::float64 ? sizeof(double) : sizeof(float);
+}
+
+} // End anonymous namespace
+
+SnapshotFileHeader MakeSnapshotHeader(const SnapshotType type,
+                                      const size_t rows, const size_t cols,
+                                      const double timestep,
+                                      const size_t nSnapshots) {
+  SnapshotFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.type = type;
+  header.nSnapshots = nSnapshots;
+  header.rows = rows;
+  header.cols = cols;
+  header.timestep = timestep;
+  header.dataOffset = RoundUp(
+      sizeof(SnapshotFileHeader) + nSnapshots * sizeof(double),
+      kDataAlignment);
+  header.snapshotBytes =
+      RoundUp(rows * cols * TypeSize(type), kSnapshotAlignment);
+  return header;
+}
+
+std::uint64_t SnapshotFileSize(SnapshotFileHeader const &header) {
+  return header.dataOffset + header.nSnapshots * header.snapshotBytes;
+}
+
+bool IsSnapshotFile(std::string const &path) {
+  std::ifstream file(path, std::ios::binary);
+  char magic[sizeof(kMagic)];
+  return file.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+bool IsCsvPath(std::string const &path) {
+  auto hasSuffix = [&path](std::string const &suffix) {
+    return path.size() >= suffix.size() &&
+           path.compare(path.size() - suffix.size(), suffix.size(), suffix) ==
+               0;
+  };
+  return hasSuffix(".txt") || hasSuffix(".csv");
+}
+
+void TruncateCsv(std::string const &path, const size_t nSnapshots) {
+  std::ifstream file(path);
+  std::string line;
+  size_t nFound = 0;
+  while (nFound < nSnapshots && std::getline(file, line)) {
+    if (line.empty()) {
+      ++nFound;
+    }
+  }
+  if (nFound < nSnapshots) {
+    throw std::runtime_error(path + " holds fewer than " +
+                             std::to_string(nSnapshots) + " snapshots.");
+  }
+  const off_t length = nSnapshots > 0 ? static_cast<off_t>(file.tellg()) : 0;
+  file.close();
+  if (truncate(path.c_str(), length) != 0) {
+    throw std::runtime_error("Failed to truncate " + path + ".");
+  }
+}
+
+SnapshotWriter::SnapshotWriter(std::string const &path,
+                               const SnapshotType type, const size_t rows,
+                               const size_t cols, const double timestep,
+                               std::vector<float> const &times,
+                               const bool resume)
+    : file_(),
+      header_(MakeSnapshotHeader(type, rows, cols, timestep, times.size())) {
+  if (resume) {
+    std::ifstream existing(path, std::ios::binary);
+    SnapshotFileHeader previous;
+    if (existing.read(reinterpret_cast<char *>(&previous), sizeof(previous)) &&
+        std::memcmp(&previous, &header_, sizeof(header_)) == 0) {
+      existing.close();
+      file_.open(path, std::ios::binary | std::ios::in | std::ios::out);
+      if (file_.is_open()) {
+        return;
+      }
+    }
+  }
+  file_.open(path, std::ios::binary | std::ios::trunc);
+  if (!file_.is_open()) {
+    throw std::runtime_error("Failed to open snapshot file " + path + ".");
+  }
+  file_.write(reinterpret_cast<char const *>(&header_), sizeof(header_));
+  // Requested times are written up front and replaced by the actual time as
+  // each snapshot is written
+  std::vector<double> timesDouble(times.cbegin(), times.cend());
+  file_.write(reinterpret_cast<char const *>(timesDouble.data()),
+              timesDouble.size() * sizeof(double));
+}
+
+SnapshotWriter::~SnapshotWriter() { Close(); }
+
+void SnapshotWriter::WriteImpl(const size_t index, const double time,
+                               const SnapshotType type, char const *data,
+                               const size_t rowStrideBytes) {
+  if (type != header_.type) {
+    throw std::runtime_error("Snapshot type does not match file type.");
+  }
+  if (index >= header_.nSnapshots) {
+    throw std::out_of_range("Snapshot index out of range.");
+  }
+  file_.seekp(sizeof(SnapshotFileHeader) + index * sizeof(double));
+  file_.write(reinterpret_cast<char const *>(&time), sizeof(time));
+  file_.seekp(header_.dataOffset + index * header_.snapshotBytes);
+  const size_t rowBytes = header_.cols * TypeSize(type);
+  if (rowStrideBytes == rowBytes) {
+    file_.write(data, header_.rows * rowBytes);
+  } else {
+    for (size_t i = 0; i < header_.rows; ++i) {
+      file_.write(data + i * rowStrideBytes, rowBytes);
+    }
+  }
+  // Snapshots are passed on as soon as they are taken, so that they survive
+  // an interruption of the run
+  file_.flush();
+  if (!file_) {
+    throw std::runtime_error("Failed to write snapshot.");
+  }
+}
+
+void SnapshotWriter::Close() {
+  if (!file_.is_open()) {
+    return;
+  }
+  // Make sure the file covers the padding of the last snapshot, so readers
+  // can map every payload in full
+  const std::uint64_t fileSize = SnapshotFileSize(header_);
+  file_.seekp(0, std::ios::end);
+  if (static_cast<std::uint64_t>(file_.tellp()) < fileSize) {
+    file_.seekp(fileSize - 1);
+    file_.put(0);
+  }
+  file_.close();
+}
+
+SnapshotReader::SnapshotReader(std::string const &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open snapshot file " + path + ".");
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 ||
+      static_cast<size_t>(status.st_size) < sizeof(SnapshotFileHeader)) {
+    close(fd);
+    throw std::runtime_error(path + " is not a snapshot file.");
+  }
+  mappingSize_ = status.st_size;
+  mapping_ = mmap(nullptr, mappingSize_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping_ == MAP_FAILED) {
+    mapping_ = nullptr;
+    throw std::runtime_error("Failed to map snapshot file " + path + ".");
+  }
+  header_ = reinterpret_cast<SnapshotFileHeader const *>(mapping_);
+  times_ = reinterpret_cast<double const *>(header_ + 1);
+  if (std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header_->version != kVersion ||
+      SnapshotFileSize(*header_) > mappingSize_) {
+    munmap(mapping_, mappingSize_);
+    mapping_ = nullptr;
+    throw std::runtime_error(path + " is not a valid snapshot file.");
+  }
+}
+
+SnapshotReader::~SnapshotReader() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mappingSize_);
+  }
+}
+
+void const *SnapshotReader::DataImpl(const size_t index,
+                                     const SnapshotType type) const {
+  if (type != header_->type) {
+    throw std::runtime_error("Requested type does not match snapshot type.");
+  }
+  if (index >= header_->nSnapshots) {
+    throw std::out_of_range("Snapshot index out of range.");
+  }
+  return reinterpret_cast<char const *>(mapping_) + header_->dataOffset +
+         index * header_->snapshotBytes;
+}
+
+} // End namespace hpcse
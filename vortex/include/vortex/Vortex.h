@@ -1,11 +1,17 @@
 #pragma once
 
 #include <vector>
+#include "common/Checkpoint.h"
 
 namespace hpcse {
 
-std::vector<std::vector<double>> Vortex(int nParticlesTotal, double lineLength,
-                                        float timestep,
-                                        std::vector<float> const &timeToRecord);
+/// Checkpoints hold the positions and strengths of all vortices, the time, the
+/// step and the snapshots recorded so far. Every rank writes its own files at
+/// checkpointing.path.<rank>, and a resumed run returns the same snapshots as
+/// an uninterrupted run.
+std::vector<std::vector<double>>
+Vortex(int nParticlesTotal, double lineLength, float timestep,
+       std::vector<float> const &timeToRecord,
+       Checkpointing const &checkpointing = Checkpointing());
 
 } // End namespace hpcse
@@ -1,15 +1,20 @@
 #include <algorithm>
 #include <cmath>
 #include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
 #include "common/Mpi.h"
+#include "common/Trace.h"
 #include "vortex/Vortex.h"
 
 namespace hpcse {
 
 std::vector<std::vector<double>>
 Vortex(const int nParticlesTotal, const double lineLength, const float timestep,
-       std::vector<float> const &timeToRecord) {
+       std::vector<float> const &timeToRecord,
+       Checkpointing const &checkpointing) {
 
   // MPI range initialization
   const int mpiRank = mpi::rank();
@@ -61,9 +66,84 @@ Vortex(const int nParticlesTotal, const double lineLength, const float timestep,
   const auto allVelEnd = allVelocities.end();
   std::vector<MPI_Request> sendRequests(mpiSize - 1);
   std::vector<MPI_Request> receiveRequests(mpiSize - 1);
+
+  // Checkpoints are taken at the top of the loop, and only if every rank has
+  // finished writing the previous one, so that all ranks checkpoint the same
+  // steps. Positions are identical on all ranks after every step, but each
+  // rank keeps its own copy so that restarting needs no communication
+  std::unique_ptr<CheckpointStore> checkpoints;
+  long step = 0;
+  long nextCheckpoint = checkpointing.interval;
+  auto putParameters = [&](CheckpointState &state) {
+    state.Put(nParticlesTotal);
+    state.Put(lineLength);
+    state.Put(timestep);
+    state.Put(mpiSize);
+    state.Put(timeToRecord.size());
+    state.Put(timeToRecord.data(), timeToRecord.size());
+  };
+  if (!checkpointing.path.empty()) {
+    checkpoints.reset(new CheckpointStore(checkpointing.path + "." +
+                                          std::to_string(mpiRank)));
+    const long latest =
+        checkpointing.resume
+            ? mpi::AllReduce<mpi::Op::min>(checkpoints->Latest())
+            : -1;
+    if (latest >= 0) {
+      if (!checkpoints->Load(latest)) {
+        throw std::runtime_error("Checkpoint of step " +
+                                 std::to_string(latest) +
+                                 " is missing on rank " +
+                                 std::to_string(mpiRank) + ".");
+      }
+      CheckpointState &state = checkpoints->state();
+      CheckpointState expected;
+      putParameters(expected);
+      state.Expect(expected.bytes().data(), expected.bytes().size(),
+                   "configuration");
+      currentTime = state.Get<float>();
+      const size_t nRecorded = state.Get<size_t>();
+      step = state.Get<long>();
+      state.Get(allPositions.data(), allPositions.size());
+      state.Get(allStrengths.data(), allStrengths.size());
+      for (size_t i = 0; i < nRecorded && mpiRank == 0; ++i) {
+        state.Get(positionSnapshots[i].data(), positionSnapshots[i].size());
+      }
+      recordItr += nRecorded;
+      outputItr += nRecorded;
+      nextCheckpoint = step + checkpointing.interval;
+    } else {
+      checkpoints->Remove();
+    }
+  }
+  auto checkpoint = [&]() {
+    if (checkpoints == nullptr || checkpointing.interval == 0 ||
+        step < nextCheckpoint ||
+        mpi::AllReduce<mpi::Op::min>(
+            static_cast<int>(checkpoints->Idle())) == 0) {
+      return;
+    }
+    HPCSE_TRACE_SCOPE("checkpoint");
+    CheckpointState &state = checkpoints->Prepare();
+    putParameters(state);
+    const size_t nRecorded = recordItr - timeToRecord.cbegin();
+    state.Put(currentTime);
+    state.Put(nRecorded);
+    state.Put(step);
+    state.Put(allPositions.data(), allPositions.size());
+    state.Put(allStrengths.data(), allStrengths.size());
+    for (size_t i = 0; i < nRecorded && mpiRank == 0; ++i) {
+      state.Put(positionSnapshots[i].data(), positionSnapshots[i].size());
+    }
+    checkpoints->Commit(step);
+    nextCheckpoint = step + checkpointing.interval;
+  };
+
   while (true) {
+    checkpoint();
     if (currentTime >= *recordItr) {
       if (mpiRank == 0) {
+        HPCSE_TRACE_SCOPE("snapshot copy");
         std::copy(posBegin, posEnd, outputItr->begin());
       }
       if (++recordItr == recordItrEnd) {
@@ -72,12 +152,15 @@ Vortex(const int nParticlesTotal, const double lineLength, const float timestep,
       ++outputItr;
     }
     // Compute local contributions to all global velocities
-    std::fill(allVelBegin, allVelEnd, 0);
-    for (int i = 0; i < nParticlesTotal; ++i) {
-      for (int j = begin; j < end; ++j) {
-        if (i != j) {
-          allVelocities[i] +=
-              allStrengths[j] / (allPositions[i] - allPositions[j]);
+    {
+      HPCSE_TRACE_SCOPE("compute");
+      std::fill(allVelBegin, allVelEnd, 0);
+      for (int i = 0; i < nParticlesTotal; ++i) {
+        for (int j = begin; j < end; ++j) {
+          if (i != j) {
+            allVelocities[i] +=
+                allStrengths[j] / (allPositions[i] - allPositions[j]);
+          }
         }
       }
     }
@@ -93,11 +176,16 @@ Vortex(const int nParticlesTotal, const double lineLength, const float timestep,
         --iRecv;
       }
     }
-    // Receive and update velocity from one process at a time
-    for (int i = 0, iMax = receiveRequests.size(); i < iMax; ++i) {
-      mpi::Wait(receiveRequests[i]);
-      for (int j = begin, jBuff = i * nParticles; j < end; ++j, ++jBuff) {
-        allVelocities[j] += velocityBuffer[jBuff];
+    // Receive and update velocity from one process at a time. Requests are
+    // stored in the reverse order of their buffers
+    {
+      HPCSE_TRACE_SCOPE("velocity wait");
+      for (int i = 0, iMax = receiveRequests.size(); i < iMax; ++i) {
+        mpi::Wait(receiveRequests[i]);
+        for (int j = begin, jBuff = (iMax - 1 - i) * nParticles; j < end;
+             ++j, ++jBuff) {
+          allVelocities[j] += velocityBuffer[jBuff];
+        }
       }
     }
     // Update positions
@@ -106,10 +194,17 @@ Vortex(const int nParticlesTotal, const double lineLength, const float timestep,
       allPositions[i] += twoPiInv * timestep * allVelocities[i];
     }
     // Get updated positions
-    mpi::GatherAll(posBegin, posEnd, allPosBegin, nParticlesAll, beginAll);
+    {
+      HPCSE_TRACE_SCOPE("gather");
+      mpi::GatherAll(posBegin, posEnd, allPosBegin, nParticlesAll, beginAll);
+    }
     // Finalize sends
-    mpi::WaitAll(sendRequests);
+    {
+      HPCSE_TRACE_SCOPE("send wait");
+      mpi::WaitAll(sendRequests);
+    }
     currentTime += timestep;
+    ++step;
   }
 
   return positionSnapshots;